@@ -14,10 +14,88 @@
 
 #include <linux/buffer_head.h>
 #include <linux/bitops.h>
+#include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/random.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
 #include "sfs.h"
 
-static DEFINE_SPINLOCK(bitmap_lock);
+/*
+ * Every bitmap block is an allocation group with its own lock.  Searches
+ * without a goal start in a group picked by the calling task, so parallel
+ * allocators mostly work in different groups.
+ */
+static inline unsigned int sfs_task_group(unsigned int ngroups)
+{
+	return task_pid_nr(current) % ngroups;
+}
+
+int sfs_summary_init(struct sfs_summary *sm, unsigned int groups)
+{
+	unsigned int words = BITS_TO_LONGS(groups);
+
+	sm->sm_groups = kmalloc(words * sizeof(long), GFP_KERNEL);
+	sm->sm_words = kmalloc(BITS_TO_LONGS(words) * sizeof(long), GFP_KERNEL);
+	if (!sm->sm_groups || !sm->sm_words) {
+		sfs_summary_free(sm);
+		return -ENOMEM;
+	}
+	/* nothing is known to be full until a search says so */
+	bitmap_fill(sm->sm_groups, groups);
+	bitmap_fill(sm->sm_words, words);
+	sm->sm_count = groups;
+	spin_lock_init(&sm->sm_lock);
+	return 0;
+}
+
+void sfs_summary_free(struct sfs_summary *sm)
+{
+	kfree(sm->sm_groups);
+	kfree(sm->sm_words);
+	sm->sm_groups = sm->sm_words = NULL;
+}
+
+/* Both are called under the group lock, so they are ordered per group */
+static void summary_set(struct sfs_summary *sm, unsigned int g)
+{
+	if (test_bit(g, sm->sm_groups))
+		return;
+	spin_lock(&sm->sm_lock);
+	set_bit(g, sm->sm_groups);
+	set_bit(g / BITS_PER_LONG, sm->sm_words);
+	spin_unlock(&sm->sm_lock);
+}
+
+static void summary_clear(struct sfs_summary *sm, unsigned int g)
+{
+	spin_lock(&sm->sm_lock);
+	clear_bit(g, sm->sm_groups);
+	if (!sm->sm_groups[g / BITS_PER_LONG])
+		clear_bit(g / BITS_PER_LONG, sm->sm_words);
+	spin_unlock(&sm->sm_lock);
+}
+
+/* First group at or after @g, wrapping, that may have room; -1 if none */
+static int summary_next(struct sfs_summary *sm, unsigned int g)
+{
+	unsigned int nwords = BITS_TO_LONGS(sm->sm_count), w, n;
+	unsigned long bits;
+
+	if (g >= sm->sm_count)
+		g = 0;
+	w = g / BITS_PER_LONG;
+	bits = ACCESS_ONCE(sm->sm_groups[w]) & (~0UL << (g % BITS_PER_LONG));
+	for (n = 0; !bits && n < nwords; n++) {
+		w = find_next_bit(sm->sm_words, nwords, w + 1);
+		if (w >= nwords)
+			w = find_first_bit(sm->sm_words, nwords);
+		if (w >= nwords)
+			return -1;
+		bits = ACCESS_ONCE(sm->sm_groups[w]);
+	}
+	return bits ? w * BITS_PER_LONG + __ffs(bits) : -1;
+}
 
 /*
  * bitmap consists of blocks filled with 16bit words
@@ -39,65 +117,510 @@ static __u32 count_free(struct buffer_head *map[], unsigned blocksize, __u32 num
 	return sum;
 }
 
-void sfs_free_block(struct inode *inode, unsigned long block)
+/*
+ * Free @count blocks from @bit on, all inside bitmap block @idx.  With
+ * @busy they are cleared in the bitmap but kept reserved, out of the
+ * tree, and 1 is returned; a group without a tree frees them outright.
+ * With a journal the commit of the transaction releases them.
+ */
+static int free_run(struct super_block *sb, unsigned long idx,
+		    unsigned long bit, unsigned long count, int busy)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_group_info *grp = &sbi->s_groups[idx];
+	struct buffer_head *bh = sbi->s_bam_bh[idx];
+	unsigned long *map = (unsigned long *)bh->b_data;
+	struct sfs_free_extent *spare;
+	unsigned long i, freed = 0;
+	handle_t *handle;
+	int slow = 0;
+
+	handle = sfs_journal_start(sb, SFS_ALLOC_CREDITS);
+	if (IS_ERR(handle) || sfs_journal_get_write_access(handle, bh)) {
+		pr_err("sfs: cannot log the freeing of %lu blocks at %lu\n",
+			count, idx * sbi->s_bits_per_block + bit);
+		if (!IS_ERR(handle))
+			sfs_journal_stop(handle);
+		return 0;
+	}
+	spare = sfs_fe_alloc();
+	sfs_load_group(sb, idx);	/* if this fails only the bits are cleared */
+
+	spin_lock(&sbi->s_bam_lock[idx]);
+	if (!grp->g_loaded) {
+		/* the bitmap of a group without a tree changes under the mutex */
+		spin_unlock(&sbi->s_bam_lock[idx]);
+		mutex_lock(&sbi->s_group_mutex);
+		spin_lock(&sbi->s_bam_lock[idx]);
+		slow = 1;
+	}
+	if (find_next_zero_bit(map, bit + count, bit) >= bit + count) {
+		bitmap_clear(map, bit, count);
+		if (busy && grp->g_loaded) {
+			grp->g_busy += count;
+			goto out;
+		}
+		busy = 0;
+		freed = count;
+		if (grp->g_loaded && sfs_fe_put(&grp->g_free,
+				idx * sbi->s_bits_per_block + bit, count, &spare))
+			goto drop;
+	} else {
+		pr_debug("sfs_free_block (%s:%lu): bit already cleared\n",
+		       sb->s_id, idx * sbi->s_bits_per_block + bit);
+		busy = 0;
+		for (i = bit; i < bit + count; i++)
+			if (test_and_clear_bit(i, map))
+				freed++;
+		/* the tree cannot be trusted either, rebuild it */
+		goto drop;
+	}
+out:
+	if (freed) {
+		percpu_counter_add(&sbi->s_freeblocks_counter, freed);
+		summary_set(&sbi->s_bam_sum, idx);
+	}
+	spin_unlock(&sbi->s_bam_lock[idx]);
+	if (slow)
+		mutex_unlock(&sbi->s_group_mutex);
+	sfs_fe_free(spare);
+	sfs_journal_dirty(handle, bh);
+	if (busy && handle)
+		sfs_journal_release_on_commit(handle,
+				idx * sbi->s_bits_per_block + bit, count);
+	sfs_journal_stop(handle);
+	return busy;
+
+drop:
+	/*
+	 * No memory or a confused tree: rebuild it from the bitmap later.
+	 * Not while blocks are reserved, they would come back free; the
+	 * run then stays out of the tree until the next mount.
+	 */
+	if (grp->g_loaded && !grp->g_busy) {
+		sfs_fe_drop(&grp->g_free);
+		grp->g_loaded = 0;
+	}
+	goto out;
+}
+
+/* Return reserved blocks to the free extent tree of group @idx */
+static void unreserve_run(struct super_block *sb, unsigned long idx,
+			  unsigned long bit, unsigned long count)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_group_info *grp = &sbi->s_groups[idx];
+	struct sfs_free_extent *spare = sfs_fe_alloc();
+
+	spin_lock(&sbi->s_bam_lock[idx]);
+	grp->g_busy -= count;
+	if (grp->g_loaded && sfs_fe_put(&grp->g_free,
+			idx * sbi->s_bits_per_block + bit, count, &spare) &&
+	    !grp->g_busy) {
+		/* the bits are clear, a rebuild finds the run */
+		sfs_fe_drop(&grp->g_free);
+		grp->g_loaded = 0;
+	}
+	percpu_counter_add(&sbi->s_freeblocks_counter, count);
+	summary_set(&sbi->s_bam_sum, idx);
+	spin_unlock(&sbi->s_bam_lock[idx]);
+	sfs_fe_free(spare);
+}
+
+/*
+ * Freed blocks that may be reused now.  With -o discard they are
+ * discarded first.
+ */
+void sfs_release_blocks(struct super_block *sb, unsigned long block,
+			unsigned long count)
+{
+	if (!test_opt(sb, DISCARD) || sfs_discard_queue(sb, block, count))
+		sfs_unreserve_blocks(sb, block, count);
+}
+
+/*
+ * Bring back freed blocks that are still held: those of a transaction
+ * that has not committed, which cannot be forced while the caller holds
+ * a handle, and those waiting for their discard.  Returns 1 if any may
+ * have come back.
+ */
+int sfs_reclaim_blocks(struct super_block *sb)
+{
+	if (!journal_current_handle() && sfs_journal_commit_freed(sb))
+		return 1;
+	return sfs_discard_flush(sb);
+}
+
+void sfs_unreserve_blocks(struct super_block *sb, unsigned long block,
+			  unsigned long count)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	unsigned long bit, idx, n;
+
+	while (count) {
+		idx = block / sbi->s_bits_per_block;
+		bit = block % sbi->s_bits_per_block;
+		n = min(count, sbi->s_bits_per_block - bit);
+		unreserve_run(sb, idx, bit, n);
+		block += n;
+		count -= n;
+	}
+}
+
+/* Mark reserved blocks, all in one group, in use on disk */
+static int claim_blocks(struct super_block *sb, unsigned long block,
+			unsigned long count)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	unsigned long idx = block / sbi->s_bits_per_block;
+	struct buffer_head *bh = sbi->s_bam_bh[idx];
+	handle_t *handle;
+	int err;
+
+	handle = sfs_journal_start(sb, SFS_ALLOC_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = sfs_journal_get_write_access(handle, bh);
+	if (err) {
+		sfs_journal_stop(handle);
+		return err;
+	}
+	spin_lock(&sbi->s_bam_lock[idx]);
+	bitmap_set((unsigned long *)bh->b_data,
+		   block % sbi->s_bits_per_block, count);
+	sbi->s_groups[idx].g_busy -= count;
+	spin_unlock(&sbi->s_bam_lock[idx]);
+	sfs_journal_dirty(handle, bh);
+	return sfs_journal_stop(handle);
+}
+
+/* With SFS_FEATURE_BLOCK_COUNT, i_blocks follows what @inode owns */
+static void count_blocks(struct inode *inode, long count)
+{
+	if (!count || !sfs_has_feature(inode->i_sb, SFS_FEATURE_BLOCK_COUNT))
+		return;
+	if (count > 0)
+		inode_add_bytes(inode, (loff_t)count << inode->i_blkbits);
+	else
+		inode_sub_bytes(inode, (loff_t)-count << inode->i_blkbits);
+	mark_inode_dirty(inode);
+}
+
+/*
+ * Free a run of blocks.  Each bitmap block it touches is locked and
+ * dirtied once, so freeing a contiguous file costs one round trip per
+ * group instead of one per block.  The run is cleared in the bitmap as
+ * usual.  With a journal it stays reserved until the transaction that
+ * frees it has committed: file data is not logged, and a new owner
+ * writing the blocks before that would leave the old file pointing at
+ * the new data after a crash.  With -o discard it is discarded before
+ * the allocator gets it back.
+ */
+void sfs_free_blocks(struct inode *inode, unsigned long block,
+		     unsigned long count)
 {
 	struct super_block *sb = inode->i_sb;
 	struct sfs_sb_info *sbi = SFS_SB(sb);
-	struct buffer_head *bh;
-	int k = sb->s_blocksize_bits + 3;
-	unsigned long bit, idx;
+	int busy = sbi->s_journal || test_opt(sb, DISCARD);
+	unsigned long bit, idx, n;
 
-	if (block < sbi->s_data_block_start || block >= sbi->s_nblocks) {
+	if (block < sbi->s_data_block_start || block + count > sbi->s_nblocks ||
+	    block + count < block) {
 		pr_debug("Trying to free block not in datazone\n");
 		return;
 	}
-	idx = block >> k;
-	bit = block & ((1<<k) - 1);
-	if (idx >= sbi->s_bam_blocks) {
-		pr_debug("sfs_free_block: nonexistent bitmap buffer\n");
-		return;
+	if (sfs_journal_dir(inode))
+		sfs_journal_revoke(inode, block, count);
+	count_blocks(inode, -(long)count);
+	while (count) {
+		idx = block / sbi->s_bits_per_block;
+		bit = block % sbi->s_bits_per_block;
+		if (idx >= sbi->s_bam_blocks) {
+			pr_debug("sfs_free_block: nonexistent bitmap buffer\n");
+			return;
+		}
+		n = min(count, sbi->s_bits_per_block - bit);
+		if (free_run(sb, idx, bit, n, busy) && !sbi->s_journal)
+			sfs_release_blocks(sb, block, n);
+		block += n;
+		count -= n;
 	}
-	bh = sbi->s_bam_bh[idx];
-	spin_lock(&bitmap_lock);
-	if (!test_and_clear_bit(bit,(unsigned long *)bh->b_data))
-		pr_debug("sfs_free_block (%s:%lu): bit already cleared\n",
-		       sb->s_id, block);
-	spin_unlock(&bitmap_lock);
-	mark_buffer_dirty(bh);
-	return;
 }
 
-unsigned long sfs_new_block(struct inode * inode, int *err)
+void sfs_free_block(struct inode *inode, unsigned long block)
+{
+	sfs_free_blocks(inode, block, 1);
+}
+
+/*
+ * Allocate a run of up to *count contiguous blocks from the free extent
+ * trees.  The search starts at @goal when it lies in the data zone (in a
+ * group picked by the task otherwise) and first looks for a free extent
+ * that holds the whole run; only if there is none anywhere is a shorter
+ * run taken.  *count is set to the length actually taken.  With @reserve
+ * the run is only reserved and the bitmap is left alone.
+ */
+static unsigned long find_blocks(struct inode *inode, unsigned long goal,
+				 unsigned long *count, int *err, int reserve)
 {
-	struct super_block *sb = inode->i_sb;	 
+	struct super_block *sb = inode->i_sb;
 	struct sfs_sb_info *sbi = SFS_SB(sb);
-	unsigned long block;
-	int i;
-
-	i = sbi->s_bam_last;
-	do {
-		spin_lock(&bitmap_lock);
-		block = find_first_zero_bit(
-			(unsigned long *)sbi->s_bam_bh[i]->b_data, 
-			sbi->s_bits_per_block); 
-		if (block < sbi->s_bits_per_block) {
-			set_bit(block, 
-				(unsigned long *)sbi->s_bam_bh[i]->b_data);
-			spin_unlock(&bitmap_lock);
-			block += i * sbi->s_bits_per_block;
-			sbi->s_bam_last = i;
-			mark_buffer_dirty(sbi->s_bam_bh[i]);
-			*err = 0;
-			return block;
-		}
-		spin_unlock(&bitmap_lock);
-		i = (i + 1) % sbi->s_bam_blocks; 
-	} while (i != sbi->s_bam_last); 
+	unsigned long bpb = sbi->s_bits_per_block;
+	struct sfs_free_extent *spare = NULL;
+	struct sfs_group_info *grp;
+	u32 block = 0, got = 0, start, need;
+	unsigned int first, i;
+	int g = 0, pass, wrapped;
+	handle_t *handle;
 
+	if (goal >= sbi->s_data_block_start && goal < sbi->s_nblocks) {
+		first = goal / bpb;
+	} else {
+		first = sfs_task_group(sbi->s_bam_blocks);
+		goal = first * bpb;
+	}
+retry:
+	handle = reserve ? NULL : sfs_journal_start(sb, SFS_ALLOC_CREDITS);
+	if (IS_ERR(handle)) {
+		*err = PTR_ERR(handle);
+		*count = 0;
+		return 0;
+	}
 	*err = -ENOSPC;
+	for (pass = 0; pass < 2 && !block; pass++) {
+		need = pass ? 1 : *count;
+		if (pass && *count == 1)
+			break;
+		/*
+		 * Walk the groups that may have room, from the goal round to
+		 * the part of the first group before the goal.
+		 */
+		wrapped = 0;
+		for (i = first; (g = summary_next(&sbi->s_bam_sum, i)) >= 0;
+		     i = g + 1) {
+			if (g < i)
+				wrapped = 1;
+			if (wrapped && g > first)
+				break;
+			start = (g == first && !wrapped) ? goal : g * bpb;
+			grp = &sbi->s_groups[g];
+			if (sfs_load_group(sb, g))
+				*err = -ENOMEM;
+			if (!spare)
+				spare = sfs_fe_alloc();
+			if (sfs_journal_get_write_access(handle,
+							 sbi->s_bam_bh[g])) {
+				*err = -EIO;
+				goto fail;
+			}
+			spin_lock(&sbi->s_bam_lock[g]);
+			if (grp->g_loaded) {
+				block = sfs_fe_take(&grp->g_free, start, need,
+						    *count, &got, &spare);
+				if (RB_EMPTY_ROOT(&grp->g_free))
+					summary_clear(&sbi->s_bam_sum, g);
+			}
+			if (block && reserve)
+				grp->g_busy += got;
+			else if (block)
+				bitmap_set((unsigned long *)sbi->s_bam_bh[g]->b_data,
+					   block - g * bpb, got);
+			spin_unlock(&sbi->s_bam_lock[g]);
+			if (block || (wrapped && g == first))
+				break;
+		}
+	}
+	sfs_fe_free(spare);
+	spare = NULL;
+
+	if (!block) {
+		sfs_journal_stop(handle);
+		if (sfs_reclaim_blocks(sb))
+			goto retry;
+		*count = 0;
+		return 0;
+	}
+	percpu_counter_sub(&sbi->s_freeblocks_counter, got);
+	if (!reserve) {
+		sfs_journal_dirty(handle, sbi->s_bam_bh[g]);
+		sfs_journal_stop(handle);
+	}
+	*count = got;
+	*err = 0;
+	return block;
+
+fail:
+	sfs_fe_free(spare);
+	sfs_journal_stop(handle);
+	*count = 0;
 	return 0;
 }
 
+unsigned long sfs_new_blocks(struct inode *inode, unsigned long goal,
+			     unsigned long *count, int *err)
+{
+	unsigned long block = find_blocks(inode, goal, count, err, 0);
+
+	if (block)
+		count_blocks(inode, *count);
+	return block;
+}
+
+/*
+ * Discard the free runs of at least @minlen blocks within bits
+ * [first, last) of group @g.  A run is reserved while its discard is
+ * in flight so that nobody allocates it meanwhile; the bitmap, which
+ * has it free, is not touched.
+ */
+int sfs_trim_group(struct super_block *sb, unsigned int g,
+		   unsigned long first, unsigned long last,
+		   unsigned long minlen, unsigned long *trimmed)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_group_info *grp = &sbi->s_groups[g];
+	unsigned long base = g * sbi->s_bits_per_block;
+	struct sfs_free_extent *spare;
+	u32 start, end, len, got;
+	int err;
+
+	err = sfs_load_group(sb, g);
+	if (err)
+		return err;
+	first += base;
+	last += base;
+	/* The spare makes sfs_fe_take cut exactly the run asked for */
+	spare = sfs_fe_alloc();
+	spin_lock(&sbi->s_bam_lock[g]);
+	while (first < last && spare && grp->g_loaded) {
+		start = sfs_fe_find(&grp->g_free, first, minlen, &len);
+		if (!start || start >= last)
+			break;
+		end = min_t(unsigned long, start + len, last);
+		if (start < first)
+			start = first;
+		first = end;
+		if (end - start < minlen)
+			continue;
+		sfs_fe_take(&grp->g_free, start, end - start, end - start,
+			    &got, &spare);
+		grp->g_busy += got;
+		percpu_counter_sub(&sbi->s_freeblocks_counter, got);
+		spin_unlock(&sbi->s_bam_lock[g]);
+
+		err = sb_issue_discard(sb, start, got, GFP_NOFS, 0);
+		sfs_unreserve_blocks(sb, start, got);
+		if (err)
+			goto out;
+		*trimmed += got;
+		if (!spare)
+			spare = sfs_fe_alloc();
+		cond_resched();
+		spin_lock(&sbi->s_bam_lock[g]);
+	}
+	spin_unlock(&sbi->s_bam_lock[g]);
+out:
+	sfs_fe_free(spare);
+	return err;
+}
+
+unsigned long sfs_new_block(struct inode * inode, unsigned long goal,
+			    int *err)
+{
+	unsigned long count = 1;
+
+	return sfs_new_blocks(inode, goal, &count, err);
+}
+
+/*
+ * Preallocation windows.  A regular file growing at its end gets more
+ * blocks than it asked for; the rest are reserved in memory only and
+ * handed out to the following appends, so files written side by side
+ * do not interleave on disk.  They are marked in the bitmap as they
+ * are handed out, so a crash loses nothing.  The window goes back on
+ * truncate, on the last close of a writer and when the inode is
+ * evicted.
+ */
+#define SFS_PA_MIN	8
+#define SFS_PA_MAX	256
+
+void sfs_discard_prealloc(struct inode *inode)
+{
+	struct sfs_inode_info *si = SFS_INODE(inode);
+	u32 start, len;
+
+	spin_lock(&si->i_pa_lock);
+	start = si->i_pa_start;
+	len = si->i_pa_len;
+	si->i_pa_len = 0;
+	spin_unlock(&si->i_pa_lock);
+	if (len)
+		sfs_unreserve_blocks(inode->i_sb, start, len);
+}
+
+/* Data blocks for logical block @lblk, preferably from the window */
+unsigned long sfs_new_data_blocks(struct inode *inode, u32 lblk,
+				  unsigned long goal, unsigned long *count,
+				  int *err)
+{
+	struct super_block *sb = inode->i_sb;
+	struct sfs_inode_info *si = SFS_INODE(inode);
+	unsigned long block, n;
+	u32 eof, window;
+
+	spin_lock(&si->i_pa_lock);
+	if (si->i_pa_len && si->i_pa_lblk == lblk) {
+		n = min_t(unsigned long, *count, si->i_pa_len);
+		block = si->i_pa_start;
+		si->i_pa_lblk += n;
+		si->i_pa_start += n;
+		si->i_pa_len -= n;
+		spin_unlock(&si->i_pa_lock);
+		goto claim;
+	}
+	spin_unlock(&si->i_pa_lock);
+	/* The write moved away from the window; it is no use any more */
+	sfs_discard_prealloc(inode);
+
+	eof = (i_size_read(inode) + sb->s_blocksize - 1) >> inode->i_blkbits;
+	/* Only files still open for writing are worth a window */
+	if (!S_ISREG(inode->i_mode) || lblk + *count < eof ||
+	    atomic_read(&inode->i_writecount) <= 0)
+		return sfs_new_blocks(inode, goal, count, err);
+
+	/* Bigger files get bigger windows */
+	window = clamp_t(u32, lblk, SFS_PA_MIN, SFS_PA_MAX);
+	n = *count + window;
+	block = find_blocks(inode, goal, &n, err, 1);
+	if (!block) {
+		*count = 0;
+		return 0;
+	}
+	if (n > *count) {
+		spin_lock(&si->i_pa_lock);
+		if (!si->i_pa_len) {
+			si->i_pa_lblk = lblk + *count;
+			si->i_pa_start = block + *count;
+			si->i_pa_len = n - *count;
+			n = *count;
+		}
+		spin_unlock(&si->i_pa_lock);
+		/* Lost a race for the window, give the extra back */
+		if (n > *count) {
+			sfs_unreserve_blocks(sb, block + *count, n - *count);
+			n = *count;
+		}
+	}
+claim:
+	*err = claim_blocks(sb, block, n);
+	if (*err) {
+		sfs_unreserve_blocks(sb, block, n);
+		n = block = 0;
+	}
+	count_blocks(inode, n);
+	*count = n;
+	return block;
+}
+
 unsigned long sfs_count_free_blocks(struct super_block *sb)
 {
 	struct sfs_sb_info *sbi = SFS_SB(sb);
@@ -108,21 +631,19 @@ unsigned long sfs_count_free_blocks(struct super_block *sb)
 
 /* Clear the link count and mode of a deleted inode on disk. */
 
-static void sfs_clear_inode(struct inode *inode)
+static void sfs_clear_inode(handle_t *handle, struct inode *inode)
 {
 	struct buffer_head *bh = NULL;
 	struct sfs_inode *di;
 
 	di = sfs_get_inode(inode->i_sb, inode->i_ino, &bh);
 
-	if (di) {
+	if (di && !sfs_journal_get_write_access(handle, bh)) {
 		di->i_nlink = cpu_to_le32(0);
 		di->i_mode = cpu_to_le32(0);
+		sfs_journal_dirty(handle, bh);
 	}
-	if (bh) {
-		mark_buffer_dirty(bh);
-		brelse (bh);
-	}
+	brelse(bh);
 }
 
 void sfs_free_inode(struct inode * inode)
@@ -132,6 +653,7 @@ void sfs_free_inode(struct inode * inode)
 	struct buffer_head *bh;
 	int k = sb->s_blocksize_bits + 3;
 	unsigned long ino, bit;
+	handle_t *handle;
 
 	ino = inode->i_ino;
 	if (ino < 1 || ino > sbi->s_ninodes) {
@@ -145,14 +667,61 @@ void sfs_free_inode(struct inode * inode)
 		return;
 	}
 
-	sfs_clear_inode(inode);	/* clear on-disk copy */
+	handle = sfs_journal_start(sb, SFS_INODE_CREDITS);
+	if (IS_ERR(handle)) {
+		pr_err("sfs: cannot log the freeing of inode %lu\n",
+			inode->i_ino);
+		return;
+	}
+	sfs_clear_inode(handle, inode);	/* clear on-disk copy */
 
 	bh = sbi->s_iam_bh[ino];
-	spin_lock(&bitmap_lock);
-	if (!test_and_clear_bit(bit, (unsigned long *)bh->b_data))
+	if (sfs_journal_get_write_access(handle, bh)) {
+		sfs_journal_stop(handle);
+		return;
+	}
+	spin_lock(&sbi->s_iam_lock[ino]);
+	if (!test_and_clear_bit(bit, (unsigned long *)bh->b_data)) {
 		pr_debug("sfs_free_inode: bit %lu already cleared\n", bit);
-	spin_unlock(&bitmap_lock);
-	mark_buffer_dirty(bh);
+	} else {
+		percpu_counter_inc(&sbi->s_freeinodes_counter);
+		summary_set(&sbi->s_iam_sum, ino);
+	}
+	spin_unlock(&sbi->s_iam_lock[ino]);
+	sfs_journal_dirty(handle, bh);
+	sfs_journal_stop(handle);
+}
+
+#define SFS_ORLOV_TRIES	8
+
+/*
+ * Where to start looking for a free inode.  Files and subdirectories go
+ * right after their parent, so the inodes of a directory share a few
+ * inode table blocks.  Directories at the top are spread out instead:
+ * of a few random inode table blocks the first one that is still unused
+ * is taken, leaving room for what will be created under them.
+ */
+static unsigned long inode_goal(struct inode *dir, umode_t mode)
+{
+	struct sfs_sb_info *sbi = SFS_SB(dir->i_sb);
+	unsigned long ipb = sbi->s_inodes_per_block, goal = dir->i_ino, bit;
+	unsigned long *map;
+	int tries;
+
+	if (!S_ISDIR(mode) || dir->i_ino != SFS_ROOT_INO)
+		return goal;
+	for (tries = 0; tries < SFS_ORLOV_TRIES; tries++) {
+		goal = (prandom_u32() % sbi->s_inode_blocks) * ipb;
+		if (goal + ipb > sbi->s_ninodes)
+			continue;
+		/* an unlocked peek, this is only a hint */
+		map = (unsigned long *)
+			sbi->s_iam_bh[goal / sbi->s_bits_per_block]->b_data;
+		bit = goal % sbi->s_bits_per_block;
+		if (find_next_bit(map, bit + ipb, bit) >= bit + ipb)
+			break;
+	}
+	return goal < sbi->s_ninodes ? goal : dir->i_ino;
 }
 
 struct inode *sfs_new_inode(struct inode *dir, umode_t mode, int *err)
@@ -161,41 +730,73 @@ struct inode *sfs_new_inode(struct inode *dir, umode_t mode, int *err)
 	struct sfs_sb_info *sbi = SFS_SB(sb);
 	struct inode *inode;
 	unsigned long ino;
+	unsigned long goal, bit;
 	struct sfs_inode_info *si;
-	int i;
+	int i, g, first, wrapped = 0;
+	handle_t *handle;
 
 	inode = new_inode(sb); 
 	if (!inode) {
 		*err = -ENOMEM;
 		return NULL;
 	}
+	handle = sfs_journal_start(sb, SFS_INODE_CREDITS);
+	if (IS_ERR(handle)) {
+		*err = PTR_ERR(handle);
+		iput(inode);
+		return NULL;
+	}
 
-	i = sbi->s_iam_last;
-	do {
-		spin_lock(&bitmap_lock);
-		ino = find_first_zero_bit(
-			(unsigned long *)sbi->s_iam_bh[i]->b_data, 
-			sbi->s_bits_per_block); 
+	goal = inode_goal(dir, mode);
+	first = goal / sbi->s_bits_per_block;
+	for (i = first; (g = summary_next(&sbi->s_iam_sum, i)) >= 0; i = g + 1) {
+		if (g < i)
+			wrapped = 1;
+		if (wrapped && g > first)
+			break;
+		/* the part of the first group before the goal comes last */
+		bit = (g == first && !wrapped) ? goal % sbi->s_bits_per_block : 0;
+		if (sfs_journal_get_write_access(handle, sbi->s_iam_bh[g]))
+			break;
+		spin_lock(&sbi->s_iam_lock[g]);
+		ino = find_next_zero_bit(
+			(unsigned long *)sbi->s_iam_bh[g]->b_data, 
+			sbi->s_bits_per_block, bit); 
 		if (ino < sbi->s_bits_per_block) {
-			set_bit(ino, (unsigned long *)sbi->s_iam_bh[i]->b_data);
-			spin_unlock(&bitmap_lock);
-			ino += i * sbi->s_bits_per_block;
-			sbi->s_iam_last = i;
-			mark_buffer_dirty(sbi->s_iam_bh[i]);
+			set_bit(ino, (unsigned long *)sbi->s_iam_bh[g]->b_data);
+			spin_unlock(&sbi->s_iam_lock[g]);
+			percpu_counter_dec(&sbi->s_freeinodes_counter);
+			ino += g * sbi->s_bits_per_block;
+			sfs_journal_dirty(handle, sbi->s_iam_bh[g]);
 			goto got_it;
 		}
-		spin_unlock(&bitmap_lock);
-		i = (i + 1) % sbi->s_iam_blocks; 
-	} while (i != sbi->s_iam_last); 
+		if (!bit)
+			summary_clear(&sbi->s_iam_sum, g);
+		spin_unlock(&sbi->s_iam_lock[g]);
+		if (wrapped && g == first)
+			break;
+	}
 
 	*err = -ENOSPC;
 	pr_debug("There is no free inode\n");
+	sfs_journal_stop(handle);
 	iput(inode);
 	return NULL;
 
 got_it:
 	si = SFS_INODE(inode);
 	memset((char*)&si->blkaddr, 0, 9*sizeof(__le32));
+	si->i_flags = 0;
+	si->i_next_block = 0;
+	si->i_next_goal = 0;
+	si->i_dir_goal = sfs_first_block(dir);
+	if (sfs_has_feature(sb, SFS_FEATURE_EXTENTS) &&
+	    (S_ISREG(mode) || S_ISDIR(mode) || S_ISLNK(mode))) {
+		si->i_flags |= SFS_EXTENTS_FL;
+		sfs_ext_init(inode);
+	}
+	if (sfs_inline_size(sb) && (S_ISREG(mode) || S_ISDIR(mode)))
+		si->i_flags |= SFS_INLINE_DATA_FL;
 
 	inode_init_owner(inode, dir, mode);
 	inode->i_ino = ino;
@@ -204,6 +805,7 @@ got_it:
 
 	insert_inode_hash(inode);
 	mark_inode_dirty(inode);
+	sfs_journal_stop(handle);
 	*err = 0;
 	return inode;	
 }
@@ -0,0 +1,284 @@
+/*
+	Delayed allocation for buffered writes.
+
+	write_begin only reserves space: the buffer is left unmapped and
+	tagged BH_Delay.  Real blocks are allocated at writepages time, one
+	contiguous run per stretch of delayed buffers, so interleaved
+	writers do not fragment each other and files removed before
+	writeback never touch the block bitmap.
+
+	Reservations are kept in s_dirtyblocks_counter and checked against
+	s_freeblocks_counter.  A delayed buffer is unmapped on purpose:
+	mpage_writepages treats an unmapped dirty buffer as "confused" and
+	hands the page to ->writepage, which allocates it one block at a
+	time if it was dirtied after the allocation pass or the pass could
+	not allocate it.  A buffer keeps its reservation until it is mapped.
+*/
+#include <linux/buffer_head.h>
+#include <linux/mpage.h>
+#include <linux/pagemap.h>
+#include <linux/pagevec.h>
+#include <linux/percpu_counter.h>
+#include <linux/writeback.h>
+#include "sfs.h"
+
+#define SFS_DA_MAX_PAGES	64	/* pages mapped per allocation pass */
+
+/* Worst case room for the tree blocks the reserved data will need */
+static inline s64 sfs_da_meta(s64 blocks)
+{
+	return blocks / 64 + SFS_EXT_MAX_DEPTH;
+}
+
+static int sfs_da_reserve(struct inode *inode, int nblocks)
+{
+	struct sfs_sb_info *sbi = SFS_SB(inode->i_sb);
+	s64 dirty;
+
+retry:
+	dirty = percpu_counter_read_positive(&sbi->s_dirtyblocks_counter);
+	dirty += nblocks;
+	if (percpu_counter_compare(&sbi->s_freeblocks_counter,
+				   dirty + sfs_da_meta(dirty)) < 0) {
+		/* blocks freed but not reusable yet are not counted */
+		if (sfs_reclaim_blocks(inode->i_sb))
+			goto retry;
+		return -ENOSPC;
+	}
+	percpu_counter_add(&sbi->s_dirtyblocks_counter, nblocks);
+	atomic_add(nblocks, &SFS_INODE(inode)->i_reserved);
+	return 0;
+}
+
+void sfs_da_release(struct inode *inode, int nblocks)
+{
+	struct sfs_sb_info *sbi = SFS_SB(inode->i_sb);
+
+	if (!nblocks)
+		return;
+	atomic_sub(nblocks, &SFS_INODE(inode)->i_reserved);
+	percpu_counter_sub(&sbi->s_dirtyblocks_counter, nblocks);
+}
+
+/* write_begin: map what exists, reserve and tag the holes */
+int sfs_da_get_block_prep(struct inode *inode, sector_t iblock,
+			  struct buffer_head *bh, int create)
+{
+	int err;
+
+	if (buffer_delay(bh))
+		return 0;
+	err = sfs_get_block(inode, iblock, bh, 0);
+	if (err || buffer_mapped(bh))
+		return err;
+	err = sfs_da_reserve(inode, 1);
+	if (err)
+		return err;
+	/* Not mapped, but __block_write_begin looks at these for new buffers */
+	bh->b_bdev = inode->i_sb->s_bdev;
+	bh->b_blocknr = SFS_INVALID_BLOCK;
+	set_buffer_new(bh);
+	set_buffer_delay(bh);
+	return 0;
+}
+
+/* ->writepage: allocate delayed buffers for real and drop the reservation */
+int sfs_da_get_block_write(struct inode *inode, sector_t iblock,
+			   struct buffer_head *bh, int create)
+{
+	int delayed = buffer_delay(bh);
+	int err;
+
+	err = sfs_get_block(inode, iblock, bh, create);
+	if (!err && delayed && buffer_mapped(bh)) {
+		clear_buffer_delay(bh);
+		sfs_da_release(inode, 1);
+	}
+	return err;
+}
+
+static int da_page_delayed(struct page *page)
+{
+	struct buffer_head *head = page_buffers(page), *bh = head;
+
+	do {
+		if (buffer_delay(bh))
+			return 1;
+	} while ((bh = bh->b_this_page) != head);
+	return 0;
+}
+
+static struct buffer_head *da_buffer(struct page **pages, int nr,
+				     sector_t block, unsigned bits)
+{
+	pgoff_t index = block >> (PAGE_CACHE_SHIFT - bits);
+	unsigned n = block & ((1 << (PAGE_CACHE_SHIFT - bits)) - 1);
+	struct buffer_head *bh;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (pages[i]->index != index)
+			continue;
+		bh = page_buffers(pages[i]);
+		while (n--)
+			bh = bh->b_this_page;
+		return bh;
+	}
+	return NULL;
+}
+
+static void da_alloc_run(struct inode *inode, struct page **pages, int nr,
+			 sector_t start, unsigned len)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned bits = inode->i_blkbits;
+	struct buffer_head map, *bh;
+	unsigned i, got;
+
+	while (len) {
+		map.b_state = 0;
+		map.b_size = len << bits;
+		if (sfs_get_block(inode, start, &map, 1) || !buffer_mapped(&map))
+			break;
+		got = map.b_size >> bits;
+		for (i = 0; i < got; i++) {
+			bh = da_buffer(pages, nr, start + i, bits);
+			if (buffer_new(&map))
+				unmap_underlying_metadata(sb->s_bdev,
+							  map.b_blocknr + i);
+			bh->b_bdev = sb->s_bdev;
+			bh->b_blocknr = map.b_blocknr + i;
+			set_buffer_mapped(bh);
+			clear_buffer_delay(bh);
+			clear_buffer_new(bh);
+		}
+		sfs_da_release(inode, got);
+		start += got;
+		len -= got;
+	}
+	if (len)
+		pr_warn("sfs: delayed allocation failed for inode %lu "
+			"at block %llu\n", inode->i_ino,
+			(unsigned long long)start);
+	/*
+	 * The rest stays delayed and reserved: ->writepage retries it block
+	 * by block and only drops the reservation once a buffer is mapped.
+	 */
+}
+
+/* Allocate every run of delayed buffers on the locked pages, then unlock */
+static void da_map_pages(struct inode *inode, struct page **pages, int nr)
+{
+	unsigned bits = inode->i_blkbits;
+	sector_t start = 0, block;
+	unsigned len = 0;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		struct buffer_head *head = page_buffers(pages[i]), *bh = head;
+
+		block = (sector_t)pages[i]->index << (PAGE_CACHE_SHIFT - bits);
+		do {
+			if (buffer_delay(bh)) {
+				if (len && start + len == block) {
+					len++;
+				} else {
+					if (len)
+						da_alloc_run(inode, pages, nr,
+							     start, len);
+					start = block;
+					len = 1;
+				}
+			}
+			block++;
+		} while ((bh = bh->b_this_page) != head);
+	}
+	if (len)
+		da_alloc_run(inode, pages, nr, start, len);
+
+	for (i = 0; i < nr; i++) {
+		unlock_page(pages[i]);
+		page_cache_release(pages[i]);
+	}
+}
+
+int sfs_da_writepages(struct address_space *mapping,
+		      struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct page *pages[SFS_DA_MAX_PAGES];
+	struct pagevec pvec;
+	pgoff_t index, end;
+	int nr = 0, i, n;
+
+	if (!atomic_read(&SFS_INODE(inode)->i_reserved))
+		goto write;
+
+	if (wbc->range_cyclic) {
+		index = 0;
+		end = -1;
+	} else {
+		index = wbc->range_start >> PAGE_CACHE_SHIFT;
+		end = wbc->range_end >> PAGE_CACHE_SHIFT;
+	}
+
+	pagevec_init(&pvec, 0);
+	while (index <= end &&
+	       (n = pagevec_lookup_tag(&pvec, mapping, &index,
+			PAGECACHE_TAG_DIRTY,
+			min_t(pgoff_t, end - index, PAGEVEC_SIZE - 1) + 1))) {
+		for (i = 0; i < n; i++) {
+			struct page *page = pvec.pages[i];
+
+			if (page->index > end)
+				break;
+			if (nr && (nr == SFS_DA_MAX_PAGES ||
+				   pages[nr - 1]->index + 1 != page->index)) {
+				da_map_pages(inode, pages, nr);
+				nr = 0;
+			}
+			lock_page(page);
+			if (page->mapping != mapping || !page_has_buffers(page) ||
+			    !da_page_delayed(page)) {
+				unlock_page(page);
+				continue;
+			}
+			page_cache_get(page);
+			pages[nr++] = page;
+		}
+		pagevec_release(&pvec);
+		cond_resched();
+	}
+	if (nr)
+		da_map_pages(inode, pages, nr);
+write:
+	return mpage_writepages(mapping, wbc, sfs_get_block);
+}
+
+/* Give back the reservations of delayed buffers being thrown away */
+void sfs_da_invalidatepage(struct page *page, unsigned int offset,
+			   unsigned int length)
+{
+	struct inode *inode = page->mapping->host;
+	struct buffer_head *head, *bh;
+	unsigned int start = 0, stop = offset + length;
+	int released = 0;
+
+	if (!page_has_buffers(page))
+		goto out;
+	head = bh = page_buffers(page);
+	do {
+		unsigned int next = start + bh->b_size;
+
+		if (next > stop)
+			break;
+		if (start >= offset && buffer_delay(bh)) {
+			clear_buffer_delay(bh);
+			released++;
+		}
+		start = next;
+	} while ((bh = bh->b_this_page) != head);
+	sfs_da_release(inode, released);
+out:
+	block_invalidatepage(page, offset, length);
+}
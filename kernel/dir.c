@@ -2,14 +2,11 @@
 #include <linux/kernel.h>
 #include <linux/string.h>
 #include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <asm/unaligned.h>
 
 #include "sfs.h"
 
-static inline size_t sfs_dir_pages(struct inode *inode)
-{
-	return (inode->i_size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
-}
-
 static inline size_t sfs_dir_entry_page(size_t pos)
 {
 	return pos >> PAGE_CACHE_SHIFT;
@@ -20,7 +17,7 @@ static inline size_t sfs_dir_entry_offset(size_t pos)
 	return pos & (PAGE_CACHE_SIZE - 1);
 }
 
-static unsigned sfs_last_byte(struct inode *inode, unsigned long page_nr)
+unsigned sfs_last_byte(struct inode *inode, unsigned long page_nr)
 {
 	unsigned last_byte = PAGE_CACHE_SIZE;
 
@@ -29,30 +26,60 @@ static unsigned sfs_last_byte(struct inode *inode, unsigned long page_nr)
 	return last_byte;
 }
 
-static int sfs_dir_prepare_chunk(struct page *page, loff_t pos, unsigned len)
+int sfs_dir_prepare_chunk(struct page *page, loff_t pos, unsigned len)
 {
+	struct inode *dir = page->mapping->host;
+	int err;
+
+	if (sfs_has_inline_data(dir)) {
+		if (pos + len <= sfs_inline_size(dir->i_sb)) {
+			if (PageUptodate(page))
+				return 0;
+			return sfs_inline_read_page(dir, page);
+		}
+		/* an inline directory is all in page 0, which is @page */
+		err = sfs_inline_convert(dir, page, sfs_get_block);
+		if (err)
+			return err;
+	}
+	if (sfs_journal_dir(dir))
+		return sfs_journal_dir_begin(page, pos, len);
 	return __block_write_begin(page, pos, len, sfs_get_block);
 }
 
-static int sfs_dir_commit_chunk(struct page *page, loff_t pos, unsigned len)
+int sfs_dir_commit_chunk(struct page *page, loff_t pos, unsigned len)
 {   
 	struct address_space *mapping = page->mapping;
 	struct inode *dir = mapping->host;
-	int err = 0;
-	block_write_end(NULL, mapping, pos, len, len, page, NULL);
+	int err = 0, ret;
+
+	if (sfs_has_inline_data(dir)) {
+		SetPageUptodate(page);
+		set_page_dirty(page);
+	} else if (sfs_journal_dir(dir)) {
+		err = sfs_journal_dir_dirty(page, pos, len);
+	} else {
+		block_write_end(NULL, mapping, pos, len, len, page, NULL);
+	}
 
 	if (pos+len > dir->i_size) {
 		i_size_write(dir, pos+len);
 		mark_inode_dirty(dir);
 	}
-	if (IS_DIRSYNC(dir))
+	if (sfs_journal_dir(dir)) {
+		/* DIRSYNC makes the handle commit when it stops */
+		unlock_page(page);
+		ret = sfs_journal_dir_end(dir);
+		if (!err)
+			err = ret;
+	} else if (IS_DIRSYNC(dir))
 		err = write_one_page(page, 1);
 	else
 		unlock_page(page);
 	return err;
 }
 
-static struct page *sfs_dir_get_page(struct inode *inode, size_t n)
+struct page *sfs_dir_get_page(struct inode *inode, size_t n)
 {
 	struct address_space *mapping = inode->i_mapping;
 	struct page *page = read_mapping_page(mapping, n, NULL);
@@ -62,33 +89,84 @@ static struct page *sfs_dir_get_page(struct inode *inode, size_t n)
 	return page;
 }
 
-static void sfs_dir_put_page(struct page *page)
+void sfs_dir_put_page(struct page *page)
 {
 	kunmap(page);
 	put_page(page);		// same as calling page_cache_release(page);
 }
 
-static int sfs_dir_emit(struct dir_context *ctx,
-			struct sfs_dir_entry *de)
+/*
+ * sfs_dir_get_page() for scans that walk the directory from front to
+ * back: pages are read ahead in the same way as file data.  A request
+ * is kept to the device's readahead window; asking for the whole rest
+ * of a big directory would read it all in one synchronous go when the
+ * scan does not start at page 0.
+ */
+struct page *sfs_dir_get_page_ra(struct inode *inode, size_t n,
+			struct file_ra_state *ra, size_t npages)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct page *page = find_get_page(mapping, n);
+	unsigned long req = min_t(unsigned long, npages - n, ra->ra_pages);
+
+	if (!page) {
+		page_cache_sync_readahead(mapping, ra, NULL, n, req);
+	} else {
+		if (PageReadahead(page))
+			page_cache_async_readahead(mapping, ra, NULL, page,
+					n, req);
+		page_cache_release(page);
+	}
+	return sfs_dir_get_page(inode, n);
+}
+
+int sfs_dir_emit(struct inode *dir, struct dir_context *ctx,
+		 struct sfs_dir_entry *de)
 {
 	unsigned type = DT_UNKNOWN;
-	unsigned len = strlen(de->de_name);
+	unsigned len = strnlen(de->de_name, sizeof(de->de_name));
 	size_t ino = le32_to_cpu(de->de_inode);
 
+	if (sfs_has_feature(dir->i_sb, SFS_FEATURE_FILETYPE))
+		type = de->de_type;
+
 	if (!ino)
 		return 1;	// skip
 	else
 		return dir_emit(ctx, de->de_name, len, ino, type);
 }
 
-static int sfs_iterate(struct inode *inode, struct dir_context *ctx)
+/*
+ * Reads ahead the inode table blocks of the entries in a page, so the
+ * stat() calls that usually follow readdir find them in the buffer cache
+ * instead of reading one block per entry.
+ */
+static void sfs_dir_inode_readahead(struct inode *dir, char *kaddr,
+			unsigned off, unsigned last_byte)
+{
+	struct sfs_dir_entry *de = (struct sfs_dir_entry *)(kaddr + off);
+	struct sfs_dir_entry *end = (struct sfs_dir_entry *)(kaddr + last_byte);
+	sector_t last = 0;
+
+	for ( ; de < end; de++)
+		last = sfs_inode_readahead(dir->i_sb,
+				le32_to_cpu(de->de_inode), last);
+}
+
+static int sfs_iterate(struct inode *inode, struct dir_context *ctx,
+			struct file_ra_state *ra)
 {
 	size_t pages = sfs_dir_pages(inode);
 	size_t pidx = sfs_dir_entry_page(ctx->pos);
 	size_t off = sfs_dir_entry_offset(ctx->pos);
 
+	if (sfs_dir_var(inode))
+		return sfs_dv_iterate(inode, ctx, ra);
+	if (sfs_has_feature(inode->i_sb, SFS_FEATURE_DIR_INDEX))
+		return sfs_dx_iterate(inode, ctx);
+
 	for ( ; pidx < pages; ++pidx, off = 0) {
-		struct page *page = sfs_dir_get_page(inode, pidx);
+		struct page *page = sfs_dir_get_page_ra(inode, pidx, ra, pages);
 		struct sfs_dir_entry *de;
 		char *kaddr;
 
@@ -100,9 +178,11 @@ static int sfs_iterate(struct inode *inode, struct dir_context *ctx)
 		}
 
 		kaddr = page_address(page);
+		sfs_dir_inode_readahead(inode, kaddr, off,
+				sfs_last_byte(inode, pidx));
 		de = (struct sfs_dir_entry *)(kaddr + off);
 		while (off < PAGE_CACHE_SIZE && ctx->pos < inode->i_size) {
-			if (!sfs_dir_emit(ctx, de)) {
+			if (!sfs_dir_emit(inode, ctx, de)) {
 				sfs_dir_put_page(page);
 				return 0;
 			}
@@ -117,97 +197,206 @@ static int sfs_iterate(struct inode *inode, struct dir_context *ctx)
 
 static int sfs_readdir(struct file *file, struct dir_context *ctx)
 {
-	return sfs_iterate(file_inode(file), ctx);
+	return sfs_iterate(file_inode(file), ctx, &file->f_ra);
 }
 
 const struct file_operations sfs_dir_ops = {
 	.llseek = generic_file_llseek,
 	.read = generic_read_dir,
 	.iterate = sfs_readdir,
-//	.fsync = generic_file_fsync,
+	.unlocked_ioctl = sfs_ioctl,
+	.fsync = sfs_fsync,
 };
 
-struct sfs_filename_match {
-	struct dir_context ctx;
-	ino_t ino;
-	const char *name;
-	int len;
+/*
+ * Fills in the free entry @de of the locked directory page and unlocks it.
+ */
+int sfs_fill_entry(struct page *page, struct sfs_dir_entry *de,
+			const char *name, struct inode *inode)
+{
+	struct inode *dir = page->mapping->host;
+	loff_t pos = page_offset(page) + (char*)de - (char *)page_address(page);
+	int err;
+
+	err = sfs_dir_prepare_chunk(page, pos, sizeof(struct sfs_dir_entry));
+	if (err) {
+		unlock_page(page);
+		return err;
+	}
+	strncpy(de->de_name, name, sizeof(de->de_name));
+	sfs_set_de_type(dir->i_sb, de, inode->i_mode);
+	de->de_inode = cpu_to_le32(inode->i_ino);
+	err = sfs_dir_commit_chunk(page, pos, sizeof(struct sfs_dir_entry));
+	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(dir);		
+	return err;
+}
+
+/*
+ * Free slot hints of a flat directory.  They are built by the first
+ * insertion after the inode is read in and kept up to date by
+ * sfs_add_link() and sfs_delete_entry(), so that a new entry goes
+ * straight to a hole or to i_size instead of rescanning from page 0.
+ * Only slots below i_size are counted as free.
+ */
+struct sfs_dir_hint {
+	unsigned long	dh_first;	/* no free slot in pages below */
+	unsigned long	dh_pages;
+	unsigned short	dh_free[];	/* free slots per page */
 };
 
-static int sfs_match(void *ctx, const char *name, int len,
-			loff_t off, u64 ino, unsigned type)
+static struct sfs_dir_hint *sfs_dir_hint_resize(struct sfs_dir_hint *hint,
+			unsigned long npages)
 {
-	struct sfs_filename_match *match = (struct sfs_filename_match *)ctx;
+	struct sfs_dir_hint *new;
+	unsigned long n = hint ? hint->dh_pages : 0;
+
+	new = krealloc(hint, sizeof(*hint) + npages * sizeof(hint->dh_free[0]),
+			GFP_NOFS | __GFP_NOWARN);
+	if (!new) {
+		kfree(hint);
+		return NULL;
+	}
+	if (!hint)
+		new->dh_first = 0;
+	for ( ; n < npages; n++)
+		new->dh_free[n] = 0;
+	new->dh_pages = npages;
+	return new;
+}
 
-	if (len != match->len)
-		return 0;
+static struct sfs_dir_entry *sfs_free_slot(struct page *page,
+			unsigned last_byte)
+{
+	struct sfs_dir_entry *de = (struct sfs_dir_entry *)page_address(page);
+	struct sfs_dir_entry *end = de + last_byte / sizeof(*de);
 
-	if (memcmp(match->name, name, len) == 0) {
-		match->ino = ino;
-		return 1;
+	for ( ; de < end; de++)
+		if (!de->de_inode)
+			return de;
+	return NULL;
+}
+
+/* Returns the hints of @dir, building them if needed, or NULL */
+static struct sfs_dir_hint *sfs_dir_hint(struct inode *dir)
+{
+	struct sfs_inode_info *si = SFS_INODE(dir);
+	unsigned long n, npages = sfs_dir_pages(dir);
+	struct sfs_dir_hint *hint = si->i_dir_hint;
+	struct file_ra_state ra;
+
+	if (hint)
+		return hint;
+
+	hint = sfs_dir_hint_resize(NULL, npages);
+	if (!hint)
+		return NULL;
+	hint->dh_first = npages;
+	file_ra_state_init(&ra, dir->i_mapping);
+	for (n = 0; n < npages; n++) {
+		struct page *page = sfs_dir_get_page_ra(dir, n, &ra, npages);
+		struct sfs_dir_entry *de, *end;
+
+		if (IS_ERR(page)) {
+			kfree(hint);
+			return NULL;
+		}
+		de = (struct sfs_dir_entry *)page_address(page);
+		end = de + sfs_last_byte(dir, n) / sizeof(*de);
+		for ( ; de < end; de++)
+			if (!de->de_inode)
+				hint->dh_free[n]++;
+		if (hint->dh_free[n] && hint->dh_first == npages)
+			hint->dh_first = n;
+		sfs_dir_put_page(page);
 	}
-	return 0;
+	si->i_dir_hint = hint;
+	return hint;
+}
+
+void sfs_dir_drop_hint(struct inode *dir)
+{
+	struct sfs_inode_info *si = SFS_INODE(dir);
+
+	kfree(si->i_dir_hint);
+	si->i_dir_hint = NULL;
 }
 
+/*
+ * Adds a link to @inode.  The VFS has already made sure that the name
+ * is not in the directory, so the first hole, or else i_size, will do.
+ */
 int sfs_add_link(struct dentry *dentry, struct inode *inode)
 {
 	struct inode *dir = dentry->d_parent->d_inode;
+	struct sfs_inode_info *si = SFS_INODE(dir);
 	const char *name = dentry->d_name.name;
-	struct page *page = NULL;
 	unsigned long npages = sfs_dir_pages(dir);
-	unsigned long n;
-	char *kaddr, *p;
+	struct sfs_dir_hint *hint;
 	struct sfs_dir_entry *de;
-	loff_t pos;
-	int err = 0;
+	struct page *page;
+	unsigned long n;
+	int hole = 1;
+	int err;
 
-	for (n = 0; n <= npages; n++) {
-		char *limit, *dir_end;
+	if (sfs_dir_var(dir))
+		return sfs_dv_add_link(dir, &dentry->d_name, inode);
+	if (sfs_dx_indexed(dir))
+		return sfs_dx_add_link(dir, &dentry->d_name, inode);
+
+	hint = sfs_dir_hint(dir);
+	for (n = hint ? hint->dh_first : 0; n < npages; n++) {
+		if (hint && !hint->dh_free[n])
+			continue;
 		page = sfs_dir_get_page(dir, n);
-		err = PTR_ERR(page);
 		if (IS_ERR(page))
-			goto out;
+			return PTR_ERR(page);
 		lock_page(page);
-		kaddr = (char *)page_address(page);
-		dir_end = kaddr + sfs_last_byte(dir, n);
-		limit = kaddr + PAGE_CACHE_SIZE - sizeof(struct sfs_dir_entry); 
-		for (p = kaddr; p <= limit; p += sizeof(struct sfs_dir_entry)) {
-			de = (struct sfs_dir_entry *) p;
-			if ((char *)de == dir_end) {
-				/* We hit i_size */
-				de->de_inode = cpu_to_le32(0);
-				goto got_it;
-			}
-			if (!le32_to_cpu(de->de_inode))
-				goto got_it;
-			err = -EEXIST;
-			if (strncmp(de->de_name, name, SFS_MAX_NAME_LEN-1) == 0)
-				goto out_unlock;
+		de = sfs_free_slot(page, sfs_last_byte(dir, n));
+		if (de) {
+			if (hint)
+				hint->dh_first = n;
+			goto got_it;
 		}
 		unlock_page(page);
 		sfs_dir_put_page(page);
-	}	
-	BUG();
-	return -EINVAL;
-	
+		if (hint)
+			hint->dh_free[n] = 0;
+	}
+	if (hint)
+		hint->dh_first = npages;
+
+	if (dir->i_size == PAGE_CACHE_SIZE &&
+	    sfs_has_feature(dir->i_sb, SFS_FEATURE_DIR_INDEX)) {
+		/* the first block is full, index the directory */
+		sfs_dir_drop_hint(dir);
+		err = sfs_dx_make_indexed(dir);
+		if (err)
+			return err;
+		return sfs_dx_add_link(dir, &dentry->d_name, inode);
+	}
+
+	/* No hole: append at i_size */
+	hole = 0;
+	n = dir->i_size >> PAGE_CACHE_SHIFT;
+	if (hint && n >= hint->dh_pages) {
+		hint = sfs_dir_hint_resize(hint, n + 1);
+		si->i_dir_hint = hint;
+	}
+	page = sfs_dir_get_page(dir, n);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	lock_page(page);
+	de = (struct sfs_dir_entry *)((char *)page_address(page) +
+			sfs_dir_entry_offset(dir->i_size));
+	de->de_inode = cpu_to_le32(0);
+
 got_it:
-	pos = page_offset(page) + (char*)de - (char *)page_address(page);
-	err = sfs_dir_prepare_chunk(page, pos, sizeof(struct sfs_dir_entry));
-	if (err)
-		goto out_unlock;	
-	strncpy(de->de_name, name, SFS_MAX_NAME_LEN-1);
-	de->de_name[SFS_MAX_NAME_LEN-1] = '\0';
-	de->de_inode = cpu_to_le32(inode->i_ino);
-	err = sfs_dir_commit_chunk(page, pos, sizeof(struct sfs_dir_entry));
-	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
-	mark_inode_dirty(dir);		
-out_put:
+	err = sfs_fill_entry(page, de, name, inode);
 	sfs_dir_put_page(page);
-out:
+	if (!err && hint && hole)
+		hint->dh_free[n]--;
 	return err;
-out_unlock:
-	unlock_page(page);
-	goto out_put;
 }
 
 int sfs_make_empty(struct inode *inode, struct inode *dir)
@@ -220,6 +409,10 @@ int sfs_make_empty(struct inode *inode, struct inode *dir)
 	if (!page)
 		return -ENOMEM;
 
+	if (sfs_dir_var(inode)) {
+		err = sfs_dv_make_empty(page, inode, dir);
+		goto fail;
+	}
 	err = sfs_dir_prepare_chunk(page, 0, 2 * sizeof(struct sfs_dir_entry));
 	if (err) {
 		unlock_page(page);
@@ -232,9 +425,11 @@ int sfs_make_empty(struct inode *inode, struct inode *dir)
 	de = (struct sfs_dir_entry *)kaddr;
 	de->de_inode = cpu_to_le32(inode->i_ino);
 	strcpy(de->de_name, ".");
+	sfs_set_de_type(inode->i_sb, de, S_IFDIR);
 	de++;
 	de->de_inode = cpu_to_le32(dir->i_ino);
 	strcpy(de->de_name, ".."); 
+	sfs_set_de_type(inode->i_sb, de, S_IFDIR);
 	kunmap_atomic(kaddr);
 
 	err = sfs_dir_commit_chunk(page, 0, 2 * sizeof(struct sfs_dir_entry));
@@ -244,49 +439,91 @@ fail:
 }	
 
 /*
- *	sfs_find_entry() modified from minix_find_entry()
- *
+ * Compares a name of @len bytes with the name of a directory entry.
+ * The terminator of the entry name is checked first, so entries of a
+ * different length are rejected with a single load; the rest is
+ * compared a word at a time.
+ */
+static inline int sfs_match_name(const char *name, unsigned len,
+			const struct sfs_dir_entry *de)
+{
+	const char *p = de->de_name;
+
+	if (len >= SFS_MAX_NAME_LEN || p[len])
+		return 0;
+	for ( ; len >= sizeof(unsigned long); len -= sizeof(unsigned long)) {
+		if (get_unaligned((const unsigned long *)name) !=
+				*(const unsigned long *)p)
+			return 0;
+		name += sizeof(unsigned long);
+		p += sizeof(unsigned long);
+	}
+	while (len--)
+		if (*name++ != *p++)
+			return 0;
+	return 1;
+}
+
+/* Looks for @child in the first @last_byte bytes of a directory page */
+struct sfs_dir_entry *sfs_find_in_page(struct page *page,
+			const struct qstr *child, unsigned last_byte)
+{
+	struct sfs_dir_entry *de = (struct sfs_dir_entry *)page_address(page);
+	struct sfs_dir_entry *end = de + last_byte / sizeof(*de);
+
+	for ( ; de < end; de++) {
+		if (!de->de_inode)
+			continue;
+		if (sfs_match_name(child->name, child->len, de))
+			return de;
+	}
+	return NULL;
+}
+
+/*
  * finds an entry in the specified directory with the wanted name. It
- * returns the cache buffer in which the entry was found, and the entry
- * itself (as a parameter - res_dir). It does NOT read the inode of the
- * entry - you'll have to do that yourself if you want to.
+ * returns the page in which the entry was found, and the entry itself.
+ * It does NOT read the inode of the entry.
  */
-struct sfs_dir_entry *
-sfs_find_entry(struct dentry *dentry, struct page **res_page)
+static struct sfs_dir_entry *sfs_lookup_entry(struct inode *dir,
+			const struct qstr *child, struct page **res_page)
 {
-	const char * name = dentry->d_name.name;
-	//int namelen = dentry->d_name.len;
-	struct inode * dir = dentry->d_parent->d_inode;
-	unsigned long n;
-	unsigned long npages = sfs_dir_pages(dir);
-	struct page *page = NULL;
-	char *p;
+	unsigned long n, npages = sfs_dir_pages(dir);
+	struct file_ra_state ra;
+
+	if (sfs_dir_var(dir))
+		return sfs_dv_find_entry(dir, child, res_page);
+	if (sfs_dx_indexed(dir))
+		return sfs_dx_find_entry(dir, child, res_page);
 
 	*res_page = NULL;
+	file_ra_state_init(&ra, dir->i_mapping);
 
 	for (n = 0; n < npages; n++) {
-		char *kaddr, *limit;
+		struct page *page = sfs_dir_get_page_ra(dir, n, &ra, npages);
+		struct sfs_dir_entry *de;
 
-		page = sfs_dir_get_page(dir, n);
 		if (IS_ERR(page))
 			continue;
 
-		kaddr = (char*)page_address(page);
-		limit = kaddr + sfs_last_byte(dir, n) - sizeof(struct sfs_dir_entry);
-		for (p = kaddr; p <= limit; p += sizeof(struct sfs_dir_entry)) {
-			struct sfs_dir_entry *de = (struct sfs_dir_entry *)p;
-			if (!le32_to_cpu(de->de_inode))
-				continue;
-			if (!strncmp(de->de_name, name, SFS_MAX_NAME_LEN))
-				goto found;
+		de = sfs_find_in_page(page, child, sfs_last_byte(dir, n));
+		if (de) {
+			*res_page = page;
+			return de;
 		}
 		sfs_dir_put_page(page);
 	}
 	return NULL;
+}
 
-found:
-	*res_page = page;
-	return (struct sfs_dir_entry *)p;
+/*
+ *	sfs_find_entry() modified from minix_find_entry()
+ */
+struct sfs_dir_entry *
+sfs_find_entry(struct dentry *dentry, struct page **res_page)
+{
+	return sfs_lookup_entry(dentry->d_parent->d_inode, &dentry->d_name,
+				res_page);
 }
 
 int sfs_delete_entry(struct sfs_dir_entry *de, struct page *page)
@@ -295,13 +532,21 @@ int sfs_delete_entry(struct sfs_dir_entry *de, struct page *page)
 	char *kaddr = page_address(page);
 	loff_t pos = page_offset(page) + (char*)de - kaddr;
 	unsigned len = sizeof(struct sfs_dir_entry);
+	struct sfs_dir_hint *hint = SFS_INODE(inode)->i_dir_hint;
 	int err;
 
+	if (sfs_dir_var(inode))
+		return sfs_dv_delete_entry(de, page);
 	lock_page(page);
 	err = sfs_dir_prepare_chunk(page, pos, len);
 	if (err == 0) {
 		de->de_inode = cpu_to_le32(0);
 		err = sfs_dir_commit_chunk(page, pos, len);
+		if (hint && page->index < hint->dh_pages) {
+			hint->dh_free[page->index]++;
+			if (page->index < hint->dh_first)
+				hint->dh_first = page->index;
+		}
 	} else {
 		unlock_page(page);
 	}
@@ -318,11 +563,15 @@ int sfs_empty_dir(struct inode * inode)
 {
 	struct page *page = NULL;
 	unsigned long i, npages = sfs_dir_pages(inode);
+	struct file_ra_state ra;
 
+	if (sfs_dir_var(inode))
+		return sfs_dv_empty_dir(inode);
+	file_ra_state_init(&ra, inode->i_mapping);
 	for (i = 0; i < npages; i++) {
 		char *p, *kaddr, *limit;
 
-		page = sfs_dir_get_page(inode, i);
+		page = sfs_dir_get_page_ra(inode, i, &ra, npages);
 		if (IS_ERR(page))
 			continue;
 
@@ -362,10 +611,16 @@ void sfs_set_link(struct sfs_dir_entry *de, struct page *page,
 			(char *)de-(char*)page_address(page);
 	int err;
 
+	if (sfs_dir_var(dir)) {
+		sfs_dv_set_link(de, page, inode);
+		return;
+	}
 	lock_page(page);
 
 	err = sfs_dir_prepare_chunk(page, pos, sizeof(struct sfs_dir_entry));
 	if (err == 0) {
+		de->de_inode = cpu_to_le32(inode->i_ino);
+		sfs_set_de_type(dir->i_sb, de, inode->i_mode);
 		err = sfs_dir_commit_chunk(page, pos, 
 				sizeof(struct sfs_dir_entry));
 	} else {
@@ -378,9 +633,13 @@ void sfs_set_link(struct sfs_dir_entry *de, struct page *page,
 
 struct sfs_dir_entry *sfs_dotdot (struct inode *dir, struct page **p)
 {
-	struct page *page = sfs_dir_get_page(dir, 0);
+	struct page *page;
 	struct sfs_dir_entry *de = NULL;
 
+	if (sfs_dir_var(dir))
+		return sfs_dv_dotdot(dir, p);
+	page = sfs_dir_get_page(dir, 0);
+
 	if (!IS_ERR(page)) {
 		de = (struct sfs_dir_entry *)((char*)page_address(page) + 
 				sizeof(struct sfs_dir_entry));
@@ -390,36 +649,17 @@ struct sfs_dir_entry *sfs_dotdot (struct inode *dir, struct page **p)
 }
 
 ino_t sfs_inode_by_name(struct inode *dir, struct qstr *child)
-{
-	struct sfs_filename_match match = {
-		.ctx = { &sfs_match, 0 }, 
-		.ino = 0, 
-		.name = child->name, 
-		.len = child->len
-	};
-
-	int err = sfs_iterate(dir, &match.ctx);
-
-	if (err)
-		pr_err("Cannot find dir entry, error = %d", err);
-	return match.ino;
-}
-
-/*
-ino_t sfs_inode_by_name(struct dentry *dentry)
 {
 	struct page *page;
-	struct sfs_dir_entry *de = sfs_find_entry(dentry, &page);
+	struct sfs_dir_entry *de;
 	ino_t res = 0;
 
+	if (sfs_dir_var(dir))
+		return sfs_dv_inode_by_name(dir, child);
+	de = sfs_lookup_entry(dir, child, &page);
 	if (de) {
-		struct address_space *mapping = page->mapping;
-		struct inode *inode = mapping->host;
-		struct sfs_sb_info *sbi = SFS_SB(inode->i_sb);
-
 		res = le32_to_cpu(de->de_inode);
 		sfs_dir_put_page(page);
 	}
 	return res;
 }
-*/
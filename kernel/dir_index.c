@@ -0,0 +1,689 @@
+/*
+	Hashed directory index, after the htree of fs/ext3/namei.c.
+	Code is reduced to the fixed size sfs_dir_entry and to a single
+	level of index nodes below the root.
+*/
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#include "sfs.h"
+
+#define DX_SLOT_SIZE	sizeof(struct sfs_dir_entry)
+#define DX_SLOTS	(PAGE_CACHE_SIZE / DX_SLOT_SIZE)
+#define DX_ROOT_SLOT	2	/* slots 0 and 1 hold "." and ".." */
+#define DX_ROOT_LIMIT	((DX_SLOTS - DX_ROOT_SLOT - 1) * SFS_DX_PER_SLOT)
+#define DX_NODE_LIMIT	((DX_SLOTS - 1) * SFS_DX_PER_SLOT)
+
+struct dx_frame {
+	struct page *page;
+	struct sfs_dx_head *head;
+	struct sfs_dx_slot *slots;	/* index entries follow the head */
+	unsigned at;			/* entry we descended through */
+};
+
+struct dx_map {
+	u32 hash;
+	u32 slot;
+};
+
+/*
+ * readdir walks a directory of a fs with the index in hash order, even
+ * before it has an index, and ctx->pos holds the half hash of the next
+ * entry.  A split or the move to an index leaves that order alone, so
+ * a readdir spread over several calls neither skips nor repeats entries
+ * around them; only entries of the same half hash may come twice.  0
+ * and 1 are "." and "..", and the last value is the end.
+ */
+#define DX_POS_EOF	0x7fffffff
+
+static inline u32 dx_pos(u32 hash)
+{
+	return clamp_t(u32, hash >> 1, DX_ROOT_SLOT, DX_POS_EOF - 1);
+}
+
+/* 32 bit FNV-1a; it must never change, the result is stored on disk */
+static u32 dx_hash(const char *name, unsigned len)
+{
+	u32 hash = 0x811c9dc5;
+
+	while (len--) {
+		hash ^= (unsigned char)*name++;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+static inline struct sfs_dx_entry *dx_entry(struct dx_frame *f, unsigned i)
+{
+	return &f->slots[i / SFS_DX_PER_SLOT].ds_entry[i % SFS_DX_PER_SLOT];
+}
+
+static inline u32 dx_get_hash(struct dx_frame *f, unsigned i)
+{
+	return le32_to_cpu(dx_entry(f, i)->de_hash);
+}
+
+static inline unsigned long dx_get_block(struct dx_frame *f, unsigned i)
+{
+	return le32_to_cpu(dx_entry(f, i)->de_block);
+}
+
+static inline void dx_set_entry(struct dx_frame *f, unsigned i,
+			u32 hash, unsigned long block)
+{
+	dx_entry(f, i)->de_hash = cpu_to_le32(hash);
+	dx_entry(f, i)->de_block = cpu_to_le32(block);
+}
+
+static inline unsigned dx_count(struct dx_frame *f)
+{
+	return le16_to_cpu(f->head->dh_count);
+}
+
+static inline void dx_set_count(struct dx_frame *f, unsigned count)
+{
+	f->head->dh_count = cpu_to_le16(count);
+}
+
+static inline unsigned dx_limit(struct dx_frame *f)
+{
+	return le16_to_cpu(f->head->dh_limit);
+}
+
+static void dx_init_frame(struct dx_frame *f, struct page *page,
+			unsigned slot)
+{
+	struct sfs_dx_slot *s = (struct sfs_dx_slot *)page_address(page);
+
+	f->page = page;
+	f->head = (struct sfs_dx_head *)(s + slot);
+	f->slots = s + slot + 1;
+	f->at = 0;
+}
+
+static void dx_init_head(struct dx_frame *f, unsigned count, unsigned limit)
+{
+	f->head->dh_magic = cpu_to_le16(SFS_DX_MAGIC);
+	f->head->dh_limit = cpu_to_le16(limit);
+	dx_set_count(f, count);
+}
+
+static int dx_valid(struct dx_frame *f, unsigned limit, size_t npages)
+{
+	unsigned i, count = dx_count(f);
+
+	if (le16_to_cpu(f->head->dh_magic) != SFS_DX_MAGIC ||
+	    dx_limit(f) != limit || !count || count > limit)
+		return 0;
+	for (i = 0; i < count; i++)
+		if (!dx_get_block(f, i) || dx_get_block(f, i) >= npages)
+			return 0;
+	return 1;
+}
+
+static void dx_release(struct dx_frame *frames, int n)
+{
+	while (n--)
+		sfs_dir_put_page(frames[n].page);
+}
+
+/* Finds the last entry whose hash is not above @hash */
+static void dx_search(struct dx_frame *f, u32 hash)
+{
+	unsigned lo = 1, hi = dx_count(f);
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+
+		if (dx_get_hash(f, mid) > hash)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	f->at = lo - 1;
+}
+
+/*
+ * Walks the index from the root down to the leaf block that covers
+ * @hash.  Returns the number of frames filled in, or an error.  The
+ * pages of all frames stay mapped until dx_release().
+ */
+static int dx_probe(struct inode *dir, u32 hash, struct dx_frame *frames)
+{
+	size_t npages = (dir->i_size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	struct dx_frame *f = frames;
+	struct page *page;
+	unsigned levels;
+	int n = 0;
+
+	page = sfs_dir_get_page(dir, 0);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	dx_init_frame(f, page, DX_ROOT_SLOT);
+	n++;
+
+	levels = f->head->dh_levels;
+	if (levels > SFS_DX_MAX_LEVELS || !dx_valid(f, DX_ROOT_LIMIT, npages))
+		goto corrupt;
+
+	for (;;) {
+		dx_search(f, hash);
+		if (n > levels)
+			return n;
+
+		page = sfs_dir_get_page(dir, dx_get_block(f, f->at));
+		if (IS_ERR(page)) {
+			dx_release(frames, n);
+			return PTR_ERR(page);
+		}
+		dx_init_frame(++f, page, 0);
+		n++;
+		if (!dx_valid(f, DX_NODE_LIMIT, npages))
+			goto corrupt;
+	}
+
+corrupt:
+	pr_err("sfs: corrupted index of directory %lu\n", dir->i_ino);
+	dx_release(frames, n);
+	return -EIO;
+}
+
+static int dx_page_begin(struct page *page)
+{
+	int err;
+
+	lock_page(page);
+	err = sfs_dir_prepare_chunk(page, page_offset(page), PAGE_CACHE_SIZE);
+	if (err)
+		unlock_page(page);
+	return err;
+}
+
+static int dx_page_end(struct page *page)
+{
+	return sfs_dir_commit_chunk(page, page_offset(page), PAGE_CACHE_SIZE);
+}
+
+/* Returns a new, zeroed, locked block at the end of the directory */
+static struct page *dx_append_page(struct inode *dir, int *err)
+{
+	size_t n = (dir->i_size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	struct page *page = sfs_dir_get_page(dir, n);
+
+	if (IS_ERR(page)) {
+		*err = PTR_ERR(page);
+		return NULL;
+	}
+	*err = dx_page_begin(page);
+	if (*err) {
+		sfs_dir_put_page(page);
+		return NULL;
+	}
+	memset(page_address(page), 0, PAGE_CACHE_SIZE);
+	return page;
+}
+
+/* Inserts (@hash, @block) at position @pos of a non-full index block */
+static int dx_insert(struct dx_frame *f, unsigned pos,
+			u32 hash, unsigned long block)
+{
+	unsigned i, count = dx_count(f);
+	int err = dx_page_begin(f->page);
+
+	if (err)
+		return err;
+	for (i = count; i > pos; i--)
+		*dx_entry(f, i) = *dx_entry(f, i - 1);
+	dx_set_entry(f, pos, hash, block);
+	dx_set_count(f, count + 1);
+	return dx_page_end(f->page);
+}
+
+/*
+ * The root is full and there is no index node level yet: move all of
+ * the root entries into a new node and let the root point to it.
+ */
+static int dx_grow_root(struct inode *dir, struct dx_frame *frames, int *n)
+{
+	struct dx_frame *root = &frames[0], *node = &frames[1];
+	unsigned i, count = dx_count(root);
+	struct page *page;
+	int err;
+
+	page = dx_append_page(dir, &err);
+	if (!page)
+		return err;
+	dx_init_frame(node, page, 0);
+	dx_init_head(node, count, DX_NODE_LIMIT);
+	for (i = 0; i < count; i++)
+		*dx_entry(node, i) = *dx_entry(root, i);
+	node->at = root->at;
+	err = dx_page_end(page);
+	if (err) {
+		sfs_dir_put_page(page);
+		return err;
+	}
+	(*n)++;
+
+	err = dx_page_begin(root->page);
+	if (err)
+		return err;
+	memset(root->slots, 0, (DX_ROOT_LIMIT / SFS_DX_PER_SLOT) * DX_SLOT_SIZE);
+	dx_set_entry(root, 0, 0, page->index);
+	dx_set_count(root, 1);
+	root->head->dh_levels = 1;
+	root->at = 0;
+	return dx_page_end(root->page);
+}
+
+/* Splits the full index node under the root in two */
+static int dx_split_node(struct inode *dir, struct dx_frame *frames)
+{
+	struct dx_frame *root = &frames[0], *f = &frames[1], nf;
+	unsigned i, count = dx_count(f), half = count / 2;
+	struct page *page;
+	u32 hash;
+	int err;
+
+	if (dx_count(root) >= dx_limit(root))
+		return -ENOSPC;
+
+	page = dx_append_page(dir, &err);
+	if (!page)
+		return err;
+	dx_init_frame(&nf, page, 0);
+	dx_init_head(&nf, count - half, DX_NODE_LIMIT);
+	for (i = half; i < count; i++)
+		*dx_entry(&nf, i - half) = *dx_entry(f, i);
+	hash = dx_get_hash(f, half);
+	err = dx_page_end(page);
+	if (err)
+		goto out;
+
+	err = dx_page_begin(f->page);
+	if (err)
+		goto out;
+	dx_set_count(f, half);
+	err = dx_page_end(f->page);
+	if (err)
+		goto out;
+
+	err = dx_insert(root, root->at + 1, hash, page->index);
+	if (err)
+		goto out;
+
+	if (f->at >= half) {
+		nf.at = f->at - half;
+		sfs_dir_put_page(f->page);
+		*f = nf;
+		root->at++;
+		return 0;
+	}
+out:
+	sfs_dir_put_page(page);
+	return err;
+}
+
+/* Makes sure the deepest index block has room for one more entry */
+static int dx_make_room(struct inode *dir, struct dx_frame *frames, int *n)
+{
+	struct dx_frame *f = &frames[*n - 1];
+
+	if (dx_count(f) < dx_limit(f))
+		return 0;
+	if (*n == 1)
+		return dx_grow_root(dir, frames, n);
+	return dx_split_node(dir, frames);
+}
+
+static int dx_map_cmp(const void *a, const void *b)
+{
+	const struct dx_map *x = a, *y = b;
+
+	if (x->hash == y->hash)
+		return 0;
+	return x->hash < y->hash ? -1 : 1;
+}
+
+/*
+ * Picks where to cut a sorted map so that no hash value is shared by
+ * both halves.  Returns 0 if every entry has the same hash.
+ */
+static unsigned dx_split_point(struct dx_map *map, unsigned count)
+{
+	unsigned i, split = count / 2;
+
+	for (i = split; i < count; i++)
+		if (map[i].hash != map[i - 1].hash)
+			return i;
+	for (i = split - 1; i > 0; i--)
+		if (map[i].hash != map[i - 1].hash)
+			return i;
+	return 0;
+}
+
+static struct sfs_dir_entry *dx_leaf_free(struct page *page)
+{
+	struct sfs_dir_entry *de = (struct sfs_dir_entry *)page_address(page);
+	struct sfs_dir_entry *end = de + DX_SLOTS;
+
+	for ( ; de < end; de++)
+		if (!le32_to_cpu(de->de_inode))
+			return de;
+	return NULL;
+}
+
+/*
+ * Moves the upper half (by hash) of the full leaf *@pagep into a new
+ * block and hooks it into the index.  On success *@pagep is the locked
+ * leaf that now covers @hash.
+ */
+static int dx_split_leaf(struct inode *dir, struct dx_frame *frames, int *n,
+			struct page **pagep, u32 hash)
+{
+	struct page *old = *pagep, *new;
+	struct sfs_dir_entry *de, *buf;
+	struct dx_map *map;
+	unsigned i, count, split;
+	int err;
+
+	err = dx_make_room(dir, frames, n);
+	if (err)
+		goto out_old;
+
+	err = -ENOMEM;
+	buf = kmalloc(PAGE_CACHE_SIZE, GFP_NOFS);
+	map = kmalloc(DX_SLOTS * sizeof(*map), GFP_NOFS);
+	if (!buf || !map)
+		goto out_free;
+
+	memcpy(buf, page_address(old), PAGE_CACHE_SIZE);
+	for (i = 0, count = 0; i < DX_SLOTS; i++) {
+		de = &buf[i];
+		if (!le32_to_cpu(de->de_inode))
+			continue;
+		map[count].hash = dx_hash(de->de_name,
+				strnlen(de->de_name, sizeof(de->de_name)));
+		map[count++].slot = i;
+	}
+	sort(map, count, sizeof(*map), dx_map_cmp, NULL);
+
+	err = -ENOSPC;
+	split = dx_split_point(map, count);
+	if (!split)
+		goto out_free;
+
+	new = dx_append_page(dir, &err);
+	if (!new)
+		goto out_free;
+	de = (struct sfs_dir_entry *)page_address(new);
+	for (i = split; i < count; i++)
+		*de++ = buf[map[i].slot];
+	err = dx_page_end(new);
+	if (err)
+		goto out_new;
+
+	err = dx_insert(&frames[*n - 1], frames[*n - 1].at + 1,
+			map[split].hash, new->index);
+	if (err)
+		goto out_new;
+
+	err = dx_page_begin(old);
+	if (err)
+		goto out_new;
+	de = (struct sfs_dir_entry *)page_address(old);
+	memset(de, 0, PAGE_CACHE_SIZE);
+	for (i = 0; i < split; i++)
+		*de++ = buf[map[i].slot];
+	err = dx_page_end(old);
+	if (err)
+		goto out_new;
+
+	if (hash >= map[split].hash)
+		swap(old, new);
+	sfs_dir_put_page(new);
+	lock_page(old);
+	*pagep = old;
+	kfree(map);
+	kfree(buf);
+	return 0;
+
+out_new:
+	sfs_dir_put_page(new);
+out_free:
+	kfree(map);
+	kfree(buf);
+out_old:
+	sfs_dir_put_page(old);
+	return err;
+}
+
+/*
+ * Emits the entries in slots [@first, @end) of @page whose position is
+ * not before ctx->pos, in position order.  Returns 1 if @ctx is full.
+ */
+static int dx_emit_leaf(struct inode *dir, struct dir_context *ctx,
+			struct page *page, unsigned first, unsigned end,
+			struct dx_map *map)
+{
+	struct sfs_dir_entry *de = (struct sfs_dir_entry *)page_address(page);
+	unsigned i, count = 0;
+	sector_t last = 0;
+	u32 pos;
+
+	for (i = first; i < end; i++) {
+		if (!le32_to_cpu(de[i].de_inode))
+			continue;
+		pos = dx_pos(dx_hash(de[i].de_name,
+				strnlen(de[i].de_name, sizeof(de[i].de_name))));
+		if (pos < ctx->pos)
+			continue;
+		last = sfs_inode_readahead(dir->i_sb,
+				le32_to_cpu(de[i].de_inode), last);
+		map[count].hash = pos;		/* sorted by position */
+		map[count++].slot = i;
+	}
+	sort(map, count, sizeof(*map), dx_map_cmp, NULL);
+
+	for (i = 0; i < count; i++) {
+		ctx->pos = map[i].hash;
+		if (!sfs_dir_emit(dir, ctx, &de[map[i].slot]))
+			return 1;
+	}
+	return 0;
+}
+
+/* Moves @frames on to the next leaf; returns 0 past the last one */
+static int dx_next_leaf(struct inode *dir, struct dx_frame *frames, int n)
+{
+	size_t npages = (dir->i_size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	struct dx_frame *root = &frames[0], *f = &frames[n - 1];
+	struct page *page;
+
+	if (++f->at < dx_count(f))
+		return 1;
+	if (n == 1 || ++root->at >= dx_count(root))
+		return 0;
+	page = sfs_dir_get_page(dir, dx_get_block(root, root->at));
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	sfs_dir_put_page(f->page);
+	dx_init_frame(f, page, 0);
+	if (!dx_valid(f, DX_NODE_LIMIT, npages)) {
+		pr_err("sfs: corrupted index of directory %lu\n", dir->i_ino);
+		return -EIO;
+	}
+	return 1;
+}
+
+int sfs_dx_iterate(struct inode *dir, struct dir_context *ctx)
+{
+	struct dx_frame frames[SFS_DX_MAX_LEVELS + 1];
+	struct sfs_dir_entry *de;
+	struct dx_map *map;
+	struct page *page;
+	int n, err = 0, full = 0;
+
+	if (ctx->pos >= DX_POS_EOF)
+		return 0;
+	map = kmalloc(DX_SLOTS * sizeof(*map), GFP_NOFS);
+	if (!map)
+		return -ENOMEM;
+	page = sfs_dir_get_page(dir, 0);
+	if (IS_ERR(page)) {
+		err = PTR_ERR(page);
+		goto out;
+	}
+	de = (struct sfs_dir_entry *)page_address(page);
+	for ( ; ctx->pos < DX_ROOT_SLOT && !full; ctx->pos++)
+		full = !sfs_dir_emit(dir, ctx, &de[ctx->pos]);
+	/* without an index, block 0 is all there is */
+	if (!full && !sfs_dx_indexed(dir))
+		full = dx_emit_leaf(dir, ctx, page, DX_ROOT_SLOT,
+				    sfs_last_byte(dir, 0) / DX_SLOT_SIZE, map);
+	sfs_dir_put_page(page);
+	if (full || !sfs_dx_indexed(dir))
+		goto done;
+
+	/* the lowest hash at ctx->pos; the first position takes the lowest */
+	n = dx_probe(dir, ctx->pos == DX_ROOT_SLOT ? 0 : (u32)ctx->pos << 1,
+		     frames);
+	if (n < 0) {
+		err = n;
+		goto out;
+	}
+	do {
+		page = sfs_dir_get_page(dir, dx_get_block(&frames[n - 1],
+							frames[n - 1].at));
+		if (IS_ERR(page)) {
+			err = PTR_ERR(page);
+			break;
+		}
+		full = dx_emit_leaf(dir, ctx, page, 0, DX_SLOTS, map);
+		sfs_dir_put_page(page);
+	} while (!full && (err = dx_next_leaf(dir, frames, n)) > 0);
+	dx_release(frames, n);
+	if (err < 0)
+		goto out;
+	err = 0;
+done:
+	if (!full)
+		ctx->pos = DX_POS_EOF;
+out:
+	kfree(map);
+	return err;
+}
+
+struct sfs_dir_entry *sfs_dx_find_entry(struct inode *dir,
+			const struct qstr *child, struct page **res_page)
+{
+	struct dx_frame frames[SFS_DX_MAX_LEVELS + 1];
+	struct sfs_dir_entry *de;
+	struct page *page;
+	unsigned long block;
+	int n;
+
+	*res_page = NULL;
+	n = dx_probe(dir, dx_hash(child->name, child->len), frames);
+	if (n < 0)
+		return NULL;
+	block = dx_get_block(&frames[n - 1], frames[n - 1].at);
+	dx_release(frames, n);
+
+	page = sfs_dir_get_page(dir, block);
+	if (IS_ERR(page))
+		return NULL;
+	de = sfs_find_in_page(page, child, PAGE_CACHE_SIZE);
+	if (!de) {
+		sfs_dir_put_page(page);
+		return NULL;
+	}
+	*res_page = page;
+	return de;
+}
+
+int sfs_dx_add_link(struct inode *dir, const struct qstr *child,
+			struct inode *inode)
+{
+	struct dx_frame frames[SFS_DX_MAX_LEVELS + 1];
+	u32 hash = dx_hash(child->name, child->len);
+	struct sfs_dir_entry *de;
+	struct page *page;
+	int n, err;
+
+	n = dx_probe(dir, hash, frames);
+	if (n < 0)
+		return n;
+
+	page = sfs_dir_get_page(dir, dx_get_block(&frames[n - 1],
+						frames[n - 1].at));
+	err = PTR_ERR(page);
+	if (IS_ERR(page))
+		goto out;
+
+	lock_page(page);
+	de = dx_leaf_free(page);
+	if (!de) {
+		unlock_page(page);
+		err = dx_split_leaf(dir, frames, &n, &page, hash);
+		if (err)
+			goto out;
+		de = dx_leaf_free(page);
+	}
+	err = sfs_fill_entry(page, de, child->name, inode);
+	sfs_dir_put_page(page);
+out:
+	dx_release(frames, n);
+	return err;
+}
+
+/*
+ * Turns a flat directory whose only block is full into an indexed one:
+ * the entries after "." and ".." move to a new leaf block and block 0
+ * becomes the root of the index.
+ */
+int sfs_dx_make_indexed(struct inode *dir)
+{
+	size_t dots = DX_ROOT_SLOT * DX_SLOT_SIZE;
+	struct page *root, *leaf;
+	struct dx_frame f;
+	int err;
+
+	BUILD_BUG_ON(sizeof(struct sfs_dx_slot) != DX_SLOT_SIZE);
+	BUILD_BUG_ON(sizeof(struct sfs_dx_head) != DX_SLOT_SIZE);
+
+	root = sfs_dir_get_page(dir, 0);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+
+	leaf = dx_append_page(dir, &err);
+	if (!leaf)
+		goto out;
+	memcpy(page_address(leaf), (char *)page_address(root) + dots,
+			PAGE_CACHE_SIZE - dots);
+	err = dx_page_end(leaf);
+	if (err)
+		goto out_leaf;
+
+	err = dx_page_begin(root);
+	if (err)
+		goto out_leaf;
+	memset((char *)page_address(root) + dots, 0, PAGE_CACHE_SIZE - dots);
+	dx_init_frame(&f, root, DX_ROOT_SLOT);
+	dx_init_head(&f, 1, DX_ROOT_LIMIT);
+	f.head->dh_levels = 0;
+	dx_set_entry(&f, 0, 0, leaf->index);
+	err = dx_page_end(root);
+	if (err)
+		goto out_leaf;
+
+	SFS_INODE(dir)->i_flags |= SFS_INDEX_FL;
+	mark_inode_dirty(dir);
+out_leaf:
+	sfs_dir_put_page(leaf);
+out:
+	sfs_dir_put_page(root);
+	return err;
+}
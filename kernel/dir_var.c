@@ -0,0 +1,464 @@
+/*
+	Variable length directory entries (SFS_FEATURE_VAR_DIRENT).
+
+	ext2 style records that carry their own length, so a short name
+	takes a few bytes instead of a whole struct sfs_dir_entry.  The
+	records of a block run from its start to its end, or to i_size in
+	the last block, and never cross into the next block.  A new entry
+	goes into the slack of an existing record or is appended at i_size.
+	A removed entry is merged into the record before it, so only the
+	first record of a block is ever left with dr_inode 0.
+
+	Directories in this format are never hash indexed.
+*/
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include "sfs.h"
+
+static inline struct sfs_dir_rec *dv_rec(struct page *page, unsigned off)
+{
+	return (struct sfs_dir_rec *)((char *)page_address(page) + off);
+}
+
+static inline unsigned dv_rec_len(struct sfs_dir_rec *dr)
+{
+	return le16_to_cpu(dr->dr_rec_len);
+}
+
+/* Space taken by the entry in @dr, 0 if it is unused */
+static inline unsigned dv_used(struct sfs_dir_rec *dr)
+{
+	return dr->dr_inode ? SFS_DIR_REC_LEN(dr->dr_name_len) : 0;
+}
+
+/*
+ * Checks the record at @off of a page whose records end at @last.  A bad
+ * length would make the walk loop or run off the block.
+ */
+static int dv_check(struct inode *dir, struct page *page, unsigned off,
+			unsigned last)
+{
+	struct sfs_dir_rec *dr = dv_rec(page, off);
+	unsigned len = dv_rec_len(dr);
+	unsigned mask = ~(dir->i_sb->s_blocksize - 1);
+
+	if (len >= SFS_DIR_REC_LEN(0) && !(len & 3) && off + len <= last &&
+	    dv_used(dr) <= len && (off & mask) == ((off + len - 1) & mask))
+		return 0;
+	pr_err("bad entry at %lu in directory %lu\n",
+		(unsigned long)(page_offset(page) + off),
+		(unsigned long)dir->i_ino);
+	return -EIO;
+}
+
+/* The first record at or after @off, which may fall inside a record */
+static int dv_resync(struct inode *dir, struct page *page, unsigned off,
+			unsigned *res)
+{
+	unsigned pos = off & ~(dir->i_sb->s_blocksize - 1);
+	unsigned last = sfs_last_byte(dir, page->index);
+	int err;
+
+	while (pos < off) {
+		err = dv_check(dir, page, pos, last);
+		if (err)
+			return err;
+		pos += dv_rec_len(dv_rec(page, pos));
+	}
+	*res = pos;
+	return 0;
+}
+
+int sfs_dv_iterate(struct inode *dir, struct dir_context *ctx,
+			struct file_ra_state *ra)
+{
+	unsigned long n, npages = sfs_dir_pages(dir);
+	unsigned off, last, next;
+	struct sfs_dir_rec *dr;
+	struct page *page;
+	sector_t block;
+	int err = 0;
+
+	n = ctx->pos >> PAGE_CACHE_SHIFT;
+	off = ctx->pos & (PAGE_CACHE_SIZE - 1);
+	for ( ; n < npages; n++, off = 0) {
+		page = sfs_dir_get_page_ra(dir, n, ra, npages);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		last = sfs_last_byte(dir, n);
+		/* a merge since the last call may have swallowed ctx->pos */
+		err = dv_resync(dir, page, off, &off);
+		if (err)
+			goto out;
+
+		/* see sfs_dir_inode_readahead() */
+		block = 0;
+		for (next = off; next < last; next += dv_rec_len(dr)) {
+			if (dv_check(dir, page, next, last))
+				break;
+			dr = dv_rec(page, next);
+			block = sfs_inode_readahead(dir->i_sb,
+					le32_to_cpu(dr->dr_inode), block);
+		}
+
+		for ( ; off < last; off += dv_rec_len(dr)) {
+			err = dv_check(dir, page, off, last);
+			if (err)
+				goto out;
+			dr = dv_rec(page, off);
+			ctx->pos = page_offset(page) + off;
+			if (dr->dr_inode &&
+			    !dir_emit(ctx, dr->dr_name, dr->dr_name_len,
+				      le32_to_cpu(dr->dr_inode), dr->dr_type))
+				goto out;
+		}
+		ctx->pos = page_offset(page) + last;
+		sfs_dir_put_page(page);
+	}
+	return 0;
+out:
+	sfs_dir_put_page(page);
+	return err;
+}
+
+static struct sfs_dir_rec *dv_find_in_page(struct inode *dir,
+			struct page *page, const struct qstr *child)
+{
+	unsigned off, last = sfs_last_byte(dir, page->index);
+	struct sfs_dir_rec *dr;
+
+	for (off = 0; off < last; off += dv_rec_len(dr)) {
+		if (dv_check(dir, page, off, last))
+			return NULL;
+		dr = dv_rec(page, off);
+		if (dr->dr_inode && dr->dr_name_len == child->len &&
+		    !memcmp(dr->dr_name, child->name, child->len))
+			return dr;
+	}
+	return NULL;
+}
+
+struct sfs_dir_entry *sfs_dv_find_entry(struct inode *dir,
+			const struct qstr *child, struct page **res_page)
+{
+	unsigned long n, npages = sfs_dir_pages(dir);
+	struct file_ra_state ra;
+	struct sfs_dir_rec *dr;
+
+	*res_page = NULL;
+	file_ra_state_init(&ra, dir->i_mapping);
+	for (n = 0; n < npages; n++) {
+		struct page *page = sfs_dir_get_page_ra(dir, n, &ra, npages);
+
+		if (IS_ERR(page))
+			continue;
+		dr = dv_find_in_page(dir, page, child);
+		if (dr) {
+			*res_page = page;
+			return (struct sfs_dir_entry *)dr;
+		}
+		sfs_dir_put_page(page);
+	}
+	return NULL;
+}
+
+ino_t sfs_dv_inode_by_name(struct inode *dir, const struct qstr *child)
+{
+	struct page *page;
+	struct sfs_dir_rec *dr;
+	ino_t res = 0;
+
+	dr = (struct sfs_dir_rec *)sfs_dv_find_entry(dir, child, &page);
+	if (dr) {
+		res = le32_to_cpu(dr->dr_inode);
+		sfs_dir_put_page(page);
+	}
+	return res;
+}
+
+/*
+ * Puts @child into [off, off + len) of the locked page: into the slack
+ * after the first @used bytes, which stay with the record there.
+ * Unlocks the page.
+ */
+static int dv_fill(struct page *page, unsigned off, unsigned len,
+			unsigned used, const struct qstr *child,
+			struct inode *inode)
+{
+	struct inode *dir = page->mapping->host;
+	loff_t pos = page_offset(page) + off;
+	struct sfs_dir_rec *dr;
+	int err;
+
+	err = sfs_dir_prepare_chunk(page, pos, len);
+	if (err) {
+		unlock_page(page);
+		return err;
+	}
+	dr = dv_rec(page, off);
+	if (used) {
+		dr->dr_rec_len = cpu_to_le16(used);
+		dr = dv_rec(page, off + used);
+	}
+	dr->dr_rec_len = cpu_to_le16(len - used);
+	dr->dr_name_len = child->len;
+	dr->dr_type = (inode->i_mode & S_IFMT) >> 12;
+	memcpy(dr->dr_name, child->name, child->len);
+	dr->dr_inode = cpu_to_le32(inode->i_ino);
+	err = sfs_dir_commit_chunk(page, pos, len);
+	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(dir);
+	return err;
+}
+
+/*
+ * Stretches the last record of the block holding i_size to the end of
+ * the block, so the next record can start a new one.
+ */
+static int dv_pad_block(struct inode *dir)
+{
+	unsigned bs = dir->i_sb->s_blocksize;
+	loff_t size = dir->i_size;
+	unsigned off, last, end, len;
+	struct page *page;
+	int err;
+
+	page = sfs_dir_get_page(dir, (size - 1) >> PAGE_CACHE_SHIFT);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	lock_page(page);
+	last = sfs_last_byte(dir, page->index);
+	off = (size - 1) & (PAGE_CACHE_SIZE - 1) & ~(bs - 1);
+	for (;;) {
+		err = dv_check(dir, page, off, last);
+		if (err)
+			goto out;
+		len = dv_rec_len(dv_rec(page, off));
+		if (off + len >= last)
+			break;
+		off += len;
+	}
+	end = (last + bs - 1) & ~(bs - 1);
+	err = sfs_dir_prepare_chunk(page, page_offset(page) + off, end - off);
+	if (err)
+		goto out;
+	dv_rec(page, off)->dr_rec_len = cpu_to_le16(end - off);
+	err = sfs_dir_commit_chunk(page, page_offset(page) + off, end - off);
+	sfs_dir_put_page(page);
+	return err;
+out:
+	unlock_page(page);
+	sfs_dir_put_page(page);
+	return err;
+}
+
+int sfs_dv_add_link(struct inode *dir, const struct qstr *child,
+			struct inode *inode)
+{
+	unsigned long n, npages = sfs_dir_pages(dir);
+	unsigned bs = dir->i_sb->s_blocksize;
+	unsigned need = SFS_DIR_REC_LEN(child->len);
+	unsigned off, last, len, used;
+	struct file_ra_state ra;
+	struct sfs_dir_rec *dr;
+	struct page *page;
+	loff_t pos;
+	int err;
+
+	file_ra_state_init(&ra, dir->i_mapping);
+	for (n = 0; n < npages; n++) {
+		page = sfs_dir_get_page_ra(dir, n, &ra, npages);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		lock_page(page);
+		last = sfs_last_byte(dir, n);
+		for (off = 0; off < last; off += len) {
+			err = dv_check(dir, page, off, last);
+			if (err) {
+				unlock_page(page);
+				sfs_dir_put_page(page);
+				return err;
+			}
+			dr = dv_rec(page, off);
+			len = dv_rec_len(dr);
+			used = dv_used(dr);
+			if (len - used >= need)
+				goto got_it;
+		}
+		unlock_page(page);
+		sfs_dir_put_page(page);
+	}
+
+	/* No room: append at i_size, in a new block if it does not fit */
+	pos = dir->i_size;
+	if ((pos & (bs - 1)) + need > bs) {
+		err = dv_pad_block(dir);
+		if (err)
+			return err;
+		pos = dir->i_size;
+	}
+	page = sfs_dir_get_page(dir, pos >> PAGE_CACHE_SHIFT);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	lock_page(page);
+	off = pos & (PAGE_CACHE_SIZE - 1);
+	len = need;
+	used = 0;
+got_it:
+	err = dv_fill(page, off, len, used, child, inode);
+	sfs_dir_put_page(page);
+	return err;
+}
+
+/* Merges the entry into the record before it in the block, if any */
+int sfs_dv_delete_entry(struct sfs_dir_entry *de, struct page *page)
+{
+	struct inode *dir = page->mapping->host;
+	struct sfs_dir_rec *dr = (struct sfs_dir_rec *)de;
+	unsigned off = (char *)dr - (char *)page_address(page);
+	unsigned last = sfs_last_byte(dir, page->index);
+	unsigned from = off & ~(dir->i_sb->s_blocksize - 1);
+	struct sfs_dir_rec *prev = NULL;
+	unsigned start = off;
+	int err = 0;
+
+	lock_page(page);
+	while (from < off) {
+		err = dv_check(dir, page, from, last);
+		if (err)
+			goto out;
+		prev = dv_rec(page, from);
+		start = from;
+		from += dv_rec_len(prev);
+	}
+	err = sfs_dir_prepare_chunk(page, page_offset(page) + start,
+				    off + dv_rec_len(dr) - start);
+	if (err)
+		goto out;
+	if (prev)
+		prev->dr_rec_len = cpu_to_le16(off + dv_rec_len(dr) - start);
+	dr->dr_inode = cpu_to_le32(0);
+	err = sfs_dir_commit_chunk(page, page_offset(page) + start,
+				   off + dv_rec_len(dr) - start);
+	goto done;
+out:
+	unlock_page(page);
+done:
+	sfs_dir_put_page(page);
+	dir->i_ctime = dir->i_mtime = CURRENT_TIME_SEC;
+	mark_inode_dirty(dir);
+	return err;
+}
+
+/* Releases the page */
+void sfs_dv_set_link(struct sfs_dir_entry *de, struct page *page,
+			struct inode *inode)
+{
+	struct inode *dir = page->mapping->host;
+	struct sfs_dir_rec *dr = (struct sfs_dir_rec *)de;
+	loff_t pos = page_offset(page) +
+			((char *)dr - (char *)page_address(page));
+
+	lock_page(page);
+	if (sfs_dir_prepare_chunk(page, pos, SFS_DIR_REC_LEN(0)) == 0) {
+		dr->dr_inode = cpu_to_le32(inode->i_ino);
+		dr->dr_type = (inode->i_mode & S_IFMT) >> 12;
+		sfs_dir_commit_chunk(page, pos, SFS_DIR_REC_LEN(0));
+	} else {
+		unlock_page(page);
+	}
+	sfs_dir_put_page(page);
+	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(dir);
+}
+
+/* ".." is the second record of block 0 */
+struct sfs_dir_entry *sfs_dv_dotdot(struct inode *dir, struct page **p)
+{
+	struct page *page = sfs_dir_get_page(dir, 0);
+	unsigned last;
+
+	if (IS_ERR(page))
+		return NULL;
+	last = sfs_last_byte(dir, 0);
+	if (dv_check(dir, page, 0, last) ||
+	    dv_check(dir, page, dv_rec_len(dv_rec(page, 0)), last)) {
+		sfs_dir_put_page(page);
+		return NULL;
+	}
+	*p = page;
+	return (struct sfs_dir_entry *)
+		dv_rec(page, dv_rec_len(dv_rec(page, 0)));
+}
+
+int sfs_dv_empty_dir(struct inode *dir)
+{
+	unsigned long n, npages = sfs_dir_pages(dir);
+	unsigned off, last;
+	struct file_ra_state ra;
+	struct sfs_dir_rec *dr;
+	struct page *page;
+
+	file_ra_state_init(&ra, dir->i_mapping);
+	for (n = 0; n < npages; n++) {
+		page = sfs_dir_get_page_ra(dir, n, &ra, npages);
+		if (IS_ERR(page))
+			continue;
+		last = sfs_last_byte(dir, n);
+		for (off = 0; off < last; off += dv_rec_len(dr)) {
+			if (dv_check(dir, page, off, last))
+				goto not_empty;
+			dr = dv_rec(page, off);
+			if (!dr->dr_inode)
+				continue;
+			/* check for . and .. */
+			if (dr->dr_name[0] != '.' || dr->dr_name_len > 2)
+				goto not_empty;
+			if (dr->dr_name_len == 1) {
+				if (le32_to_cpu(dr->dr_inode) != dir->i_ino)
+					goto not_empty;
+			} else if (dr->dr_name_len != 2 ||
+				   dr->dr_name[1] != '.') {
+				goto not_empty;
+			}
+		}
+		sfs_dir_put_page(page);
+	}
+	return 1;
+
+not_empty:
+	sfs_dir_put_page(page);
+	return 0;
+}
+
+/* "." and ".." in the locked page 0 of a new directory; unlocks it */
+int sfs_dv_make_empty(struct page *page, struct inode *inode,
+			struct inode *dir)
+{
+	unsigned len = SFS_DIR_REC_LEN(1) + SFS_DIR_REC_LEN(2);
+	struct sfs_dir_rec *dr;
+	char *kaddr;
+	int err;
+
+	err = sfs_dir_prepare_chunk(page, 0, len);
+	if (err) {
+		unlock_page(page);
+		return err;
+	}
+	kaddr = kmap_atomic(page);
+	memset(kaddr, 0, PAGE_CACHE_SIZE);
+	dr = (struct sfs_dir_rec *)kaddr;
+	dr->dr_inode = cpu_to_le32(inode->i_ino);
+	dr->dr_rec_len = cpu_to_le16(SFS_DIR_REC_LEN(1));
+	dr->dr_name_len = 1;
+	dr->dr_type = DT_DIR;
+	memcpy(dr->dr_name, ".", 1);
+	dr = (struct sfs_dir_rec *)(kaddr + SFS_DIR_REC_LEN(1));
+	dr->dr_inode = cpu_to_le32(dir->i_ino);
+	dr->dr_rec_len = cpu_to_le16(SFS_DIR_REC_LEN(2));
+	dr->dr_name_len = 2;
+	dr->dr_type = DT_DIR;
+	memcpy(dr->dr_name, "..", 2);
+	kunmap_atomic(kaddr);
+	return sfs_dir_commit_chunk(page, 0, len);
+}
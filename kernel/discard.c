@@ -0,0 +1,136 @@
+/*
+	Discard support.
+
+	With -o discard, freed runs are cleared in the bitmap as usual but
+	kept out of the free extent trees, like preallocation windows, and
+	queued, with a journal once the transaction that freed them has
+	committed.  A worker discards them and only then hands them to the
+	allocator, so a block is never reused while its discard is pending.
+	A crash meanwhile loses nothing: on disk the runs are free.  FITRIM
+	walks the trees and reserves each free run it finds while
+	discarding it; runs waiting for a commit are not in the trees.
+*/
+#include <linux/blkdev.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "sfs.h"
+
+#define SFS_DISCARD_DELAY	(5 * HZ)	/* batch frees for this long */
+
+struct sfs_discard_run {
+	struct list_head	dr_list;
+	unsigned long		dr_start;
+	unsigned long		dr_len;
+};
+
+/* Returns -ENOMEM if the run could not be queued; free it directly then */
+int sfs_discard_queue(struct super_block *sb, unsigned long start,
+		      unsigned long len)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_discard_run *dr;
+
+	spin_lock(&sbi->s_discard_lock);
+	if (!list_empty(&sbi->s_discard_list)) {
+		dr = list_entry(sbi->s_discard_list.prev,
+				struct sfs_discard_run, dr_list);
+		if (dr->dr_start + dr->dr_len == start) {
+			dr->dr_len += len;
+			spin_unlock(&sbi->s_discard_lock);
+			goto queued;
+		}
+	}
+	spin_unlock(&sbi->s_discard_lock);
+
+	dr = kmalloc(sizeof(*dr), GFP_NOFS);
+	if (!dr)
+		return -ENOMEM;
+	dr->dr_start = start;
+	dr->dr_len = len;
+	spin_lock(&sbi->s_discard_lock);
+	list_add_tail(&dr->dr_list, &sbi->s_discard_list);
+	spin_unlock(&sbi->s_discard_lock);
+queued:
+	schedule_delayed_work(&sbi->s_discard_work, SFS_DISCARD_DELAY);
+	return 0;
+}
+
+void sfs_discard_worker(struct work_struct *work)
+{
+	struct sfs_sb_info *sbi = container_of(to_delayed_work(work),
+					       struct sfs_sb_info,
+					       s_discard_work);
+	struct super_block *sb = sbi->s_sb;
+	struct sfs_discard_run *dr, *next;
+	LIST_HEAD(runs);
+
+	spin_lock(&sbi->s_discard_lock);
+	list_splice_init(&sbi->s_discard_list, &runs);
+	spin_unlock(&sbi->s_discard_lock);
+	if (list_empty(&runs))
+		return;
+
+	/*
+	 * With a journal, runs are only queued once the frees have
+	 * committed, so a replay never brings back a file pointing at
+	 * them.  Without one there is no such order, as with any reuse of
+	 * a block; the buffers are written out, the inodes may not be.
+	 */
+	if (!SFS_SB(sb)->s_journal)
+		sync_blockdev(sb->s_bdev);
+	list_for_each_entry_safe(dr, next, &runs, dr_list) {
+		sb_issue_discard(sb, dr->dr_start, dr->dr_len, GFP_NOFS, 0);
+		sfs_unreserve_blocks(sb, dr->dr_start, dr->dr_len);
+		list_del(&dr->dr_list);
+		kfree(dr);
+	}
+}
+
+/*
+ * Push the queued runs through now (unmount, or the allocator ran dry).
+ * A worker may already have taken them off the list, so it is waited
+ * for even when the list is empty.  Returns 1 if any runs came back.
+ */
+int sfs_discard_flush(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	int queued = !list_empty_careful(&sbi->s_discard_list);
+
+	return flush_delayed_work(&sbi->s_discard_work) || queued;
+}
+
+int sfs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	unsigned int bits = sb->s_blocksize_bits;
+	unsigned long bpb = sbi->s_bits_per_block;
+	unsigned long start, end, last, minlen, trimmed = 0;
+	unsigned int g;
+	int err = 0;
+
+	if (range->len < sb->s_blocksize)
+		return -EINVAL;
+	if (range->start >> bits >= sbi->s_nblocks)
+		return -EINVAL;
+	start = range->start >> bits;
+	end = min_t(u64, sbi->s_nblocks, start + (range->len >> bits));
+	minlen = max_t(u64, range->minlen >> bits, 1);
+	if (start < sbi->s_data_block_start)
+		start = sbi->s_data_block_start;
+
+	for (g = start / bpb; start < end; g++) {
+		last = min(end, (g + 1) * bpb);
+		err = sfs_trim_group(sb, g, start - g * bpb, last - g * bpb,
+				     minlen, &trimmed);
+		if (err)
+			break;
+		if (fatal_signal_pending(current)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+		start = last;
+	}
+	range->len = (u64)trimmed << bits;
+	return err;
+}
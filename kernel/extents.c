@@ -0,0 +1,885 @@
+/*
+	Extent mapped files (SFS_EXTENTS_FL).
+
+	A small B+tree of (logical block, physical block, length) triples
+	rooted in i_blkaddr, in the spirit of ext4 extents.  Lookups
+	return whole runs, so a contiguous file costs one probe instead of
+	a walk through indirect blocks per block.
+
+	Extents made by fallocate are SFS_EXT_UNWRITTEN: they read as holes
+	until get_block(create) converts the part being written.
+
+	Changes to the tree run in the caller's journal handle, which is
+	taken before i_ext_sem.
+*/
+#include <linux/buffer_head.h>
+#include <linux/rwsem.h>
+#include "sfs.h"
+
+struct ext_path {
+	struct buffer_head *bh;		/* NULL for the root in the inode */
+	struct sfs_extent_header *hdr;
+	int p;				/* chosen entry, -1 if none */
+};
+
+static inline struct sfs_extent_header *ext_root(struct inode *inode)
+{
+	return (struct sfs_extent_header *)SFS_INODE(inode)->blkaddr;
+}
+
+static inline struct sfs_extent *ext_first(struct sfs_extent_header *eh)
+{
+	return (struct sfs_extent *)(eh + 1);
+}
+
+static inline struct sfs_extent_idx *idx_first(struct sfs_extent_header *eh)
+{
+	return (struct sfs_extent_idx *)(eh + 1);
+}
+
+static inline int ext_entries(struct sfs_extent_header *eh)
+{
+	return le16_to_cpu(eh->eh_entries);
+}
+
+static inline int ext_full(struct sfs_extent_header *eh)
+{
+	return le16_to_cpu(eh->eh_entries) >= le16_to_cpu(eh->eh_max);
+}
+
+static inline int ext_block_max(struct super_block *sb, int depth)
+{
+	size_t size = sb->s_blocksize - sizeof(struct sfs_extent_header);
+
+	return depth ? size / sizeof(struct sfs_extent_idx)
+		     : size / sizeof(struct sfs_extent);
+}
+
+static inline int ext_root_max(int depth)
+{
+	size_t size = sizeof(((struct sfs_inode_info *)0)->blkaddr) -
+		      sizeof(struct sfs_extent_header);
+
+	return depth ? size / sizeof(struct sfs_extent_idx)
+		     : size / sizeof(struct sfs_extent);
+}
+
+static void ext_init_header(struct sfs_extent_header *eh, int max, int depth)
+{
+	eh->eh_magic = cpu_to_le16(SFS_EXT_MAGIC);
+	eh->eh_entries = 0;
+	eh->eh_max = cpu_to_le16(max);
+	eh->eh_depth = cpu_to_le16(depth);
+}
+
+void sfs_ext_init(struct inode *inode)
+{
+	memset(SFS_INODE(inode)->blkaddr, 0, sizeof(SFS_INODE(inode)->blkaddr));
+	ext_init_header(ext_root(inode), ext_root_max(0), 0);
+}
+
+static int ext_check(struct inode *inode, struct sfs_extent_header *eh,
+		     int depth, int max)
+{
+	if (le16_to_cpu(eh->eh_magic) == SFS_EXT_MAGIC &&
+	    le16_to_cpu(eh->eh_depth) == depth &&
+	    le16_to_cpu(eh->eh_max) == max &&
+	    ext_entries(eh) <= max)
+		return 0;
+	pr_err("sfs: bad extent header in inode %lu (depth %d)\n",
+		inode->i_ino, depth);
+	return -EIO;
+}
+
+static void ext_put_path(struct ext_path *path, int depth)
+{
+	int i;
+
+	for (i = 1; i <= depth; i++)
+		brelse(path[i].bh);
+}
+
+/* The handle the caller runs in, NULL without a journal */
+static inline handle_t *ext_handle(struct inode *inode)
+{
+	return SFS_SB(inode->i_sb)->s_journal ? journal_current_handle() : NULL;
+}
+
+/* Must come before a tree block on the path is changed */
+static int ext_access(struct inode *inode, struct ext_path *node)
+{
+	if (!node->bh)
+		return 0;
+	return sfs_journal_get_write_access(ext_handle(inode), node->bh);
+}
+
+static void ext_dirty(struct inode *inode, struct ext_path *node)
+{
+	if (node->bh)
+		sfs_journal_dirty_map(ext_handle(inode), inode, node->bh);
+	else
+		mark_inode_dirty(inode);
+}
+
+/* Index of the last entry starting at or before @block, -1 if none */
+static int ext_search(struct sfs_extent_header *eh, u32 block, int depth)
+{
+	int lo = 0, hi = ext_entries(eh) - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		u32 key = depth ? le32_to_cpu(idx_first(eh)[mid].ei_block)
+				: le32_to_cpu(ext_first(eh)[mid].ee_block);
+		if (key <= block)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+/*
+ * Walk from the root to the leaf that covers (or would cover) @block.
+ * Returns the tree depth; path[0..depth] hold the nodes on the way.
+ */
+static int ext_find_path(struct inode *inode, u32 block, struct ext_path *path)
+{
+	struct super_block *sb = inode->i_sb;
+	struct sfs_extent_header *eh = ext_root(inode);
+	int depth = le16_to_cpu(eh->eh_depth);
+	int level, err;
+
+	if (depth > SFS_EXT_MAX_DEPTH)
+		goto bad;
+	err = ext_check(inode, eh, depth, ext_root_max(depth));
+	if (err)
+		return err;
+
+	path[0].bh = NULL;
+	path[0].hdr = eh;
+	for (level = 0; ; level++) {
+		struct buffer_head *bh;
+		int p = ext_search(path[level].hdr, block, depth - level);
+
+		if (level == depth) {
+			path[level].p = p;
+			break;
+		}
+		/* Entry 0 covers everything to its left */
+		if (p < 0) {
+			if (!ext_entries(path[level].hdr))
+				goto bad_path;
+			p = 0;
+		}
+		path[level].p = p;
+		bh = sb_bread(sb, le32_to_cpu(idx_first(path[level].hdr)[p].ei_leaf));
+		if (!bh) {
+			ext_put_path(path, level);
+			return -EIO;
+		}
+		eh = (struct sfs_extent_header *)bh->b_data;
+		path[level + 1].bh = bh;
+		path[level + 1].hdr = eh;
+		err = ext_check(inode, eh, depth - level - 1,
+				ext_block_max(sb, depth - level - 1));
+		if (err) {
+			ext_put_path(path, level + 1);
+			return err;
+		}
+	}
+	return depth;
+
+bad_path:
+	ext_put_path(path, level);
+bad:
+	pr_err("sfs: corrupted extent tree in inode %lu\n", inode->i_ino);
+	return -EIO;
+}
+
+/* Grab a zeroed tree block holding a header for @depth */
+static struct buffer_head *ext_new_node(struct inode *inode, int depth,
+					unsigned long goal, int *err)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	int nr = sfs_new_block(inode, goal, err);
+
+	if (!nr)
+		return NULL;
+	bh = sb_getblk(sb, nr);
+	if (!bh) {
+		sfs_free_block(inode, nr);
+		*err = -EIO;
+		return NULL;
+	}
+	lock_buffer(bh);
+	*err = sfs_journal_get_create_access(ext_handle(inode), bh);
+	if (*err) {
+		unlock_buffer(bh);
+		brelse(bh);
+		sfs_free_block(inode, nr);
+		return NULL;
+	}
+	memset(bh->b_data, 0, bh->b_size);
+	ext_init_header((struct sfs_extent_header *)bh->b_data,
+			ext_block_max(sb, depth), depth);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	return bh;
+}
+
+static inline size_t ext_entry_size(int depth)
+{
+	return depth ? sizeof(struct sfs_extent_idx) : sizeof(struct sfs_extent);
+}
+
+/* Move the root into a new block and make the root point at it */
+static int ext_grow_root(struct inode *inode, struct ext_path *path, int *depth)
+{
+	struct sfs_extent_header *root = ext_root(inode), *eh;
+	struct sfs_extent_idx *ix;
+	struct buffer_head *bh;
+	int err = -EIO;
+
+	if (*depth >= SFS_EXT_MAX_DEPTH)
+		return -EFBIG;
+	bh = ext_new_node(inode, *depth, sfs_ext_first_block(inode), &err);
+	if (!bh)
+		return err;
+	eh = (struct sfs_extent_header *)bh->b_data;
+	memcpy(eh + 1, root + 1, ext_entries(root) * ext_entry_size(*depth));
+	eh->eh_entries = root->eh_entries;
+	sfs_journal_dirty_map(ext_handle(inode), inode, bh);
+
+	memmove(&path[1], &path[0], (*depth + 1) * sizeof(*path));
+	path[1].bh = bh;
+	path[1].hdr = eh;
+
+	(*depth)++;
+	ext_init_header(root, ext_root_max(*depth), *depth);
+	root->eh_entries = cpu_to_le16(1);
+	ix = idx_first(root);
+	ix->ei_block = 0;
+	ix->ei_leaf = cpu_to_le32(bh->b_blocknr);
+	path[0].bh = NULL;
+	path[0].hdr = root;
+	path[0].p = 0;
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/* Split the full node path[level]; its parent is known to have room */
+static int ext_split(struct inode *inode, struct ext_path *path, int level,
+		     int depth)
+{
+	struct ext_path *node = &path[level], *parent = &path[level - 1];
+	struct sfs_extent_header *eh = node->hdr, *neh;
+	struct sfs_extent_idx *ix;
+	struct buffer_head *bh;
+	int entries = ext_entries(eh);
+	int half = entries / 2;
+	size_t size = ext_entry_size(depth - level);
+	u32 key;
+	int err = -EIO;
+
+	err = ext_access(inode, node);
+	if (!err)
+		err = ext_access(inode, parent);
+	if (err)
+		return err;
+	bh = ext_new_node(inode, depth - level, node->bh->b_blocknr, &err);
+	if (!bh)
+		return err;
+	neh = (struct sfs_extent_header *)bh->b_data;
+	memcpy(neh + 1, (char *)(eh + 1) + half * size, (entries - half) * size);
+	neh->eh_entries = cpu_to_le16(entries - half);
+	eh->eh_entries = cpu_to_le16(half);
+	key = level == depth ? le32_to_cpu(ext_first(neh)->ee_block)
+			     : le32_to_cpu(idx_first(neh)->ei_block);
+	sfs_journal_dirty_map(ext_handle(inode), inode, bh);
+	ext_dirty(inode, node);
+
+	ix = idx_first(parent->hdr) + parent->p + 1;
+	memmove(ix + 1, ix, (ext_entries(parent->hdr) - parent->p - 1) * sizeof(*ix));
+	ix->ei_block = cpu_to_le32(key);
+	ix->ei_leaf = cpu_to_le32(bh->b_blocknr);
+	le16_add_cpu(&parent->hdr->eh_entries, 1);
+	ext_dirty(inode, parent);
+
+	if (node->p >= half) {
+		brelse(node->bh);
+		node->bh = bh;
+		node->hdr = neh;
+		node->p -= half;
+		parent->p++;
+	} else
+		brelse(bh);
+	return 0;
+}
+
+/* Make sure the leaf at path[*depth] can take one more extent */
+static int ext_make_room(struct inode *inode, struct ext_path *path, int *depth)
+{
+	int level, err;
+
+	for (level = *depth; level >= 0 && ext_full(path[level].hdr); level--)
+		;
+	if (level < 0) {
+		/* Every level is full: the old root moves into a roomy block */
+		err = ext_grow_root(inode, path, depth);
+		if (err)
+			return err;
+		level = 1;
+	}
+	for (level++; level <= *depth; level++) {
+		err = ext_split(inode, path, level, *depth);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static inline struct sfs_extent *ext_cur(struct ext_path *path, int depth)
+{
+	return ext_first(path[depth].hdr) + path[depth].p;
+}
+
+/* Map @len blocks at @block to @pblk, extending a neighbour when possible */
+static int ext_insert(struct inode *inode, struct ext_path *path, int *depth,
+		      u32 block, u32 pblk, u32 len, u16 flags)
+{
+	struct ext_path *leaf = &path[*depth];
+	struct sfs_extent *ex = ext_first(leaf->hdr);
+	int n = ext_entries(leaf->hdr);
+	int p = leaf->p;
+	int err;
+
+	err = ext_access(inode, leaf);
+	if (err)
+		return err;
+	if (p >= 0) {
+		struct sfs_extent *e = ex + p;
+		u32 elen = le16_to_cpu(e->ee_len);
+
+		if (le32_to_cpu(e->ee_block) + elen == block &&
+		    le32_to_cpu(e->ee_start) + elen == pblk &&
+		    le16_to_cpu(e->ee_flags) == flags &&
+		    elen + len <= SFS_EXT_MAX_LEN) {
+			e->ee_len = cpu_to_le16(elen + len);
+			ext_dirty(inode, leaf);
+			return 0;
+		}
+	}
+	if (p + 1 < n) {
+		struct sfs_extent *e = ex + p + 1;
+		u32 elen = le16_to_cpu(e->ee_len);
+
+		if (le32_to_cpu(e->ee_block) == block + len &&
+		    le32_to_cpu(e->ee_start) == pblk + len &&
+		    le16_to_cpu(e->ee_flags) == flags &&
+		    elen + len <= SFS_EXT_MAX_LEN) {
+			e->ee_block = cpu_to_le32(block);
+			e->ee_start = cpu_to_le32(pblk);
+			e->ee_len = cpu_to_le16(elen + len);
+			ext_dirty(inode, leaf);
+			return 0;
+		}
+	}
+
+	err = ext_make_room(inode, path, depth);
+	if (err)
+		return err;
+	leaf = &path[*depth];
+	err = ext_access(inode, leaf);
+	if (err)
+		return err;
+	ex = ext_first(leaf->hdr) + leaf->p + 1;
+	memmove(ex + 1, ex, (ext_entries(leaf->hdr) - leaf->p - 1) * sizeof(*ex));
+	ex->ee_block = cpu_to_le32(block);
+	ex->ee_start = cpu_to_le32(pblk);
+	ex->ee_len = cpu_to_le16(len);
+	ex->ee_flags = cpu_to_le16(flags);
+	le16_add_cpu(&leaf->hdr->eh_entries, 1);
+	ext_dirty(inode, leaf);
+	return 0;
+}
+
+/* Cut the extent at the leaf position in two at @at, if @at is inside it */
+static int ext_split_at(struct inode *inode, struct ext_path *path, int *depth,
+			u32 at)
+{
+	struct ext_path *leaf;
+	struct sfs_extent *ex = ext_cur(path, *depth);
+	u32 start = le32_to_cpu(ex->ee_block);
+	u32 len = le16_to_cpu(ex->ee_len);
+	int err;
+
+	if (at <= start || at >= start + len)
+		return 0;
+	err = ext_make_room(inode, path, depth);
+	if (err)
+		return err;
+	leaf = &path[*depth];
+	err = ext_access(inode, leaf);
+	if (err)
+		return err;
+	ex = ext_cur(path, *depth);
+	memmove(ex + 2, ex + 1,
+		(ext_entries(leaf->hdr) - leaf->p - 1) * sizeof(*ex));
+	ex[1].ee_block = cpu_to_le32(at);
+	ex[1].ee_start = cpu_to_le32(le32_to_cpu(ex->ee_start) + at - start);
+	ex[1].ee_len = cpu_to_le16(start + len - at);
+	ex[1].ee_flags = ex->ee_flags;
+	ex->ee_len = cpu_to_le16(at - start);
+	le16_add_cpu(&leaf->hdr->eh_entries, 1);
+	ext_dirty(inode, leaf);
+	return 0;
+}
+
+/* Walk down again after the tree changed shape */
+static int ext_refind(struct inode *inode, struct ext_path *path, int *depth,
+		      u32 block)
+{
+	int d;
+
+	ext_put_path(path, *depth);
+	d = ext_find_path(inode, block, path);
+	*depth = d < 0 ? 0 : d;
+	return d < 0 ? d : 0;
+}
+
+/*
+ * Mark [block, block + len) of the unwritten extent at the leaf position
+ * as written.  The parts around it are split off; if there is no room
+ * for that they get zeroes on disk and are converted along with it.
+ */
+static int ext_convert(struct inode *inode, struct ext_path *path, int *depth,
+		       u32 block, u32 len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct sfs_extent *ex = ext_cur(path, *depth);
+	u32 start = le32_to_cpu(ex->ee_block);
+	u32 end = start + le16_to_cpu(ex->ee_len);
+	u32 pblk = le32_to_cpu(ex->ee_start);
+	int err;
+
+	if (block + len < end && ext_split_at(inode, path, depth, block + len)) {
+		err = sb_issue_zeroout(sb, pblk + block + len - start,
+				       end - block - len, GFP_NOFS);
+		if (err)
+			return err;
+	}
+	err = ext_refind(inode, path, depth, block);
+	if (err)
+		return err;
+	if (block > start && ext_split_at(inode, path, depth, block)) {
+		err = sb_issue_zeroout(sb, pblk, block - start, GFP_NOFS);
+		if (err)
+			return err;
+	}
+	err = ext_refind(inode, path, depth, block);
+	if (!err)
+		err = ext_access(inode, &path[*depth]);
+	if (err)
+		return err;
+	ex = ext_cur(path, *depth);
+	ex->ee_flags &= ~cpu_to_le16(SFS_EXT_UNWRITTEN);
+	ext_dirty(inode, &path[*depth]);
+	return 0;
+}
+
+/* First mapped logical block after the leaf position, ~0 if none */
+static u32 ext_next_block(struct ext_path *path, int depth)
+{
+	int level;
+
+	for (level = depth; level >= 0; level--) {
+		struct ext_path *node = &path[level];
+
+		if (node->p + 1 >= ext_entries(node->hdr))
+			continue;
+		if (level == depth)
+			return le32_to_cpu(ext_first(node->hdr)[node->p + 1].ee_block);
+		return le32_to_cpu(idx_first(node->hdr)[node->p + 1].ei_block);
+	}
+	return ~0U;
+}
+
+/* Where to put @block: next to the mapping around it, if there is one */
+static unsigned long ext_goal(struct inode *inode, struct ext_path *path,
+			      int depth, u32 block)
+{
+	struct sfs_inode_info *si = SFS_INODE(inode);
+	struct ext_path *leaf = &path[depth];
+	struct sfs_extent *ex;
+
+	if (block == si->i_next_block && si->i_next_goal)
+		return si->i_next_goal;
+	if (leaf->p >= 0) {
+		ex = ext_first(leaf->hdr) + leaf->p;
+		return le32_to_cpu(ex->ee_start) + block -
+			le32_to_cpu(ex->ee_block);
+	}
+	if (ext_entries(leaf->hdr)) {
+		ex = ext_first(leaf->hdr);
+		if (le32_to_cpu(ex->ee_start) > le32_to_cpu(ex->ee_block) - block)
+			return le32_to_cpu(ex->ee_start) -
+				(le32_to_cpu(ex->ee_block) - block);
+	}
+	if (leaf->bh)
+		return leaf->bh->b_blocknr;
+	return si->i_dir_goal;
+}
+
+/* First block of the file, or of its first tree block */
+unsigned long sfs_ext_first_block(struct inode *inode)
+{
+	struct sfs_extent_header *eh = ext_root(inode);
+
+	if (!ext_entries(eh))
+		return 0;
+	if (le16_to_cpu(eh->eh_depth))
+		return le32_to_cpu(idx_first(eh)->ei_leaf);
+	return le32_to_cpu(ext_first(eh)->ee_start);
+}
+
+/* Returns the number of mapped blocks from @block on, 0 for a hole */
+static u32 ext_lookup(struct ext_path *leaf, u32 block, u32 *pblk,
+		      int *unwritten)
+{
+	struct sfs_extent *ex;
+	u32 start, len;
+
+	if (leaf->p < 0)
+		return 0;
+	ex = ext_first(leaf->hdr) + leaf->p;
+	start = le32_to_cpu(ex->ee_block);
+	len = le16_to_cpu(ex->ee_len);
+	if (block >= start + len)
+		return 0;
+	*pblk = le32_to_cpu(ex->ee_start) + block - start;
+	*unwritten = le16_to_cpu(ex->ee_flags) & SFS_EXT_UNWRITTEN;
+	return start + len - block;
+}
+
+int sfs_ext_get_block(struct inode *inode, sector_t iblock,
+		      struct buffer_head *bh, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	struct sfs_inode_info *si = SFS_INODE(inode);
+	struct ext_path path[SFS_EXT_MAX_DEPTH + 1];
+	u32 block = iblock, pblk = 0, max, len;
+	int depth, err, unwritten = 0;
+	handle_t *handle;
+
+	if (iblock >= SFS_SB(sb)->s_nblocks)
+		return -EFBIG;
+	max = bh->b_size >> inode->i_blkbits;
+	if (!max)
+		max = 1;
+
+	down_read(&si->i_ext_sem);
+	depth = ext_find_path(inode, block, path);
+	if (depth < 0) {
+		up_read(&si->i_ext_sem);
+		return depth;
+	}
+	len = ext_lookup(&path[depth], block, &pblk, &unwritten);
+	ext_put_path(path, depth);
+	up_read(&si->i_ext_sem);
+
+	if (len && !unwritten)
+		goto got_it;
+	if (!create)
+		return 0;
+
+	/* The new extent commits with the bitmap bits of its blocks */
+	handle = sfs_journal_start(sb, SFS_MAP_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	down_write(&si->i_ext_sem);
+	depth = ext_find_path(inode, block, path);
+	if (depth < 0) {
+		err = depth;
+		goto out_unlock;
+	}
+	/* Someone may have raced us to it */
+	len = ext_lookup(&path[depth], block, &pblk, &unwritten);
+	if (len && unwritten) {
+		len = min(len, max);
+		err = ext_convert(inode, path, &depth, block, len);
+		if (err)
+			goto out_put;
+		set_buffer_new(bh);
+	} else if (!len) {
+		unsigned long count = min3(max, ext_next_block(path, depth) - block,
+					   (u32)SFS_EXT_MAX_LEN);
+
+		pblk = sfs_new_data_blocks(inode, block,
+					   ext_goal(inode, path, depth, block),
+					   &count, &err);
+		if (!pblk)
+			goto out_put;
+		err = ext_insert(inode, path, &depth, block, pblk, count, 0);
+		if (err) {
+			sfs_free_blocks(inode, pblk, count);
+			goto out_put;
+		}
+		si->i_next_block = block + count;
+		si->i_next_goal = pblk + count;
+		inode->i_ctime = CURRENT_TIME_SEC;
+		mark_inode_dirty(inode);
+		set_buffer_new(bh);
+		len = count;
+	}
+	ext_put_path(path, depth);
+	up_write(&si->i_ext_sem);
+	sfs_journal_stop(handle);
+got_it:
+	if (len > max)
+		len = max;
+	map_bh(bh, sb, pblk);
+	bh->b_size = len << inode->i_blkbits;
+	return 0;
+
+out_put:
+	ext_put_path(path, depth);
+out_unlock:
+	up_write(&si->i_ext_sem);
+	sfs_journal_stop(handle);
+	return err;
+}
+
+static inline void ext_free_run(struct inode *inode, u32 start, u32 len)
+{
+	sfs_free_blocks(inode, start, len);
+}
+
+/*
+ * Drop everything at or beyond @from below @eh, from the end backwards.
+ * Returns 1 if the handle ran out of room first: the tree is whole, and
+ * the rest is left for another handle.
+ */
+static int ext_remove(struct inode *inode, struct sfs_extent_header *eh,
+		      int depth, u32 from)
+{
+	struct super_block *sb = inode->i_sb;
+	handle_t *handle = ext_handle(inode);
+	int i = ext_entries(eh) - 1, ret;
+
+	if (!depth) {
+		for (; i >= 0; i--) {
+			struct sfs_extent *ex = ext_first(eh) + i;
+			u32 start = le32_to_cpu(ex->ee_block);
+			u32 len = le16_to_cpu(ex->ee_len);
+
+			if (start + len <= from)
+				break;
+			if (!sfs_journal_room(handle, SFS_FREE_CREDITS))
+				return 1;
+			if (start >= from) {
+				ext_free_run(inode, le32_to_cpu(ex->ee_start), len);
+				eh->eh_entries = cpu_to_le16(i);
+			} else {
+				ext_free_run(inode, le32_to_cpu(ex->ee_start) +
+					     from - start, start + len - from);
+				ex->ee_len = cpu_to_le16(from - start);
+				break;
+			}
+		}
+		return 0;
+	}
+
+	for (; i >= 0; i--) {
+		struct sfs_extent_idx *ix = idx_first(eh) + i;
+		u32 key = le32_to_cpu(ix->ei_block);
+		u32 nr = le32_to_cpu(ix->ei_leaf);
+		struct buffer_head *bh = sb_bread(sb, nr);
+		struct sfs_extent_header *ceh;
+
+		if (!bh)
+			return -EIO;
+		ceh = (struct sfs_extent_header *)bh->b_data;
+		ret = ext_check(inode, ceh, depth - 1, ext_block_max(sb, depth - 1));
+		if (!ret)
+			ret = sfs_journal_get_write_access(handle, bh);
+		if (!ret)
+			ret = ext_remove(inode, ceh, depth - 1, from);
+		if (ret < 0) {
+			brelse(bh);
+			return ret;
+		}
+		if (!ext_entries(ceh) &&
+		    sfs_journal_room(handle, SFS_FREE_CREDITS)) {
+			sfs_journal_forget(handle, bh);
+			sfs_free_block(inode, nr);
+			eh->eh_entries = cpu_to_le16(i);
+		} else {
+			sfs_journal_dirty_map(handle, inode, bh);
+			brelse(bh);
+			if (!ext_entries(ceh))
+				ret = 1;
+		}
+		if (ret || key <= from)
+			return ret;
+	}
+	return 0;
+}
+
+void sfs_ext_truncate(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct sfs_inode_info *si = SFS_INODE(inode);
+	struct sfs_extent_header *root = ext_root(inode);
+	handle_t *handle;
+	u32 from;
+	int depth, ret;
+
+	from = (inode->i_size + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+	/* takes the page lock, which comes before a handle */
+	block_truncate_page(inode->i_mapping, inode->i_size, sfs_get_block);
+
+	/* i_ext_sem is not held across a restart, a handle at a time */
+	do {
+		handle = sfs_journal_start(sb, SFS_TRUNCATE_CREDITS);
+		if (IS_ERR(handle)) {
+			ret = PTR_ERR(handle);
+			break;
+		}
+		down_write(&si->i_ext_sem);
+		depth = le16_to_cpu(root->eh_depth);
+		ret = -EIO;
+		if (depth <= SFS_EXT_MAX_DEPTH &&
+		    !ext_check(inode, root, depth, ext_root_max(depth))) {
+			ret = ext_remove(inode, root, depth, from);
+			if (!ext_entries(root))
+				ext_init_header(root, ext_root_max(0), 0);
+		}
+		up_write(&si->i_ext_sem);
+
+		inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
+		mark_inode_dirty(inode);
+		sfs_journal_stop(handle);
+	} while (ret == 1);
+	if (ret)
+		pr_err("sfs: truncate of inode %lu failed (%d)\n",
+			inode->i_ino, ret);
+}
+
+/* Unmap and free the first run in [*start, end) and move *start past it */
+static int ext_punch_run(struct inode *inode, u32 *start, u32 end)
+{
+	struct ext_path path[SFS_EXT_MAX_DEPTH + 1];
+	struct sfs_extent *ex;
+	struct ext_path *leaf;
+	u32 pblk, len;
+	int depth, err = 0, unwritten;
+
+	depth = ext_find_path(inode, *start, path);
+	if (depth < 0)
+		return depth;
+	len = ext_lookup(&path[depth], *start, &pblk, &unwritten);
+	if (!len) {
+		*start = ext_next_block(path, depth);
+		goto out;
+	}
+	if (len > end - *start) {
+		err = ext_split_at(inode, path, &depth, end);
+		if (err)
+			goto out;
+		len = end - *start;
+	}
+	/* The extent now ends at *start + len */
+	leaf = &path[depth];
+	err = ext_access(inode, leaf);
+	if (err)
+		goto out;
+	ex = ext_cur(path, depth);
+	if (le32_to_cpu(ex->ee_block) < *start) {
+		ex->ee_len = cpu_to_le16(*start - le32_to_cpu(ex->ee_block));
+	} else {
+		memmove(ex, ex + 1,
+			(ext_entries(leaf->hdr) - leaf->p - 1) * sizeof(*ex));
+		le16_add_cpu(&leaf->hdr->eh_entries, -1);
+	}
+	ext_dirty(inode, leaf);
+	ext_free_run(inode, pblk, len);
+	*start += len;
+out:
+	ext_put_path(path, depth);
+	return err;
+}
+
+/* Unmap and free [start, end); tree blocks that empty out stay around */
+int sfs_ext_punch(struct inode *inode, u32 start, u32 end)
+{
+	struct sfs_inode_info *si = SFS_INODE(inode);
+	handle_t *handle;
+	int err = 0;
+
+	while (!err && start < end) {
+		handle = sfs_journal_start(inode->i_sb, SFS_MAP_CREDITS);
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+		down_write(&si->i_ext_sem);
+		err = ext_punch_run(inode, &start, end);
+		up_write(&si->i_ext_sem);
+		sfs_journal_stop(handle);
+	}
+	return err;
+}
+
+/* Back the first hole in [*start, end) with an unwritten extent */
+static int ext_fallocate_run(struct inode *inode, u32 *start, u32 end)
+{
+	struct ext_path path[SFS_EXT_MAX_DEPTH + 1];
+	unsigned long count;
+	u32 pblk, len;
+	int depth, err = 0, unwritten;
+
+	depth = ext_find_path(inode, *start, path);
+	if (depth < 0)
+		return depth;
+	len = ext_lookup(&path[depth], *start, &pblk, &unwritten);
+	if (len) {
+		*start += len;
+		goto out;
+	}
+	count = min3(end, ext_next_block(path, depth), *start +
+		     (u32)SFS_EXT_MAX_LEN) - *start;
+	pblk = sfs_new_blocks(inode, ext_goal(inode, path, depth, *start),
+			      &count, &err);
+	if (!pblk)
+		goto out;
+	err = ext_insert(inode, path, &depth, *start, pblk, count,
+			 SFS_EXT_UNWRITTEN);
+	if (err)
+		ext_free_run(inode, pblk, count);
+	else
+		*start += count;
+out:
+	ext_put_path(path, depth);
+	return err;
+}
+
+/* Back the holes in [start, end) with unwritten extents */
+int sfs_ext_fallocate(struct inode *inode, u32 start, u32 end)
+{
+	struct sfs_inode_info *si = SFS_INODE(inode);
+	handle_t *handle;
+	int err = 0;
+
+	while (!err && start < end) {
+		handle = sfs_journal_start(inode->i_sb, SFS_MAP_CREDITS);
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+			break;
+		}
+		down_write(&si->i_ext_sem);
+		err = ext_fallocate_run(inode, &start, end);
+		up_write(&si->i_ext_sem);
+		sfs_journal_stop(handle);
+	}
+	mark_inode_dirty(inode);
+	return err;
+}
@@ -1,4 +1,122 @@
 #include <linux/fs.h>
+#include <linux/falloc.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include "sfs.h"
+
+static int sfs_release_file(struct inode *inode, struct file *filp)
+{
+	/* The last writer is gone, nothing will append to the window */
+	if ((filp->f_mode & FMODE_WRITE) &&
+	    atomic_read(&inode->i_writecount) == 1)
+		sfs_discard_prealloc(inode);
+	return 0;
+}
+
+/* Zero [from, from + len), inside one block, through the page cache */
+static int sfs_zero_partial(struct inode *inode, loff_t from, unsigned len)
+{
+	struct page *page;
+	void *fsdata;
+	loff_t size = i_size_read(inode);
+	int err;
+
+	/* Past EOF there is nothing to zero */
+	if (from >= size)
+		return 0;
+	if (from + len > size)
+		len = size - from;
+	if (!len)
+		return 0;
+	err = pagecache_write_begin(NULL, inode->i_mapping, from, len, 0,
+				    &page, &fsdata);
+	if (err)
+		return err;
+	zero_user(page, from & (PAGE_CACHE_SIZE - 1), len);
+	err = pagecache_write_end(NULL, inode->i_mapping, from, len, len,
+				  page, fsdata);
+	return err < 0 ? err : 0;
+}
+
+/* Zero the partial blocks at either end of [start, end) */
+static int sfs_zero_edges(struct inode *inode, loff_t start, loff_t end)
+{
+	loff_t mask = inode->i_sb->s_blocksize - 1;
+	loff_t first = (start + mask) & ~mask, last = end & ~mask;
+	int err;
+
+	if (first > last)
+		return sfs_zero_partial(inode, start, end - start);
+	err = sfs_zero_partial(inode, start, first - start);
+	if (!err)
+		err = sfs_zero_partial(inode, last, end - last);
+	return err;
+}
+
+static long sfs_fallocate(struct file *file, int mode, loff_t offset,
+			  loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	unsigned bits = inode->i_blkbits;
+	loff_t end = offset + len;
+	u32 first, last;
+	long err = 0;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	if (!S_ISREG(inode->i_mode))
+		return -EOPNOTSUPP;
+
+	mutex_lock(&inode->i_mutex);
+	if (sfs_has_inline_data(inode)) {
+		err = sfs_inline_convert_file(inode);
+		if (err)
+			goto out;
+	}
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+		err = inode_newsize_ok(inode, end);
+		if (err)
+			goto out;
+	}
+
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		if ((mode & FALLOC_FL_PUNCH_HOLE) && end > i_size_read(inode))
+			end = i_size_read(inode);
+		if (end <= offset)
+			goto out;
+		err = sfs_zero_edges(inode, offset, end);
+		if (err)
+			goto out;
+		first = (offset + (1 << bits) - 1) >> bits;
+		last = end >> bits;
+		if (first < last) {
+			truncate_pagecache_range(inode, (loff_t)first << bits,
+						 ((loff_t)last << bits) - 1);
+			if (mode & FALLOC_FL_PUNCH_HOLE)
+				err = sfs_punch_blocks(inode, first, last);
+			else
+				err = sfs_fallocate_blocks(inode, first, last, 1);
+		}
+		inode->i_mtime = CURRENT_TIME_SEC;
+	} else {
+		first = offset >> bits;
+		last = (end + (1 << bits) - 1) >> bits;
+		/* New blocks get zeroed on disk; dirty data must not race that */
+		if (!(SFS_INODE(inode)->i_flags & SFS_EXTENTS_FL))
+			err = filemap_write_and_wait_range(inode->i_mapping,
+							   offset, end - 1);
+		if (!err)
+			err = sfs_fallocate_blocks(inode, first, last, 0);
+	}
+	if (!err && !(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode))
+		i_size_write(inode, end);
+	inode->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(inode);
+out:
+	mutex_unlock(&inode->i_mutex);
+	return err;
+}
 
 const struct file_operations sfs_file_ops = {
 	.llseek = generic_file_llseek,
@@ -12,5 +130,9 @@ const struct file_operations sfs_file_ops = {
 	.aio_write = generic_file_aio_write,
 	.mmap = generic_file_mmap,
 	.splice_read = generic_file_splice_read,
-	.splice_write = generic_file_splice_write
+	.splice_write = generic_file_splice_write,
+	.fsync = sfs_fsync,
+	.release = sfs_release_file,
+	.unlocked_ioctl = sfs_ioctl,
+	.fallocate = sfs_fallocate
 };
@@ -0,0 +1,303 @@
+/*
+	Free extent trees.
+
+	Each allocation group (one bitmap block) gets an rbtree of its free
+	extents, sorted by start and augmented with the longest extent in
+	every subtree, so "N contiguous blocks at or after X" is a single
+	descent.  The bitmap stays the on-disk truth; a tree is built from
+	it the first time the group is used and is changed together with
+	the bitmap under the group lock afterwards.
+
+	Blocks can also be reserved: taken out of the tree but left clear
+	in the bitmap, so nothing is lost on disk if they are never used.
+	g_busy counts them, and a group holding any keeps its tree, since
+	a rebuild from the bitmap would hand them out again.
+*/
+#include <linux/slab.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/mutex.h>
+#include "sfs.h"
+
+struct sfs_free_extent {
+	struct rb_node	fe_node;
+	u32		fe_start;
+	u32		fe_len;
+	u32		fe_max;		/* longest fe_len in this subtree */
+};
+
+static struct kmem_cache *sfs_fe_cachep;
+
+static inline u32 fe_end(struct sfs_free_extent *fe)
+{
+	return fe->fe_start + fe->fe_len;
+}
+
+static inline u32 fe_compute_max(struct sfs_free_extent *fe)
+{
+	struct sfs_free_extent *child;
+	u32 max = fe->fe_len;
+
+	if (fe->fe_node.rb_left) {
+		child = rb_entry(fe->fe_node.rb_left, struct sfs_free_extent,
+				 fe_node);
+		if (child->fe_max > max)
+			max = child->fe_max;
+	}
+	if (fe->fe_node.rb_right) {
+		child = rb_entry(fe->fe_node.rb_right, struct sfs_free_extent,
+				 fe_node);
+		if (child->fe_max > max)
+			max = child->fe_max;
+	}
+	return max;
+}
+
+RB_DECLARE_CALLBACKS(static, fe_cb, struct sfs_free_extent, fe_node,
+		     u32, fe_max, fe_compute_max)
+
+struct sfs_free_extent *sfs_fe_alloc(void)
+{
+	return kmem_cache_alloc(sfs_fe_cachep, GFP_NOFS);
+}
+
+void sfs_fe_free(struct sfs_free_extent *fe)
+{
+	if (fe)
+		kmem_cache_free(sfs_fe_cachep, fe);
+}
+
+static void fe_insert(struct rb_root *root, struct sfs_free_extent *new)
+{
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+	struct sfs_free_extent *fe;
+
+	new->fe_max = new->fe_len;
+	while (*p) {
+		parent = *p;
+		fe = rb_entry(parent, struct sfs_free_extent, fe_node);
+		/* keep the subtree maxima right on the way down */
+		if (fe->fe_max < new->fe_len)
+			fe->fe_max = new->fe_len;
+		if (new->fe_start < fe->fe_start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&new->fe_node, parent, p);
+	rb_insert_augmented(&new->fe_node, root, &fe_cb);
+}
+
+static void fe_erase(struct rb_root *root, struct sfs_free_extent *fe)
+{
+	rb_erase_augmented(&fe->fe_node, root, &fe_cb);
+	sfs_fe_free(fe);
+}
+
+/* The extent holding @block, if any */
+static struct sfs_free_extent *fe_lookup(struct rb_root *root, u32 block)
+{
+	struct rb_node *n = root->rb_node;
+
+	while (n) {
+		struct sfs_free_extent *fe =
+			rb_entry(n, struct sfs_free_extent, fe_node);
+
+		if (block < fe->fe_start)
+			n = n->rb_left;
+		else if (block >= fe_end(fe))
+			n = n->rb_right;
+		else
+			return fe;
+	}
+	return NULL;
+}
+
+/* Lowest extent ending after @goal that is at least @len long */
+static struct sfs_free_extent *fe_first_fit(struct rb_node *n, u32 goal,
+					    u32 len)
+{
+	struct sfs_free_extent *fe, *res;
+
+	if (!n)
+		return NULL;
+	fe = rb_entry(n, struct sfs_free_extent, fe_node);
+	if (fe->fe_max < len)
+		return NULL;
+	if (fe_end(fe) > goal) {
+		res = fe_first_fit(n->rb_left, goal, len);
+		if (res)
+			return res;
+		if (fe->fe_len >= len)
+			return fe;
+	}
+	return fe_first_fit(n->rb_right, goal, len);
+}
+
+/*
+ * Take up to @want blocks, at least @need of them contiguous, starting as
+ * close after @goal as possible.  Splitting an extent needs *spare; without
+ * one the run is cut from the start of the extent instead.  Returns the
+ * first block (0 if nothing fits) and sets *got.
+ */
+u32 sfs_fe_take(struct rb_root *root, u32 goal, u32 need, u32 want, u32 *got,
+		struct sfs_free_extent **spare)
+{
+	struct sfs_free_extent *fe, *new;
+	u32 start, len, end;
+
+	fe = fe_lookup(root, goal);
+	if (fe && fe_end(fe) - goal >= need) {
+		start = goal;
+	} else {
+		fe = fe_first_fit(root->rb_node, goal, need);
+		if (!fe)
+			return 0;
+		start = fe->fe_start;
+	}
+	end = fe_end(fe);
+	if (start != fe->fe_start && end - start > want && !*spare)
+		start = fe->fe_start;
+	len = min_t(u32, want, end - start);
+
+	if (start == fe->fe_start) {
+		if (len == fe->fe_len) {
+			fe_erase(root, fe);
+		} else {
+			fe->fe_start += len;
+			fe->fe_len -= len;
+			fe_cb_propagate(&fe->fe_node, NULL);
+		}
+	} else {
+		fe->fe_len = start - fe->fe_start;
+		fe_cb_propagate(&fe->fe_node, NULL);
+		if (start + len < end) {
+			new = *spare;
+			*spare = NULL;
+			new->fe_start = start + len;
+			new->fe_len = end - new->fe_start;
+			fe_insert(root, new);
+		}
+	}
+	*got = len;
+	return start;
+}
+
+/*
+ * The lowest extent ending after @from that is at least @len long: its
+ * start, or 0 if there is none, and its length in *got.
+ */
+u32 sfs_fe_find(struct rb_root *root, u32 from, u32 len, u32 *got)
+{
+	struct sfs_free_extent *fe = fe_first_fit(root->rb_node, from, len);
+
+	if (!fe)
+		return 0;
+	*got = fe->fe_len;
+	return fe->fe_start;
+}
+
+/*
+ * Give [start, start + len) back, merging with its neighbours.  Returns
+ * -ENOMEM if a new extent was needed and there was no *spare.
+ */
+int sfs_fe_put(struct rb_root *root, u32 start, u32 len,
+	       struct sfs_free_extent **spare)
+{
+	struct sfs_free_extent *left = NULL, *right, *new;
+
+	if (start)
+		left = fe_lookup(root, start - 1);
+	right = fe_lookup(root, start + len);
+
+	if (left && right) {
+		len += right->fe_len;
+		fe_erase(root, right);
+		left->fe_len += len;
+		fe_cb_propagate(&left->fe_node, NULL);
+	} else if (left) {
+		left->fe_len += len;
+		fe_cb_propagate(&left->fe_node, NULL);
+	} else if (right) {
+		right->fe_start = start;
+		right->fe_len += len;
+		fe_cb_propagate(&right->fe_node, NULL);
+	} else {
+		if (!*spare)
+			return -ENOMEM;
+		new = *spare;
+		*spare = NULL;
+		new->fe_start = start;
+		new->fe_len = len;
+		fe_insert(root, new);
+	}
+	return 0;
+}
+
+/* Throw a group's tree away; it is rebuilt from the bitmap when needed */
+void sfs_fe_drop(struct rb_root *root)
+{
+	struct rb_node *n;
+
+	while ((n = rb_first(root))) {
+		rb_erase(n, root);
+		sfs_fe_free(rb_entry(n, struct sfs_free_extent, fe_node));
+	}
+}
+
+/*
+ * Build the tree of group @g from its bitmap.  The bitmap of an unloaded
+ * group is only changed under s_group_mutex, so it holds still here.
+ */
+int sfs_load_group(struct super_block *sb, unsigned int g)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_group_info *grp = &sbi->s_groups[g];
+	unsigned long *map = (unsigned long *)sbi->s_bam_bh[g]->b_data;
+	unsigned long bits = sbi->s_bits_per_block, bit = 0, start, end;
+	struct rb_root root = RB_ROOT;
+	struct sfs_free_extent *fe;
+	int err = 0;
+
+	if (ACCESS_ONCE(grp->g_loaded))
+		return 0;
+
+	mutex_lock(&sbi->s_group_mutex);
+	if (grp->g_loaded)
+		goto out;
+	while ((start = find_next_zero_bit(map, bits, bit)) < bits) {
+		end = find_next_bit(map, bits, start);
+		fe = sfs_fe_alloc();
+		if (!fe) {
+			sfs_fe_drop(&root);
+			err = -ENOMEM;
+			goto out;
+		}
+		fe->fe_start = g * bits + start;
+		fe->fe_len = end - start;
+		fe_insert(&root, fe);
+		bit = end;
+	}
+	spin_lock(&sbi->s_bam_lock[g]);
+	grp->g_free = root;
+	grp->g_loaded = 1;
+	spin_unlock(&sbi->s_bam_lock[g]);
+out:
+	mutex_unlock(&sbi->s_group_mutex);
+	return err;
+}
+
+int __init sfs_fe_cache_create(void)
+{
+	sfs_fe_cachep = kmem_cache_create("sfs_free_extent",
+					  sizeof(struct sfs_free_extent), 0,
+					  SLAB_RECLAIM_ACCOUNT, NULL);
+	if (sfs_fe_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void sfs_fe_cache_destroy(void)
+{
+	kmem_cache_destroy(sfs_fe_cachep);
+	sfs_fe_cachep = NULL;
+}
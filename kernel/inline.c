@@ -0,0 +1,170 @@
+/*
+	Inline data.
+
+	With SFS_FEATURE_INLINE_DATA, the space after struct sfs_inode in
+	an s_inode_size inode holds the data of small files and directories
+	(SFS_INLINE_DATA_FL), so they need no data block and are read with
+	the inode.  The data is still served through the page cache: page 0
+	is filled from the inode and written back into it, and bytes past
+	sfs_inline_size() read as zeroes.  A write that does not fit moves
+	the data to blocks for good.  i_blkaddr keeps an empty mapping all
+	along, so a converted inode just starts using it.
+*/
+#include <linux/buffer_head.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include "sfs.h"
+
+static inline char *sfs_inline_data(struct sfs_inode *di)
+{
+	return (char *)(di + 1);
+}
+
+/* Fills a page of an inline inode, which must be locked */
+int sfs_inline_read_page(struct inode *inode, struct page *page)
+{
+	struct buffer_head *bh = NULL;
+	struct sfs_inode *di = NULL;
+	size_t len = 0;
+	char *kaddr;
+
+	if (page->index == 0) {
+		di = sfs_get_inode(inode->i_sb, inode->i_ino, &bh);
+		if (!di)
+			return -EIO;
+		len = min_t(loff_t, i_size_read(inode),
+			    sfs_inline_size(inode->i_sb));
+	}
+	kaddr = kmap_atomic(page);
+	if (len)
+		memcpy(kaddr, sfs_inline_data(di), len);
+	memset(kaddr + len, 0, PAGE_CACHE_SIZE - len);
+	flush_dcache_page(page);
+	kunmap_atomic(kaddr);
+	brelse(bh);
+	SetPageUptodate(page);
+	return 0;
+}
+
+int sfs_inline_readpage(struct page *page)
+{
+	int err = sfs_inline_read_page(page->mapping->host, page);
+
+	if (err)
+		SetPageError(page);
+	unlock_page(page);
+	return err;
+}
+
+/* Copies page 0 back into the inode; other pages hold nothing to keep */
+int sfs_inline_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	unsigned size = sfs_inline_size(inode->i_sb);
+	struct buffer_head *bh;
+	struct sfs_inode *di;
+	size_t len;
+	char *kaddr;
+	int err = 0;
+
+	if (page->index) {
+		unlock_page(page);
+		return 0;
+	}
+	di = sfs_get_inode(inode->i_sb, inode->i_ino, &bh);
+	if (!di) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return -EIO;
+	}
+	len = min_t(loff_t, i_size_read(inode), size);
+	kaddr = kmap_atomic(page);
+	lock_buffer(bh);
+	memcpy(sfs_inline_data(di), kaddr, len);
+	memset(sfs_inline_data(di) + len, 0, size - len);
+	unlock_buffer(bh);
+	kunmap_atomic(kaddr);
+	mark_buffer_dirty(bh);
+
+	set_page_writeback(page);
+	unlock_page(page);
+	end_page_writeback(page);
+
+	if (wbc->sync_mode == WB_SYNC_ALL) {
+		sync_dirty_buffer(bh);
+		if (buffer_req(bh) && !buffer_uptodate(bh))
+			err = -EIO;
+	}
+	brelse(bh);
+	return err;
+}
+
+/* write_begin for a write that stays inside the inode */
+int sfs_inline_write_begin(struct address_space *mapping, loff_t pos,
+			unsigned flags, struct page **pagep)
+{
+	struct page *page;
+	int err;
+
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_CACHE_SHIFT,
+					   flags);
+	if (!page)
+		return -ENOMEM;
+	if (!PageUptodate(page)) {
+		err = sfs_inline_read_page(mapping->host, page);
+		if (err) {
+			unlock_page(page);
+			page_cache_release(page);
+			return err;
+		}
+	}
+	*pagep = page;
+	return 0;
+}
+
+/*
+ * Moves the inline data of @inode to blocks mapped by @get_block.  @page
+ * is page 0, locked; it is left dirty with the data, to be written out
+ * like any other page.
+ */
+int sfs_inline_convert(struct inode *inode, struct page *page,
+			get_block_t *get_block)
+{
+	struct sfs_inode_info *si = SFS_INODE(inode);
+	unsigned len = min_t(loff_t, i_size_read(inode),
+			     sfs_inline_size(inode->i_sb));
+	int err;
+
+	if (!PageUptodate(page)) {
+		err = sfs_inline_read_page(inode, page);
+		if (err)
+			return err;
+	}
+	si->i_flags &= ~SFS_INLINE_DATA_FL;
+	if (len) {
+		err = __block_write_begin(page, 0, len, get_block);
+		if (err) {
+			si->i_flags |= SFS_INLINE_DATA_FL;
+			return err;
+		}
+		block_commit_write(page, 0, len);
+	}
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/* sfs_inline_convert() for regular files; the caller holds i_mutex */
+int sfs_inline_convert_file(struct inode *inode)
+{
+	struct page *page;
+	int err = 0;
+
+	page = grab_cache_page_write_begin(inode->i_mapping, 0, 0);
+	if (!page)
+		return -ENOMEM;
+	if (sfs_has_inline_data(inode))
+		err = sfs_inline_convert(inode, page, sfs_da_get_block_prep);
+	unlock_page(page);
+	page_cache_release(page);
+	return err;
+}
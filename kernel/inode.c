@@ -22,6 +22,12 @@ static void sfs_inode_fill(struct sfs_inode_info *si,
 	set_nlink(&si->vfs_inode, le16_to_cpu(di->i_nlink));
 	for (i = 0; i < 9; i++) 
 		si->blkaddr[i] = di->i_blkaddr[i];
+	si->i_flags = 0;
+	if (SFS_SB(si->vfs_inode.i_sb)->s_inode_size > SFS_OLD_INODE_SIZE)
+		si->i_flags = le32_to_cpu(di->i_flags);
+	if (sfs_has_feature(si->vfs_inode.i_sb, SFS_FEATURE_BLOCK_COUNT))
+		si->vfs_inode.i_blocks = (blkcnt_t)le32_to_cpu(di->i_blocks) <<
+			(si->vfs_inode.i_sb->s_blocksize_bits - 9);
 }
 
 static inline sector_t sfs_inode_block(struct sfs_sb_info const *sbi,
@@ -33,7 +39,26 @@ static inline sector_t sfs_inode_block(struct sfs_sb_info const *sbi,
 
 static size_t sfs_inode_offset(struct sfs_sb_info const *sbi, ino_t ino)
 {
-	return sizeof(struct sfs_inode) * (ino % sbi->s_inodes_per_block);
+	return sbi->s_inode_size * (ino % sbi->s_inodes_per_block);
+}
+
+/*
+ * Starts reading the inode table block of @ino without waiting for it.
+ * Returns the block so that callers walking many inodes can skip the
+ * ones sharing it.
+ */
+sector_t sfs_inode_readahead(struct super_block *sb, ino_t ino,
+			sector_t last)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	sector_t block;
+
+	if (!ino || ino > sbi->s_ninodes)
+		return last;
+	block = sfs_inode_block(sbi, ino);
+	if (block != last)
+		sb_breadahead(sb, block);
+	return block;
 }
 
 /*
@@ -44,18 +69,26 @@ void sfs_truncate(struct inode * inode)
 	if (!(S_ISREG(inode->i_mode) || 
 		S_ISDIR(inode->i_mode) || S_ISLNK(inode->i_mode)))
 		return;
+	/* inline data and fast symlinks own no blocks */
+	if (sfs_has_inline_data(inode) || sfs_fast_symlink(inode))
+		return;
 	sfs_truncate_inode(inode);
 }
 
 void sfs_evict_inode(struct inode *inode)
 {
 	truncate_inode_pages(&inode->i_data, 0);
+	sfs_da_release(inode, atomic_read(&SFS_INODE(inode)->i_reserved));
 	if (!inode->i_nlink) {
 		inode->i_size = 0;
 		sfs_truncate(inode);
 	}
+	sfs_discard_prealloc(inode);
 	invalidate_inode_buffers(inode);
 	clear_inode(inode);
+	if (S_ISDIR(inode->i_mode))
+		sfs_dir_drop_hint(inode);
+	sfs_map_drop(inode);
 	if (!inode->i_nlink)
 		sfs_free_inode(inode);
 }
@@ -70,7 +103,10 @@ void sfs_set_inode(struct inode *inode, dev_t rdev)
 		inode->i_op = &sfs_dir_inode_ops;
 		inode->i_fop = &sfs_dir_ops;
 	} else if (S_ISLNK(inode->i_mode)) {
-		inode->i_op = &sfs_symlink_inode_ops;
+		if (sfs_fast_symlink(inode))
+			inode->i_op = &sfs_fast_symlink_inode_ops;
+		else
+			inode->i_op = &sfs_symlink_inode_ops;
 	} else { 
 		inode->i_mapping->a_ops = NULL;
 		init_special_inode(inode, inode->i_mode, rdev);
@@ -140,17 +176,10 @@ struct sfs_inode *sfs_get_inode(struct super_block *sb, ino_t ino,
 	return (struct sfs_inode *)((*p)->b_data + offset);
 }
 
-static struct buffer_head *sfs_update_inode(struct inode *inode)
+static void sfs_fill_disk_inode(struct inode *inode, struct sfs_inode *di)
 {
-	struct buffer_head *bh;
-	struct sfs_inode_info *si;
-	struct sfs_inode *di;
+	struct sfs_inode_info *si = SFS_INODE(inode);
 	int i;
-	
-	si = SFS_INODE(inode);
-	di = sfs_get_inode(inode->i_sb, inode->i_ino, &bh);
-	if (!di)
-		return NULL;
 
 	di->i_size = cpu_to_le32(inode->i_size);
 	di->i_mode = cpu_to_le16(inode->i_mode);
@@ -166,17 +195,64 @@ static struct buffer_head *sfs_update_inode(struct inode *inode)
 			di->i_blkaddr[i] = cpu_to_le32(0);
 	} else for (i = 0; i < 9; i++)
 			di->i_blkaddr[i] = si->blkaddr[i];
+	if (SFS_SB(inode->i_sb)->s_inode_size > SFS_OLD_INODE_SIZE)
+		di->i_flags = cpu_to_le32(si->i_flags);
+	if (sfs_has_feature(inode->i_sb, SFS_FEATURE_BLOCK_COUNT))
+		di->i_blocks = cpu_to_le32(inode->i_blocks >>
+					   (inode->i_sb->s_blocksize_bits - 9));
+}
+
+static struct buffer_head *sfs_update_inode(struct inode *inode)
+{
+	struct buffer_head *bh;
+	struct sfs_inode *di;
 
+	di = sfs_get_inode(inode->i_sb, inode->i_ino, &bh);
+	if (!di)
+		return NULL;
+	sfs_fill_disk_inode(inode, di);
 	mark_buffer_dirty(bh);
 	return bh;
 }
 
+/*
+ * With a journal, the inode is logged as soon as it is dirtied, in the
+ * handle of the caller or in one of its own.
+ */
+void sfs_dirty_inode(struct inode *inode, int flags)
+{
+	struct buffer_head *bh = NULL;
+	struct sfs_inode *di;
+	handle_t *handle;
+
+	if (!SFS_SB(inode->i_sb)->s_journal)
+		return;
+	handle = sfs_journal_start(inode->i_sb, SFS_INODE_CREDITS);
+	if (IS_ERR(handle))
+		return;
+	di = sfs_get_inode(inode->i_sb, inode->i_ino, &bh);
+	if (di && !sfs_journal_get_write_access(handle, bh)) {
+		sfs_fill_disk_inode(inode, di);
+		if (!sfs_journal_dirty(handle, bh))
+			SFS_INODE(inode)->i_sync_tid =
+				handle->h_transaction->t_tid;
+	}
+	brelse(bh);
+	sfs_journal_stop(handle);
+}
+
 int sfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
 	int err = 0;
 	struct buffer_head *bh;
 
 	pr_debug("Enter: sfs_write_inode (ino = %ld)\n", inode->i_ino);
+	if (SFS_SB(inode->i_sb)->s_journal) {
+		/* sfs_dirty_inode() logged it, sync_fs commits for sync(2) */
+		if (wbc->sync_mode != WB_SYNC_ALL || wbc->for_sync)
+			return 0;
+		return sfs_journal_commit_inode(inode);
+	}
 	bh = sfs_update_inode(inode);
 	if (!bh)
 		return -EIO;
@@ -198,19 +274,25 @@ static int
 sfs_writepage(struct page *page, struct writeback_control *wbc)
 {
 	pr_debug("sfs_writepage called\n");
-	return block_write_full_page(page, sfs_get_block, wbc);
+	if (sfs_has_inline_data(page->mapping->host))
+		return sfs_inline_writepage(page, wbc);
+	return block_write_full_page(page, sfs_da_get_block_write, wbc);
 }
 
 static int 
 sfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
 {
 	pr_debug("sfs_writepages called\n");
-	return mpage_writepages(mapping, wbc, sfs_get_block);
+	if (sfs_has_inline_data(mapping->host))
+		return generic_writepages(mapping, wbc);
+	return sfs_da_writepages(mapping, wbc);
 }
 
 static int sfs_readpage(struct file *file, struct page *page)
 {
 	pr_debug("sfs_readpage called\n");
+	if (sfs_has_inline_data(page->mapping->host))
+		return sfs_inline_readpage(page);
 	return mpage_readpage(page, sfs_get_block);
 }
 
@@ -219,6 +301,9 @@ sfs_readpages(struct file *file, struct address_space *mapping,
 			struct list_head *pages, unsigned nr_pages)
 {
 	pr_debug("sfs_readpages called\n");
+	/* ->readpage fills inline pages as they are needed */
+	if (sfs_has_inline_data(mapping->host))
+		return 0;
 	return mpage_readpages(mapping, pages, nr_pages, sfs_get_block);
 }
 
@@ -229,6 +314,9 @@ static ssize_t sfs_direct_io(int rw, struct kiocb *iocb,
 	struct inode *inode = file_inode(iocb->ki_filp);
 
 	pr_debug("sfs_direct_io called\n");
+	/* 0 makes the caller fall back to buffered I/O */
+	if (sfs_has_inline_data(inode))
+		return 0;
 	return blockdev_direct_IO(rw, iocb, inode, iov, off, 
 				nr_segs, sfs_get_block);
 }
@@ -248,6 +336,7 @@ static void sfs_write_failed(struct address_space *mapping, loff_t to)
 
 	pr_debug("sfs_write_failed called.\n");
 	if (to > inode->i_size) {
+		sfs_journal_wait_tail_page(inode, inode->i_size);
 		truncate_pagecache(inode, inode->i_size);
 		sfs_truncate(inode);
 	}	
@@ -258,10 +347,20 @@ sfs_write_begin(struct file *file, struct address_space *mapping,
 		loff_t pos, unsigned len, unsigned flags,
 		struct page **pagep, void **fsdata)
 {
+	struct inode *inode = mapping->host;
 	int ret;
 
 	pr_debug("sfs_write_begin called\n");
-	ret = block_write_begin(mapping, pos, len, flags, pagep, sfs_get_block);
+	if (sfs_has_inline_data(inode)) {
+		if (pos + len <= sfs_inline_size(inode->i_sb))
+			return sfs_inline_write_begin(mapping, pos, flags,
+						      pagep);
+		ret = sfs_inline_convert_file(inode);
+		if (ret < 0)
+			return ret;
+	}
+	ret = block_write_begin(mapping, pos, len, flags, pagep,
+				sfs_da_get_block_prep);
 	if (ret < 0)
 		sfs_write_failed(mapping, pos + len);
 	return ret;
@@ -274,7 +373,12 @@ static int sfs_write_end(struct file *file, struct address_space *mapping,
 	int ret;
 
 	pr_debug("sfs_write_end called\n");
-	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+	if (sfs_has_inline_data(mapping->host))
+		ret = simple_write_end(file, mapping, pos, len, copied, page,
+				       fsdata);
+	else
+		ret = generic_write_end(file, mapping, pos, len, copied, page,
+					fsdata);
 	
 	mark_inode_dirty(mapping->host);
 
@@ -283,9 +387,30 @@ static int sfs_write_end(struct file *file, struct address_space *mapping,
 	return ret;
 }
 
+static void sfs_invalidatepage(struct page *page, unsigned int offset,
+			unsigned int length)
+{
+	if (sfs_journal_dir(page->mapping->host))
+		sfs_journal_invalidatepage(page, offset, length);
+	else
+		sfs_da_invalidatepage(page, offset, length);
+}
+
+static int sfs_releasepage(struct page *page, gfp_t wait)
+{
+	if (sfs_journal_dir(page->mapping->host))
+		return sfs_journal_releasepage(page, wait);
+	return try_to_free_buffers(page);
+}
+
 static sector_t sfs_bmap(struct address_space *mapping, sector_t block)
 {
 	pr_debug("sfs_bmap called\n");
+	if (sfs_has_inline_data(mapping->host))
+		return 0;
+	/* delayed blocks have no address until they are written */
+	if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+		filemap_write_and_wait(mapping);
 	return generic_block_bmap(mapping, block, sfs_get_block);
 }
 
@@ -296,6 +421,8 @@ const struct address_space_operations sfs_aops = {
 	.writepages = sfs_writepages,
 	.write_begin = sfs_write_begin,
 	.write_end = sfs_write_end,
+	.invalidatepage = sfs_invalidatepage,
+	.releasepage = sfs_releasepage,
 	.bmap = sfs_bmap, 
 	.direct_IO = sfs_direct_io
 };
@@ -0,0 +1,34 @@
+/*
+	ioctl handling for sfs files and directories.
+*/
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/capability.h>
+#include <linux/uaccess.h>
+#include "sfs.h"
+
+long sfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct super_block *sb = file_inode(filp)->i_sb;
+	struct fstrim_range __user *urange = (struct fstrim_range __user *)arg;
+	struct fstrim_range range;
+	int err;
+
+	switch (cmd) {
+	case FITRIM:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (!blk_queue_discard(bdev_get_queue(sb->s_bdev)))
+			return -EOPNOTSUPP;
+		if (copy_from_user(&range, urange, sizeof(range)))
+			return -EFAULT;
+		err = sfs_trim_fs(sb, &range);
+		if (err < 0)
+			return err;
+		if (copy_to_user(urange, &range, sizeof(range)))
+			return -EFAULT;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
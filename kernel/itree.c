@@ -20,9 +20,11 @@ static inline block_t *i_data(struct inode *inode)
 #define DIRCOUNT 6
 #define INDIRCOUNT(sb) (1 << ((sb)->s_blocksize_bits - 2))
 
-static int block_to_path(struct inode * inode, long block, int offsets[DEPTH])
+static int block_to_path(struct inode * inode, long block, int offsets[DEPTH],
+			 int *boundary)
 {
 	int n = 0;
+	int final = 0;
 	char b[BDEVNAME_SIZE];
 	struct super_block *sb = inode->i_sb;
 
@@ -36,20 +38,27 @@ static int block_to_path(struct inode * inode, long block, int offsets[DEPTH])
 				block, bdevname(sb->s_bdev, b));
 	} else if (block < DIRCOUNT) {
 		offsets[n++] = block;
+		final = DIRCOUNT;
 	} else if ((block -= DIRCOUNT) < INDIRCOUNT(sb)) {
 		offsets[n++] = DIRCOUNT;
 		offsets[n++] = block;
+		final = INDIRCOUNT(sb);
 	} else if ((block -= INDIRCOUNT(sb)) < INDIRCOUNT(sb) * INDIRCOUNT(sb)) {
 		offsets[n++] = DIRCOUNT + 1;
 		offsets[n++] = block / INDIRCOUNT(sb);
 		offsets[n++] = block % INDIRCOUNT(sb);
+		final = INDIRCOUNT(sb);
 	} else {
 		block -= INDIRCOUNT(sb) * INDIRCOUNT(sb);
 		offsets[n++] = DIRCOUNT + 2;
 		offsets[n++] = (block / INDIRCOUNT(sb)) / INDIRCOUNT(sb);
 		offsets[n++] = (block / INDIRCOUNT(sb)) % INDIRCOUNT(sb);
 		offsets[n++] = block % INDIRCOUNT(sb);
+		final = INDIRCOUNT(sb);
 	}
+	/* blocks left in the same leaf after this one */
+	if (n)
+		*boundary = final - 1 - offsets[n - 1];
 	return n;
 }
 
@@ -59,7 +68,15 @@ typedef struct {
 	struct buffer_head *bh;
 } Indirect;
 
-static DEFINE_RWLOCK(pointers_lock);
+/*
+ * Pointer updates in an inode's indirect tree are serialized by its
+ * i_pointers_lock; lookups only check that the chain did not change
+ * under them, so they run without taking anything.
+ */
+static inline seqlock_t *pointers_lock(struct inode *inode)
+{
+	return &SFS_INODE(inode)->i_pointers_lock;
+}
 
 static inline void add_chain(Indirect *p, struct buffer_head *bh, block_t *v)
 {
@@ -88,6 +105,8 @@ static inline Indirect *get_branch(struct inode *inode,
 	struct super_block *sb = inode->i_sb;
 	Indirect *p = chain;
 	struct buffer_head *bh;
+	unsigned seq;
+	int ok;
 
 	*err = 0;
 	/* i_data is not going away, no lock needed */
@@ -98,18 +117,23 @@ static inline Indirect *get_branch(struct inode *inode,
 		bh = sb_bread(sb, block_to_cpu(p->key));
 		if (!bh)
 			goto failure;
-		read_lock(&pointers_lock);
-		if (!verify_chain(chain, p))
+		do {
+			seq = read_seqbegin(pointers_lock(inode));
+			ok = verify_chain(chain, p);
+			if (ok)
+				add_chain(p + 1, bh,
+					  (block_t *)bh->b_data + offsets[1]);
+		} while (read_seqretry(pointers_lock(inode), seq));
+		if (!ok)
 			goto changed;
-		add_chain(++p, bh, (block_t *)bh->b_data + *++offsets);
-		read_unlock(&pointers_lock);
+		p++;
+		offsets++;
 		if (!p->key)
 			goto no_block;
 	}
 	return NULL;
 
 changed:
-	read_unlock(&pointers_lock);
 	brelse(bh);
 	*err = -EAGAIN;
 	goto no_block;
@@ -119,62 +143,167 @@ no_block:
 	return p;
 }
 
-static int alloc_branch(struct inode *inode,
+/*
+ * How many blocks to allocate for the branch: everything up to the end of
+ * the leaf if the leaf itself is new, otherwise the run of holes that
+ * follows the first one in the existing leaf.
+ */
+static int blks_to_allocate(Indirect *branch, int k, unsigned long blks,
+			    int boundary)
+{
+	unsigned long count = 1;
+
+	if (k > 0)
+		return min_t(unsigned long, blks, boundary + 1);
+	while (count < blks && count <= boundary &&
+	       !block_to_cpu(*(branch[0].p + count)))
+		count++;
+	return count;
+}
+
+static void free_branch_blocks(handle_t *handle, struct inode *inode,
+			       Indirect *branch, int num, int count)
+{
+	int i;
+
+	for (i = 1; i < num; i++)
+		sfs_journal_forget(handle, branch[i].bh);
+	for (i = 0; i < num - 1; i++)
+		sfs_free_block(inode, block_to_cpu(branch[i].key));
+	sfs_free_blocks(inode, block_to_cpu(branch[num - 1].key), count);
+}
+
+/*
+ * Allocate the missing indirect blocks one by one, then a contiguous run
+ * of up to *count data blocks.  *count is set to the run length.
+ */
+static int alloc_branch(handle_t *handle,
+			     struct inode *inode,
+			     long block,
 			     int num,
 			     int *offsets,
-			     Indirect *branch)
+			     Indirect *branch,
+			     int *count,
+			     unsigned long goal)
 {
 	int n = 0;
 	int i;
 	int err;
-	int parent = sfs_new_block(inode, &err);
+	unsigned long run = 1;
+	int parent;
+
+	if (num == 1) {
+		run = *count;
+		parent = sfs_new_data_blocks(inode, block, goal, &run, &err);
+	} else
+		parent = sfs_new_blocks(inode, goal, &run, &err);
 
 	branch[0].key = cpu_to_block(parent);
 	if (parent) for (n = 1; n < num; n++) {
 		struct buffer_head *bh;
-		/* Allocate the next block */
-		int nr = sfs_new_block(inode, &err);
+		/* Allocate the next block, the data run at the last level */
+		int nr;
+
+		run = 1;
+		if (n == num - 1) {
+			run = *count;
+			nr = sfs_new_data_blocks(inode, block, parent + 1,
+						 &run, &err);
+		} else
+			nr = sfs_new_blocks(inode, parent + 1, &run, &err);
 		if (!nr)
 			break;
 		branch[n].key = cpu_to_block(nr);
 		bh = sb_getblk(inode->i_sb, parent);
 		lock_buffer(bh);
+		err = sfs_journal_get_create_access(handle, bh);
+		if (err) {
+			unlock_buffer(bh);
+			brelse(bh);
+			sfs_free_blocks(inode, nr, run);
+			break;
+		}
 		memset(bh->b_data, 0, bh->b_size);
 		branch[n].bh = bh;
 		branch[n].p = (block_t*) bh->b_data + offsets[n];
-		*branch[n].p = branch[n].key;
+		for (i = 0; i < run; i++)
+			branch[n].p[i] = cpu_to_block(nr + i);
 		set_buffer_uptodate(bh);
 		unlock_buffer(bh);
-		mark_buffer_dirty_inode(bh, inode);
+		sfs_journal_dirty_map(handle, inode, bh);
 		parent = nr;
 	}
-	if (n == num)
+	if (n == num) {
+		*count = run;
 		return 0;
+	}
 
 	/* Allocation failed, free what we already allocated */
-	for (i = 1; i < n; i++)
-		bforget(branch[i].bh);
-	for (i = 0; i < n; i++)
-		sfs_free_block(inode, block_to_cpu(branch[i].key));
-	return -ENOSPC;
+	if (n)
+		free_branch_blocks(handle, inode, branch, n, 1);
+	return err ? err : -ENOSPC;
+}
+
+/* The closest allocated block to the left of ind->p, to allocate near */
+static inline unsigned long find_near(struct inode *inode, Indirect *ind)
+{
+	block_t *start = ind->bh ? (block_t *)ind->bh->b_data : i_data(inode);
+	block_t *p;
+
+	for (p = ind->p - 1; p >= start; p--)
+		if (*p)
+			return block_to_cpu(*p);
+
+	/* No such thing, so let's try location of indirect block */
+	if (ind->bh)
+		return ind->bh->b_blocknr;
+	return SFS_INODE(inode)->i_dir_goal;
+}
+
+static inline unsigned long find_goal(struct inode *inode, long block,
+				      Indirect *partial)
+{
+	struct sfs_inode_info *si = SFS_INODE(inode);
+
+	/* Sequential writes continue where the last allocation stopped */
+	if (block == si->i_next_block && si->i_next_goal)
+		return si->i_next_goal;
+	return find_near(inode, partial);
 }
 
-static inline int splice_branch(struct inode *inode,
+static inline int splice_branch(handle_t *handle,
+				     struct inode *inode,
 				     Indirect chain[DEPTH],
 				     Indirect *where,
-				     int num)
+				     int num,
+				     int count)
 {
-	int i;
+	int i, err;
+
+	if (where->bh) {
+		err = sfs_journal_get_write_access(handle, where->bh);
+		if (err) {
+			free_branch_blocks(handle, inode, where, num, count);
+			return err;
+		}
+	}
 
-	write_lock(&pointers_lock);
+	write_seqlock(pointers_lock(inode));
 
 	/* Verify that place we are splicing to is still there and vacant */
-	if (!verify_chain(chain, where-1) || *where->p)
+	if (!verify_chain(chain, where-1))
 		goto changed;
+	for (i = 0; i < (num == 1 ? count : 1); i++)
+		if (where->p[i])
+			goto changed;
 
 	*where->p = where->key;
+	/* a run spliced straight into an existing leaf */
+	if (num == 1)
+		for (i = 1; i < count; i++)
+			where->p[i] = cpu_to_block(block_to_cpu(where->key) + i);
 
-	write_unlock(&pointers_lock);
+	write_sequnlock(pointers_lock(inode));
 
 	/* We are done with atomic stuff, now do the rest of housekeeping */
 
@@ -182,17 +311,14 @@ static inline int splice_branch(struct inode *inode,
 
 	/* had we spliced it onto indirect block? */
 	if (where->bh)
-		mark_buffer_dirty_inode(where->bh, inode);
+		sfs_journal_dirty_map(handle, inode, where->bh);
 
 	mark_inode_dirty(inode);
 	return 0;
 
 changed:
-	write_unlock(&pointers_lock);
-	for (i = 1; i < num; i++)
-		bforget(where[i].bh);
-	for (i = 0; i < num; i++)
-		sfs_free_block(inode, block_to_cpu(where[i].key));
+	write_sequnlock(pointers_lock(inode));
+	free_branch_blocks(handle, inode, where, num, count);
 	return -EAGAIN;
 }
 
@@ -204,20 +330,48 @@ static inline int get_block(struct inode * inode, sector_t block,
 	Indirect chain[DEPTH];
 	Indirect *partial;
 	int left;
-	int depth = block_to_path(inode, block, offsets);
+	int boundary = 0;
+	int maxblocks = bh->b_size >> inode->i_blkbits;
+	int count = 0;
+	handle_t *handle;
+	block_t first;
+	u32 pblk;
+	unsigned seq;
+	int depth = block_to_path(inode, block, offsets, &boundary);
 
 	if (depth == 0)
 		goto out;
+	if (maxblocks < 1)
+		maxblocks = 1;
+
+	count = sfs_map_lookup(inode, block, &pblk);
+	if (count) {
+		map_bh(bh, inode->i_sb, pblk);
+		bh->b_size = min(count, maxblocks) << inode->i_blkbits;
+		return 0;
+	}
 
 reread:
 	partial = get_branch(inode, depth, offsets, chain, &err);
 
 	/* Simplest case - block found, no allocation needed */
 	if (!partial) {
+		/* Extend the mapping over the physically contiguous run */
+		first = block_to_cpu(chain[depth-1].key);
+		do {
+			seq = read_seqbegin(pointers_lock(inode));
+			for (count = 1; count < maxblocks && count <= boundary;
+			     count++)
+				if (block_to_cpu(chain[depth-1].p[count]) !=
+				    first + count)
+					break;
+		} while (read_seqretry(pointers_lock(inode), seq));
+		sfs_map_insert(inode, block, first, count);
 got_it:
-		pr_debug("ino %ld, block %ld -> %d\n", inode->i_ino, 
-			block, block_to_cpu(chain[depth-1].key)); 
+		pr_debug("ino %ld, block %ld -> %d (%d)\n", inode->i_ino, 
+			block, block_to_cpu(chain[depth-1].key), count); 
 		map_bh(bh, inode->i_sb, block_to_cpu(chain[depth-1].key));
+		bh->b_size = count << inode->i_blkbits;
 		/* Clean up and exit */
 		partial = chain+depth-1; /* the whole chain */
 		goto cleanup;
@@ -244,12 +398,25 @@ out:
 		goto changed;
 
 	left = (chain + depth) - partial;
-	err = alloc_branch(inode, left, offsets+(partial-chain), partial);
-	if (err)
+	count = blks_to_allocate(partial, left - 1, maxblocks, boundary);
+	/* The new pointers commit with the bitmap bits of their blocks */
+	handle = sfs_journal_start(inode->i_sb, SFS_MAP_CREDITS);
+	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
 		goto cleanup;
-
-	if (splice_branch(inode, chain, partial, left) < 0)
+	}
+	err = alloc_branch(handle, inode, block, left, offsets+(partial-chain),
+			   partial, &count, find_goal(inode, block, partial));
+	if (!err)
+		err = splice_branch(handle, inode, chain, partial, left, count);
+	sfs_journal_stop(handle);
+	if (err == -EAGAIN)
 		goto changed;
+	if (err)
+		goto cleanup;
+	SFS_INODE(inode)->i_next_block = block + count;
+	SFS_INODE(inode)->i_next_goal = block_to_cpu(chain[depth-1].key) + count;
+	sfs_map_insert(inode, block, block_to_cpu(chain[depth-1].key), count);
 
 	set_buffer_new(bh);
 	goto got_it;
@@ -284,22 +451,20 @@ static Indirect *find_shared(struct inode *inode,
 		;
 	partial = get_branch(inode, k, offsets, chain, &err);
 
-	write_lock(&pointers_lock);
 	if (!partial)
 		partial = chain + k-1;
-	if (!partial->key && *partial->p) {
-		write_unlock(&pointers_lock);
+	if (!partial->key && *partial->p)
 		goto no_top;
-	}
 	for (p=partial;p>chain && all_zeroes((block_t*)p->bh->b_data,p->p);p--)
 		;
-	if (p == chain + k - 1 && p > chain) {
+	/*
+	 * The subtree at *p->p is left in place; free_branches() clears
+	 * the pointer once everything below it is gone.
+	 */
+	if (p == chain + k - 1 && p > chain)
 		p->p--;
-	} else {
+	else
 		*top = *p->p;
-		*p->p = 0;
-	}
-	write_unlock(&pointers_lock);
 
 	while(partial > p)
 	{
@@ -310,41 +475,92 @@ no_top:
 	return partial;
 }
 
-static inline void free_data(struct inode *inode, block_t *p, block_t *q)
+/*
+ * Clear the pointers in [p, q) and free their blocks, a run at a time.
+ * They live in @bh, which the caller got write access to, or in the
+ * inode if @bh is NULL.  A run is freed in the transaction that clears
+ * its pointers.
+ */
+static inline int free_data(handle_t *handle, struct inode *inode,
+			    struct buffer_head *bh, block_t *p, block_t *q)
 {
-	unsigned long nr;
+	unsigned long nr, start = 0, len = 0;
+	int err;
 
 	for ( ; p < q ; p++) {
 		nr = block_to_cpu(*p);
-		if (nr) {
+		if (!nr)
+			continue;
+		if (len && nr == start + len) {
 			*p = 0;
-			sfs_free_block(inode, nr);
+			len++;
+			continue;
 		}
+		if (len)
+			sfs_free_blocks(inode, start, len);
+		len = 0;
+		err = sfs_journal_extend(handle, inode, bh, SFS_FREE_CREDITS);
+		if (err)
+			return err;
+		*p = 0;
+		start = nr;
+		len = 1;
 	}
+	if (len)
+		sfs_free_blocks(inode, start, len);
+	return 0;
 }
 
-static void free_branches(struct inode *inode, block_t *p, block_t *q, int depth)
+/*
+ * Free the subtrees of @depth levels below [p, q), which live in @parent
+ * (or in the inode).  A tree block is freed, and its pointer cleared,
+ * only after everything below it, so whatever a crash leaves behind is
+ * still reachable.
+ */
+static int free_branches(handle_t *handle, struct inode *inode,
+			 struct buffer_head *parent, block_t *p, block_t *q,
+			 int depth)
 {
 	struct buffer_head * bh;
 	unsigned long nr;
+	int err;
 
-	if (depth--) {
-		for ( ; p < q ; p++) {
-			nr = block_to_cpu(*p);
-			if (!nr)
-				continue;
-			*p = 0;
-			bh = sb_bread(inode->i_sb, nr);
-			if (!bh)
-				continue;
-			free_branches(inode, (block_t*)bh->b_data,
-				      block_end(bh), depth);
-			bforget(bh);
-			sfs_free_block(inode, nr);
-			mark_inode_dirty(inode);
+	if (!depth--)
+		return free_data(handle, inode, parent, p, q);
+
+	for ( ; p < q ; p++) {
+		nr = block_to_cpu(*p);
+		if (!nr)
+			continue;
+		bh = sb_bread(inode->i_sb, nr);
+		if (!bh)
+			continue;
+		err = sfs_journal_get_write_access(handle, bh);
+		if (!err)
+			err = free_branches(handle, inode, bh,
+					    (block_t*)bh->b_data,
+					    block_end(bh), depth);
+		if (!err)
+			err = sfs_journal_dirty_map(handle, inode, bh);
+		/* a restart below left @parent in the old transaction */
+		if (!err)
+			err = sfs_journal_extend(handle, inode, NULL,
+						 SFS_FREE_CREDITS);
+		if (!err && parent)
+			err = sfs_journal_get_write_access(handle, parent);
+		if (err) {
+			brelse(bh);
+			return err;
 		}
-	} else
-		free_data(inode, p, q);
+		sfs_journal_forget(handle, bh);
+		sfs_free_block(inode, nr);
+		*p = 0;
+		if (parent)
+			sfs_journal_dirty_map(handle, inode, parent);
+		else
+			mark_inode_dirty(inode);
+	}
+	return 0;
 }
 
 static inline void truncate (struct inode * inode)
@@ -355,53 +571,74 @@ static inline void truncate (struct inode * inode)
 	Indirect chain[DEPTH];
 	Indirect *partial;
 	block_t nr = 0;
+	handle_t *handle;
 	int n;
 	int first_whole;
+	int boundary;
+	int err = 0;
 	long iblock;
 
 	iblock = (inode->i_size + sb->s_blocksize -1) >> sb->s_blocksize_bits;
+	/* takes the page lock, which comes before a handle */
 	block_truncate_page(inode->i_mapping, inode->i_size, get_block);
+	sfs_map_remove(inode, iblock);
 
-	n = block_to_path(inode, iblock, offsets);
+	n = block_to_path(inode, iblock, offsets, &boundary);
 	if (!n)
 		return;
 
+	handle = sfs_journal_start(sb, SFS_TRUNCATE_CREDITS);
+	if (IS_ERR(handle)) {
+		pr_err("sfs: cannot log the truncate of inode %lu\n",
+			inode->i_ino);
+		return;
+	}
+
 	if (n == 1) {
-		free_data(inode, idata+offsets[0], idata + DIRECT);
+		err = free_data(handle, inode, NULL, idata+offsets[0],
+				idata + DIRECT);
 		first_whole = 0;
 		goto do_indirects;
 	}
 
 	first_whole = offsets[0] + 1 - DIRECT;
 	partial = find_shared(inode, n, offsets, chain, &nr);
-	if (nr) {
-		if (partial == chain)
-			mark_inode_dirty(inode);
-		else
-			mark_buffer_dirty_inode(partial->bh, inode);
-		free_branches(inode, &nr, &nr+1, (chain+n-1) - partial);
-	}
+	if (nr && partial > chain)
+		err = sfs_journal_get_write_access(handle, partial->bh);
+	if (nr && !err)
+		err = free_branches(handle, inode,
+				    partial > chain ? partial->bh : NULL,
+				    partial->p, partial->p + 1,
+				    (chain+n-1) - partial);
 	/* Clear the ends of indirect blocks on the shared branch */
 	while (partial > chain) {
-		free_branches(inode, partial->p + 1, block_end(partial->bh),
-				(chain+n-1) - partial);
-		mark_buffer_dirty_inode(partial->bh, inode);
+		if (!err)
+			err = sfs_journal_get_write_access(handle, partial->bh);
+		if (!err)
+			err = free_branches(handle, inode, partial->bh,
+					    partial->p + 1,
+					    block_end(partial->bh),
+					    (chain+n-1) - partial);
+		if (!err)
+			err = sfs_journal_dirty_map(handle, inode, partial->bh);
 		brelse (partial->bh);
 		partial--;
 	}
 do_indirects:
 	/* Kill the remaining (whole) subtrees */
-	while (first_whole < DEPTH-1) {
-		nr = idata[DIRECT+first_whole];
-		if (nr) {
-			idata[DIRECT+first_whole] = 0;
-			mark_inode_dirty(inode);
-			free_branches(inode, &nr, &nr+1, first_whole+1);
-		}
+	while (!err && first_whole < DEPTH-1) {
+		err = free_branches(handle, inode, NULL,
+				    idata + DIRECT + first_whole,
+				    idata + DIRECT + first_whole + 1,
+				    first_whole + 1);
 		first_whole++;
 	}
+	if (err)
+		pr_err("sfs: truncate of inode %lu failed (%d)\n",
+			inode->i_ino, err);
 	inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
 	mark_inode_dirty(inode);
+	sfs_journal_stop(handle);
 }
 
 static inline unsigned nblocks(loff_t size, struct super_block *sb)
@@ -420,6 +657,14 @@ static inline unsigned nblocks(loff_t size, struct super_block *sb)
 	return res;
 }
 
+/* Some block of the file, as an allocation goal for its neighbours */
+unsigned long sfs_first_block(struct inode *inode)
+{
+	if (SFS_INODE(inode)->i_flags & SFS_EXTENTS_FL)
+		return sfs_ext_first_block(inode);
+	return block_to_cpu(i_data(inode)[0]);
+}
+
 unsigned sfs_blocks(loff_t size, struct super_block *sb)
 {
 	return nblocks(size, sb);
@@ -427,11 +672,118 @@ unsigned sfs_blocks(loff_t size, struct super_block *sb)
 
 void sfs_truncate_inode(struct inode *inode)
 {
-	truncate(inode);
+	sfs_discard_prealloc(inode);
+	if (SFS_INODE(inode)->i_flags & SFS_EXTENTS_FL)
+		sfs_ext_truncate(inode);
+	else
+		truncate(inode);
+}
+
+/* Free the data blocks in [start, end); indirect blocks stay in place */
+static int punch(handle_t *handle, struct inode *inode, long start, long end)
+{
+	int offsets[DEPTH];
+	Indirect chain[DEPTH];
+	Indirect *partial;
+	struct buffer_head *bh;
+	int n, err, boundary;
+	long count;
+
+	while (start < end) {
+		n = block_to_path(inode, start, offsets, &boundary);
+		if (!n)
+			break;
+		count = min_t(long, end - start, boundary + 1);
+		partial = get_branch(inode, n, offsets, chain, &err);
+		if (!partial) {
+			bh = chain[n-1].bh;
+			if (bh)
+				err = sfs_journal_get_write_access(handle, bh);
+			if (!err)
+				err = free_data(handle, inode, bh, chain[n-1].p,
+						chain[n-1].p + count);
+			if (!bh)
+				mark_inode_dirty(inode);
+			else if (!err)
+				err = sfs_journal_dirty_map(handle, inode, bh);
+			partial = chain + n - 1;
+		}
+		/* A missing indirect block means the rest of the leaf is a hole */
+		while (partial > chain) {
+			brelse(partial->bh);
+			partial--;
+		}
+		if (err == -EAGAIN)
+			continue;
+		if (err)
+			return err;
+		start += count;
+	}
+	return 0;
+}
+
+int sfs_punch_blocks(struct inode *inode, u32 start, u32 end)
+{
+	handle_t *handle;
+	int err;
+
+	if (SFS_INODE(inode)->i_flags & SFS_EXTENTS_FL)
+		return sfs_ext_punch(inode, start, end);
+	handle = sfs_journal_start(inode->i_sb, SFS_TRUNCATE_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	/*
+	 * A cached run must not outlive the blocks it maps: drop them
+	 * before the blocks are freed, and again for runs a concurrent
+	 * get_block cached meanwhile.
+	 */
+	sfs_map_remove(inode, start);
+	err = punch(handle, inode, start, end);
+	sfs_map_remove(inode, start);
+	sfs_journal_stop(handle);
+	return err;
+}
+
+/*
+ * Allocate the holes in [start, end).  Indirect mapped files have no
+ * unwritten state, so their new blocks (all of them if @zero) are
+ * zeroed on disk; extent files get unwritten extents instead.
+ */
+int sfs_fallocate_blocks(struct inode *inode, u32 start, u32 end, int zero)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head map;
+	unsigned long n;
+	int err = 0;
+
+	if (SFS_INODE(inode)->i_flags & SFS_EXTENTS_FL) {
+		if (zero)
+			err = sfs_ext_punch(inode, start, end);
+		if (!err)
+			err = sfs_ext_fallocate(inode, start, end);
+		return err;
+	}
+	while (start < end) {
+		map.b_state = 0;
+		map.b_size = (size_t)(end - start) << inode->i_blkbits;
+		err = get_block(inode, start, &map, 1);
+		if (err)
+			break;
+		n = map.b_size >> inode->i_blkbits;
+		if (zero || buffer_new(&map)) {
+			err = sb_issue_zeroout(sb, map.b_blocknr, n, GFP_NOFS);
+			if (err)
+				break;
+		}
+		start += n;
+	}
+	return err;
 }
 
 int sfs_get_block(struct inode * inode, sector_t block,
 			struct buffer_head *bh, int create)
 {
+	if (SFS_INODE(inode)->i_flags & SFS_EXTENTS_FL)
+		return sfs_ext_get_block(inode, block, bh, create);
 	return get_block(inode, block, bh, create);
 }
@@ -0,0 +1,462 @@
+/*
+	Metadata journal.
+
+	With SFS_FEATURE_JOURNAL, the inode table, both bitmaps, the
+	indirect and extent tree blocks and the directory blocks are
+	changed through jbd2, in a log of s_journal_blocks blocks that
+	mkfs sets aside at s_journal_start.  A namei operation runs in one
+	handle, so the entry, the inode and the bitmap bits it touches
+	reach the disk together or not at all; so do the pointers and the
+	bits of an allocation, a punch or a step of a truncate.  Directory
+	pages are never dirtied: their buffers are logged, and jbd2 writes
+	them home once the transaction has committed.
+
+	fsync writes the data of the file, then waits for the transaction
+	that last logged its inode.  Transactions gather everything logged
+	in the commit interval, so fsyncs of different files share one
+	sequential log write and one flush.
+
+	File data is not logged and not ordered against the commit that
+	maps it: after a crash, blocks of a file that was not fsynced may
+	still hold what they held before.  Blocks the other way round, freed
+	by a transaction, stay reserved until it commits, so no new owner
+	writes them while a replay could still give them back to the old.
+
+	There is no orphan list.  An inode unlinked while open is only
+	freed at eviction; a crash before that leaks it and its blocks, and
+	nothing finds them again.  A truncate too large for one transaction
+	commits in steps, and a crash between them leaves a file with only
+	part of its tail freed.  Every step keeps the tree consistent, so
+	the file is still readable, but its blocks past i_size stay
+	allocated.
+*/
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/jbd2.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include "sfs.h"
+
+struct sfs_freed_run {
+	struct list_head	fr_list;
+	unsigned long		fr_start;
+	unsigned long		fr_len;
+};
+
+/* The transaction is on disk: its freed runs may be reused now */
+static void sfs_journal_commit_callback(journal_t *journal,
+					transaction_t *transaction)
+{
+	struct super_block *sb = journal->j_private;
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_freed_run *fr, *next;
+	LIST_HEAD(runs);
+
+	spin_lock(&sbi->s_freed_lock);
+	list_splice_init(&transaction->t_private_list, &runs);
+	spin_unlock(&sbi->s_freed_lock);
+	list_for_each_entry_safe(fr, next, &runs, fr_list) {
+		sfs_release_blocks(sb, fr->fr_start, fr->fr_len);
+		list_del(&fr->fr_list);
+		kfree(fr);
+		atomic_dec(&sbi->s_freed_runs);
+	}
+}
+
+int sfs_journal_load(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	journal_t *journal;
+	int err;
+
+	if (sbi->s_journal_start < sbi->s_data_block_start ||
+	    sbi->s_journal_start + sbi->s_journal_blocks > sbi->s_nblocks ||
+	    sbi->s_journal_start + sbi->s_journal_blocks <
+	    sbi->s_journal_start) {
+		pr_err("sfs: journal at %lu, %lu blocks, is outside the fs\n",
+			(unsigned long)sbi->s_journal_start,
+			(unsigned long)sbi->s_journal_blocks);
+		return -EINVAL;
+	}
+	journal = jbd2_journal_init_dev(sb->s_bdev, sb->s_bdev,
+			sbi->s_journal_start, sbi->s_journal_blocks,
+			sb->s_blocksize);
+	if (!journal) {
+		pr_err("sfs: cannot set up the journal\n");
+		return -ENOMEM;
+	}
+	journal->j_private = sb;
+	journal->j_commit_callback = sfs_journal_commit_callback;
+	journal->j_commit_interval = JBD2_DEFAULT_MAX_COMMIT_AGE * HZ;
+	journal->j_flags |= JBD2_BARRIER;
+	/* replays what a crash left in the log */
+	err = jbd2_journal_load(journal);
+	if (err) {
+		pr_err("sfs: cannot load the journal (%d)\n", err);
+		jbd2_journal_destroy(journal);
+		return err;
+	}
+	sbi->s_journal = journal;
+	return 0;
+}
+
+/* Commits what is left and writes everything home */
+int sfs_journal_destroy(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	int err;
+
+	if (!sbi->s_journal)
+		return 0;
+	err = jbd2_journal_destroy(sbi->s_journal);
+	sbi->s_journal = NULL;
+	if (err)
+		pr_err("sfs: journal aborted (%d)\n", err);
+	return err;
+}
+
+/*
+ * Handles nest: inside one the others just join it, and it must have
+ * been started with credits for them.  Without a journal there is no
+ * handle, NULL stands for it, and the helpers below fall back to plain
+ * buffer writes.
+ */
+handle_t *sfs_journal_start(struct super_block *sb, int nblocks)
+{
+	journal_t *journal = SFS_SB(sb)->s_journal;
+
+	if (!journal)
+		return NULL;
+	return jbd2_journal_start(journal, nblocks);
+}
+
+int sfs_journal_stop(handle_t *handle)
+{
+	if (!handle)
+		return 0;
+	return jbd2_journal_stop(handle);
+}
+
+/* Must come before @bh is changed */
+int sfs_journal_get_write_access(handle_t *handle, struct buffer_head *bh)
+{
+	if (!handle)
+		return 0;
+	return jbd2_journal_get_write_access(handle, bh);
+}
+
+/* For a block just allocated, whose old contents do not matter */
+int sfs_journal_get_create_access(handle_t *handle, struct buffer_head *bh)
+{
+	if (!handle)
+		return 0;
+	return jbd2_journal_get_create_access(handle, bh);
+}
+
+/* mark_buffer_dirty_inode() for a block of the block map of @inode */
+int sfs_journal_dirty_map(handle_t *handle, struct inode *inode,
+			  struct buffer_head *bh)
+{
+	if (!handle) {
+		mark_buffer_dirty_inode(bh, inode);
+		return 0;
+	}
+	return jbd2_journal_dirty_metadata(handle, bh);
+}
+
+/* mark_buffer_dirty() for metadata */
+int sfs_journal_dirty(handle_t *handle, struct buffer_head *bh)
+{
+	if (!handle) {
+		mark_buffer_dirty(bh);
+		return 0;
+	}
+	return jbd2_journal_dirty_metadata(handle, bh);
+}
+
+/*
+ * bforget() for a tree block about to be freed.  The revoke record keeps
+ * a replay from writing it over whatever the block is used for next.
+ * Drops the reference to @bh.
+ */
+void sfs_journal_forget(handle_t *handle, struct buffer_head *bh)
+{
+	if (!handle)
+		bforget(bh);
+	else
+		jbd2_journal_revoke(handle, bh->b_blocknr, bh);
+}
+
+/* Whether @handle can dirty @nblocks more buffers, extending it if need be */
+int sfs_journal_room(handle_t *handle, int nblocks)
+{
+	if (!handle || handle->h_buffer_credits >= nblocks)
+		return 1;
+	return jbd2_journal_extend(handle, nblocks) == 0;
+}
+
+/*
+ * Make room for @nblocks more buffers in a long running handle, such as
+ * a truncate.  When the transaction cannot take them, what was done so
+ * far commits: @bh (if any) and the inode are logged first, and @bh is
+ * writable again in the new transaction.  A nested handle cannot be
+ * restarted under its outer operation: -ENOSPC.
+ */
+int sfs_journal_extend(handle_t *handle, struct inode *inode,
+		       struct buffer_head *bh, int nblocks)
+{
+	int err;
+
+	if (sfs_journal_room(handle, nblocks))
+		return 0;
+	if (handle->h_ref > 1)
+		return -ENOSPC;
+	if (bh) {
+		err = jbd2_journal_dirty_metadata(handle, bh);
+		if (err)
+			return err;
+	}
+	mark_inode_dirty(inode);
+	err = jbd2_journal_restart(handle, nblocks);
+	if (!err && bh)
+		err = jbd2_journal_get_write_access(handle, bh);
+	return err;
+}
+
+/*
+ * Freed directory blocks may come back as file data, which is not
+ * logged.  Revoke records keep a replay from writing the old entries
+ * over it.
+ */
+void sfs_journal_revoke(struct inode *inode, unsigned long block,
+			unsigned long count)
+{
+	handle_t *handle;
+
+	handle = sfs_journal_start(inode->i_sb, SFS_ALLOC_CREDITS);
+	if (IS_ERR_OR_NULL(handle))
+		return;
+	while (count--)
+		jbd2_journal_revoke(handle, block++, NULL);
+	sfs_journal_stop(handle);
+}
+
+/*
+ * Keeps reserved blocks, just cleared in the bitmap in @handle, until
+ * the transaction commits.  Runs freed back to back are merged.
+ */
+void sfs_journal_release_on_commit(handle_t *handle, unsigned long block,
+				   unsigned long count)
+{
+	transaction_t *transaction = handle->h_transaction;
+	struct sfs_sb_info *sbi = SFS_SB(transaction->t_journal->j_private);
+	struct list_head *list = &transaction->t_private_list;
+	struct sfs_freed_run *fr;
+
+	spin_lock(&sbi->s_freed_lock);
+	if (!list_empty(list)) {
+		fr = list_entry(list->prev, struct sfs_freed_run, fr_list);
+		if (fr->fr_start + fr->fr_len == block) {
+			fr->fr_len += count;
+			spin_unlock(&sbi->s_freed_lock);
+			return;
+		}
+	}
+	spin_unlock(&sbi->s_freed_lock);
+
+	/* the bitmap change is logged, there is no going back */
+	fr = kmalloc(sizeof(*fr), GFP_NOFS | __GFP_NOFAIL);
+	fr->fr_start = block;
+	fr->fr_len = count;
+	atomic_inc(&sbi->s_freed_runs);
+	spin_lock(&sbi->s_freed_lock);
+	list_add_tail(&fr->fr_list, list);
+	spin_unlock(&sbi->s_freed_lock);
+}
+
+/*
+ * Commits the transactions holding freed runs back.  Must not be called
+ * with a handle.  Returns 1 if there were any and the commit went fine.
+ */
+int sfs_journal_commit_freed(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+
+	if (!sbi->s_journal || !atomic_read(&sbi->s_freed_runs))
+		return 0;
+	return !jbd2_journal_force_commit(sbi->s_journal);
+}
+
+typedef int (sfs_bh_fn)(handle_t *handle, struct buffer_head *bh);
+
+/* Calls @fn on the buffers of @page that overlap [from, to) */
+static int walk_buffers(handle_t *handle, struct page *page,
+			unsigned from, unsigned to, sfs_bh_fn *fn)
+{
+	struct buffer_head *head = page_buffers(page), *bh = head;
+	unsigned start = 0, end;
+	int err = 0, ret;
+
+	do {
+		end = start + bh->b_size;
+		if (end > from && start < to) {
+			ret = fn(handle, bh);
+			if (!err)
+				err = ret;
+		}
+		start = end;
+		bh = bh->b_this_page;
+	} while (bh != head);
+	return err;
+}
+
+static int dirty_buffer(handle_t *handle, struct buffer_head *bh)
+{
+	set_buffer_uptodate(bh);
+	clear_buffer_new(bh);
+	return jbd2_journal_dirty_metadata(handle, bh);
+}
+
+/*
+ * The journaled side of sfs_dir_prepare_chunk(): maps the chunk and
+ * starts a handle, stopped by sfs_journal_dir_end() once the chunk is
+ * committed.
+ */
+int sfs_journal_dir_begin(struct page *page, loff_t pos, unsigned len)
+{
+	struct inode *dir = page->mapping->host;
+	unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+	handle_t *handle;
+	int err;
+
+	handle = sfs_journal_start(dir->i_sb, SFS_DIR_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = __block_write_begin(page, pos, len, sfs_get_block);
+	if (!err)
+		err = walk_buffers(handle, page, from, from + len,
+				   jbd2_journal_get_write_access);
+	if (err)
+		sfs_journal_stop(handle);
+	return err;
+}
+
+/* Logs the chunk in place of block_write_end() */
+int sfs_journal_dir_dirty(struct page *page, loff_t pos, unsigned len)
+{
+	unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+
+	return walk_buffers(journal_current_handle(), page, from, from + len,
+			    dirty_buffer);
+}
+
+int sfs_journal_dir_end(struct inode *dir)
+{
+	handle_t *handle = journal_current_handle();
+
+	if (IS_DIRSYNC(dir))
+		handle->h_sync = 1;
+	return sfs_journal_stop(handle);
+}
+
+/*
+ * A page cut in the middle cannot let go of a buffer that the committing
+ * transaction still holds, and ->invalidatepage must not wait for the
+ * commit under the page lock.  So before the page cache is truncated to
+ * @size, wait for it here with the page unlocked.
+ */
+void sfs_journal_wait_tail_page(struct inode *inode, loff_t size)
+{
+	journal_t *journal = SFS_SB(inode->i_sb)->s_journal;
+	unsigned offset = size & (PAGE_CACHE_SIZE - 1);
+	struct page *page;
+	tid_t tid;
+	int ret;
+
+	/* no buffer of the tail page goes away */
+	if (!sfs_journal_dir(inode) || !offset ||
+	    offset > PAGE_CACHE_SIZE - (1 << inode->i_blkbits))
+		return;
+	for (;;) {
+		page = find_lock_page(inode->i_mapping,
+				      size >> PAGE_CACHE_SHIFT);
+		if (!page)
+			return;
+		ret = jbd2_journal_invalidatepage(journal, page, offset,
+						  PAGE_CACHE_SIZE - offset);
+		unlock_page(page);
+		page_cache_release(page);
+		if (ret != -EBUSY)
+			return;
+		tid = 0;
+		read_lock(&journal->j_state_lock);
+		if (journal->j_committing_transaction)
+			tid = journal->j_committing_transaction->t_tid;
+		read_unlock(&journal->j_state_lock);
+		if (tid)
+			jbd2_log_wait_commit(journal, tid);
+	}
+}
+
+/* The buffers of a page being truncated may still be in a transaction */
+void sfs_journal_invalidatepage(struct page *page, unsigned int offset,
+				unsigned int length)
+{
+	journal_t *journal = SFS_SB(page->mapping->host->i_sb)->s_journal;
+
+	/* -EBUSY: sfs_journal_wait_tail_page() was not called first */
+	WARN_ON(jbd2_journal_invalidatepage(journal, page, offset,
+					    length) < 0);
+}
+
+int sfs_journal_releasepage(struct page *page, gfp_t wait)
+{
+	journal_t *journal = SFS_SB(page->mapping->host->i_sb)->s_journal;
+
+	return jbd2_journal_try_to_free_buffers(journal, page, wait);
+}
+
+/*
+ * Waits for the transaction that last logged @inode.  Everybody who
+ * waits on the same transaction shares its commit.  A commit flushes
+ * the disk cache; when there is nothing left to commit, the data just
+ * written needs a flush of its own.
+ */
+int sfs_journal_commit_inode(struct inode *inode)
+{
+	journal_t *journal = SFS_SB(inode->i_sb)->s_journal;
+	tid_t tid = SFS_INODE(inode)->i_sync_tid;
+	int flush = 0, err;
+
+	if ((journal->j_flags & JBD2_BARRIER) &&
+	    !jbd2_trans_will_send_data_barrier(journal, tid))
+		flush = 1;
+	err = jbd2_complete_transaction(journal, tid);
+	if (!err && flush)
+		err = blkdev_issue_flush(inode->i_sb->s_bdev, GFP_KERNEL, NULL);
+	return err;
+}
+
+int sfs_sync_fs(struct super_block *sb, int wait)
+{
+	journal_t *journal = SFS_SB(sb)->s_journal;
+
+	if (!journal || !wait)
+		return 0;
+	return jbd2_journal_force_commit(journal);
+}
+
+int sfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	int err;
+
+	if (!SFS_SB(inode->i_sb)->s_journal)
+		return generic_file_fsync(file, start, end, datasync);
+
+	/* allocating the blocks for it logs the inode */
+	err = filemap_write_and_wait_range(inode->i_mapping, start, end);
+	if (err)
+		return err;
+	return sfs_journal_commit_inode(inode);
+}
@@ -0,0 +1,170 @@
+/*
+	Per-inode cache of logical to physical block runs.
+
+	Indirect-mapped files pay an sb_bread and a verify_chain per level
+	for every get_block.  Runs found (or allocated) once are kept in a
+	small rbtree hung off sfs_inode_info, so later lookups in the same
+	range skip the chain walk.  The cache only ever holds mapped blocks,
+	so it needs dropping only when blocks go away (truncate, evict).
+*/
+#include <linux/slab.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include "sfs.h"
+
+#define SFS_MAP_MAX	128	/* cached runs per inode */
+
+struct sfs_map {
+	struct rb_node	m_node;
+	u32		m_lblk;
+	u32		m_pblk;
+	u32		m_len;
+};
+
+static struct kmem_cache *sfs_map_cachep;
+
+static inline u32 map_end(struct sfs_map *m)
+{
+	return m->m_lblk + m->m_len;
+}
+
+/* The run containing @lblk, or the first one after it if @next */
+static struct sfs_map *map_search(struct sfs_inode_info *si, u32 lblk, int next)
+{
+	struct rb_node *n = si->i_map_tree.rb_node;
+	struct sfs_map *m, *after = NULL;
+
+	while (n) {
+		m = rb_entry(n, struct sfs_map, m_node);
+		if (lblk < m->m_lblk) {
+			after = m;
+			n = n->rb_left;
+		} else if (lblk >= map_end(m))
+			n = n->rb_right;
+		else
+			return m;
+	}
+	return next ? after : NULL;
+}
+
+static void map_erase(struct sfs_inode_info *si, struct sfs_map *m)
+{
+	rb_erase(&m->m_node, &si->i_map_tree);
+	si->i_map_count--;
+	kmem_cache_free(sfs_map_cachep, m);
+}
+
+/* Returns the number of cached mapped blocks from @lblk on, 0 on a miss */
+u32 sfs_map_lookup(struct inode *inode, u32 lblk, u32 *pblk)
+{
+	struct sfs_inode_info *si = SFS_INODE(inode);
+	struct sfs_map *m;
+	u32 len = 0;
+
+	read_lock(&si->i_map_lock);
+	m = map_search(si, lblk, 0);
+	if (m) {
+		*pblk = m->m_pblk + lblk - m->m_lblk;
+		len = map_end(m) - lblk;
+	}
+	read_unlock(&si->i_map_lock);
+	return len;
+}
+
+void sfs_map_insert(struct inode *inode, u32 lblk, u32 pblk, u32 len)
+{
+	struct sfs_inode_info *si = SFS_INODE(inode);
+	struct sfs_map *new, *m;
+	struct rb_node **p, *parent = NULL, *n;
+
+	new = kmem_cache_alloc(sfs_map_cachep, GFP_NOFS);
+	if (!new)
+		return;
+	new->m_lblk = lblk;
+	new->m_pblk = pblk;
+	new->m_len = len;
+
+	write_lock(&si->i_map_lock);
+	/* Runs already cached in the range describe the same blocks */
+	while ((m = map_search(si, lblk, 1)) && m->m_lblk < lblk + len) {
+		if (m->m_lblk <= lblk && map_end(m) >= lblk + len)
+			goto out_free;
+		map_erase(si, m);
+	}
+	m = map_search(si, lblk ? lblk - 1 : 0, 0);
+	if (m && map_end(m) == lblk && m->m_pblk + m->m_len == pblk) {
+		/* glue onto the run on the left */
+		new->m_lblk = m->m_lblk;
+		new->m_pblk = m->m_pblk;
+		new->m_len += m->m_len;
+		map_erase(si, m);
+	}
+	m = map_search(si, map_end(new), 0);
+	if (m && m->m_pblk == new->m_pblk + new->m_len) {
+		new->m_len += m->m_len;
+		map_erase(si, m);
+	}
+	if (si->i_map_count >= SFS_MAP_MAX)
+		map_erase(si, rb_entry(rb_first(&si->i_map_tree),
+				       struct sfs_map, m_node));
+
+	p = &si->i_map_tree.rb_node;
+	while (*p) {
+		parent = *p;
+		m = rb_entry(parent, struct sfs_map, m_node);
+		if (new->m_lblk < m->m_lblk)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	n = &new->m_node;
+	rb_link_node(n, parent, p);
+	rb_insert_color(n, &si->i_map_tree);
+	si->i_map_count++;
+	write_unlock(&si->i_map_lock);
+	return;
+
+out_free:
+	write_unlock(&si->i_map_lock);
+	kmem_cache_free(sfs_map_cachep, new);
+}
+
+/* Forget everything at or beyond @from */
+void sfs_map_remove(struct inode *inode, u32 from)
+{
+	struct sfs_inode_info *si = SFS_INODE(inode);
+	struct rb_node *n;
+
+	write_lock(&si->i_map_lock);
+	while ((n = rb_last(&si->i_map_tree))) {
+		struct sfs_map *m = rb_entry(n, struct sfs_map, m_node);
+
+		if (m->m_lblk < from) {
+			if (map_end(m) > from)
+				m->m_len = from - m->m_lblk;
+			break;
+		}
+		map_erase(si, m);
+	}
+	write_unlock(&si->i_map_lock);
+}
+
+void sfs_map_drop(struct inode *inode)
+{
+	sfs_map_remove(inode, 0);
+}
+
+int __init sfs_map_cache_create(void)
+{
+	sfs_map_cachep = kmem_cache_create("sfs_map", sizeof(struct sfs_map),
+					   0, SLAB_RECLAIM_ACCOUNT, NULL);
+	if (sfs_map_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void sfs_map_cache_destroy(void)
+{
+	kmem_cache_destroy(sfs_map_cachep);
+	sfs_map_cachep = NULL;
+}
@@ -1,4 +1,5 @@
 #include <linux/fs.h>
+#include <linux/namei.h>
 #include "sfs.h"
 
 static int add_nondir(struct dentry *dentry, struct inode *inode)
@@ -12,29 +13,53 @@ static int add_nondir(struct dentry *dentry, struct inode *inode)
 	return err;	
 }
 
+/*
+ * A namei operation is one journal handle: whatever it changes commits
+ * together.  Without a journal the handle is NULL.
+ */
+static handle_t *namei_start(struct inode *dir, int nblocks)
+{
+	return sfs_journal_start(dir->i_sb, nblocks);
+}
+
+static int namei_stop(handle_t *handle, int err)
+{
+	int ret = sfs_journal_stop(handle);
+
+	return err ? err : ret;
+}
+
 static int sfs_mknod(struct inode *dir, struct dentry *dentry, 
 			umode_t mode, dev_t rdev)
 {
 	int err;
 	struct inode *inode;
+	handle_t *handle;
 
 	if (!new_valid_dev(rdev))
 		return -EINVAL;
 
+	handle = namei_start(dir, SFS_NAMEI_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
 	inode = sfs_new_inode(dir, mode, &err);
 	if (!err && inode) {
 		sfs_set_inode(inode, rdev);
 		mark_inode_dirty(inode);
 		err = add_nondir(dentry, inode);
 	}
-	return err;
+	return namei_stop(handle, err);
 } 
 
 static int sfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 {
 	struct inode *inode;
+	handle_t *handle;
 	int err;
 
+	handle = namei_start(dir, SFS_NAMEI_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
 	inode_inc_link_count(dir);
 
 	inode = sfs_new_inode(dir, S_IFDIR | mode, &err);
@@ -55,7 +80,7 @@ static int sfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 
 	d_instantiate(dentry, inode);
 out:
-	return err;
+	return namei_stop(handle, err);
 
 out_fail:
 	inode_dec_link_count(inode);
@@ -72,7 +97,7 @@ static struct dentry *sfs_lookup(struct inode *dir, struct dentry *dentry,
 	struct inode *inode = NULL;
 	ino_t ino;
 
-	if (dentry->d_name.len >= SFS_MAX_NAME_LEN)
+	if (dentry->d_name.len > sfs_max_name_len(dir->i_sb))
 		return ERR_PTR(-ENAMETOOLONG);
 
 	ino = sfs_inode_by_name(dir, &dentry->d_name);
@@ -92,14 +117,18 @@ static int sfs_create(struct inode *dir, struct dentry *dentry,
 {
 	int err;
 	struct inode *inode;
+	handle_t *handle;
 
+	handle = namei_start(dir, SFS_NAMEI_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
 	inode = sfs_new_inode(dir, mode, &err);
 	if (!err && inode) {
 		sfs_set_inode(inode, 0);
 		mark_inode_dirty(inode);
 		err = add_nondir(dentry, inode);
 	}
-	return err;
+	return namei_stop(handle, err);
 } 
 
 static int sfs_symlink(struct inode * dir, struct dentry *dentry,
@@ -108,22 +137,43 @@ static int sfs_symlink(struct inode * dir, struct dentry *dentry,
 	int err = -ENAMETOOLONG;
 	int i = strlen(symname)+1;
 	struct inode * inode;
+	struct sfs_inode_info *si;
+	handle_t *handle;
 
 	if (i > dir->i_sb->s_blocksize)
-		goto out;
+		return err;
 
+	handle = namei_start(dir, SFS_NAMEI_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
 	inode = sfs_new_inode(dir, S_IFLNK | 0777, &err);
 	if (!inode)
 		goto out;
 
-	sfs_set_inode(inode, 0);
-	err = page_symlink(inode, symname, i);
-	if (err)
-		goto out_fail;
+	si = SFS_INODE(inode);
+	if (i <= sizeof(si->blkaddr) &&
+	    sfs_has_feature(dir->i_sb, SFS_FEATURE_FAST_SYMLINK)) {
+		/*
+		 * Short enough to live in i_blkaddr, no data block.  Only
+		 * with the feature: older kernels take i_blkaddr for block
+		 * numbers.
+		 */
+		si->i_flags = SFS_FAST_SYMLINK_FL;
+		memset(si->blkaddr, 0, sizeof(si->blkaddr));
+		memcpy(si->blkaddr, symname, i);
+		inode->i_size = i - 1;
+		sfs_set_inode(inode, 0);
+		mark_inode_dirty(inode);
+	} else {
+		sfs_set_inode(inode, 0);
+		err = page_symlink(inode, symname, i);
+		if (err)
+			goto out_fail;
+	}
 
 	err = add_nondir(dentry, inode);
 out:
-	return err;
+	return namei_stop(handle, err);
 
 out_fail:
 	inode_dec_link_count(inode);
@@ -135,11 +185,15 @@ static int sfs_link(struct dentry * old_dentry, struct inode * dir,
 			struct dentry *dentry)
 {
 	struct inode *inode = old_dentry->d_inode;
+	handle_t *handle;
 
+	handle = namei_start(dir, SFS_NAMEI_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
 	inode->i_ctime = CURRENT_TIME_SEC;
 	inode_inc_link_count(inode);
 	ihold(inode);
-	return add_nondir(dentry, inode);
+	return namei_stop(handle, add_nondir(dentry, inode));
 }
 
 static int sfs_unlink(struct inode * dir, struct dentry *dentry)
@@ -148,7 +202,11 @@ static int sfs_unlink(struct inode * dir, struct dentry *dentry)
 	struct inode * inode = dentry->d_inode;
 	struct page * page;
 	struct sfs_dir_entry * de;
+	handle_t *handle;
 
+	handle = namei_start(dir, SFS_NAMEI_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
 	de = sfs_find_entry(dentry, &page);
 	if (!de)
 		goto end_unlink;
@@ -160,14 +218,18 @@ static int sfs_unlink(struct inode * dir, struct dentry *dentry)
 	inode->i_ctime = dir->i_ctime;
 	inode_dec_link_count(inode);
 end_unlink:
-	return err;
+	return namei_stop(handle, err);
 }
 
 static int sfs_rmdir(struct inode * dir, struct dentry *dentry)
 {
 	struct inode * inode = dentry->d_inode;
 	int err = -ENOTEMPTY;
+	handle_t *handle;
 
+	handle = namei_start(dir, SFS_NAMEI_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
 	if (sfs_empty_dir(inode)) {
 		err = sfs_unlink(dir, dentry);
 		if (!err) {
@@ -175,7 +237,7 @@ static int sfs_rmdir(struct inode * dir, struct dentry *dentry)
 			inode_dec_link_count(inode);
 		}
 	}
-	return err;
+	return namei_stop(handle, err);
 }
 
 static int sfs_rename(struct inode * old_dir, struct dentry *old_dentry,
@@ -187,8 +249,12 @@ static int sfs_rename(struct inode * old_dir, struct dentry *old_dentry,
 	struct sfs_dir_entry * dir_de = NULL;
 	struct page * old_page;
 	struct sfs_dir_entry * old_de;
+	handle_t *handle;
 	int err = -ENOENT;
 
+	handle = namei_start(old_dir, SFS_RENAME_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
 	old_de = sfs_find_entry(old_dentry, &old_page);
 	if (!old_de)
 		goto out;
@@ -232,7 +298,7 @@ static int sfs_rename(struct inode * old_dir, struct dentry *old_dentry,
 		sfs_set_link(dir_de, dir_page, new_dir);
 		inode_dec_link_count(old_dir);
 	}
-	return 0;
+	return namei_stop(handle, 0);
 
 out_dir:
 	if (dir_de) {
@@ -243,20 +309,66 @@ out_old:
 	kunmap(old_page);
 	page_cache_release(old_page);
 out:
-	return err;
+	return namei_stop(handle, err);
 }
 
 int sfs_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat)
 {
 	struct super_block *sb = dentry->d_sb;
-
-	generic_fillattr(dentry->d_inode, stat);
-	stat->blocks = (sb->s_blocksize / 512) * sfs_blocks(stat->size, sb);
+	struct inode *inode = dentry->d_inode;
+
+	generic_fillattr(inode, stat);
+	if (sfs_has_feature(sb, SFS_FEATURE_BLOCK_COUNT)) {
+		/* delayed blocks count as soon as they are reserved */
+		stat->blocks += (u64)atomic_read(&SFS_INODE(inode)->i_reserved)
+				<< (sb->s_blocksize_bits - 9);
+	} else if (sfs_has_inline_data(inode) || sfs_fast_symlink(inode)) {
+		stat->blocks = 0;
+	} else {
+		/* no count on disk, estimate it from the size */
+		stat->blocks = (sb->s_blocksize / 512) *
+			sfs_blocks(stat->size, sb);
+	}
 	stat->blksize = sb->s_blocksize;
 	return 0;
 }
 
+/*
+ * Inline data ends at sfs_inline_size(): a file grown past it moves to a
+ * block first, or what mmap stores beyond it would be lost.
+ */
+static int sfs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = dentry->d_inode;
+	int error;
+
+	error = inode_change_ok(inode, attr);
+	if (error)
+		return error;
+
+	if ((attr->ia_valid & ATTR_SIZE) &&
+	    attr->ia_size != i_size_read(inode)) {
+		error = inode_newsize_ok(inode, attr->ia_size);
+		if (error)
+			return error;
+		if (sfs_has_inline_data(inode) &&
+		    attr->ia_size > sfs_inline_size(inode->i_sb)) {
+			error = sfs_inline_convert_file(inode);
+			if (error)
+				return error;
+		}
+		sfs_journal_wait_tail_page(inode, attr->ia_size);
+		truncate_setsize(inode, attr->ia_size);
+		sfs_truncate(inode);
+	}
+
+	setattr_copy(inode, attr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
 const struct inode_operations sfs_file_inode_ops = {
+	.setattr		= sfs_setattr,
 	.getattr		= sfs_getattr,
 };
 
@@ -267,6 +379,18 @@ const struct inode_operations sfs_symlink_inode_ops = {
 	.getattr		= sfs_getattr,
 };
 
+static void *sfs_follow_link(struct dentry *dentry, struct nameidata *nd)
+{
+	nd_set_link(nd, (char *)SFS_INODE(dentry->d_inode)->blkaddr);
+	return NULL;
+}
+
+const struct inode_operations sfs_fast_symlink_inode_ops = {
+	.readlink		= generic_readlink,
+	.follow_link		= sfs_follow_link,
+	.getattr		= sfs_getattr,
+};
+
 const struct inode_operations sfs_dir_inode_ops = {
 	.create		= sfs_create,
 	.lookup		= sfs_lookup,
@@ -6,6 +6,11 @@
 #include <linux/fs.h>
 #include <linux/writeback.h>
 #include <linux/buffer_head.h>
+#include <linux/percpu_counter.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
+#include <linux/jbd2.h>
 #else	/* __KERNEL__ */
 #include <linux/types.h>
 
@@ -22,6 +27,27 @@ static const unsigned long SFS_MAGIC = 0x20150825;
 #define SFS_ROOT_INO			1
 #define SFS_LINK_MAX			32000
 
+/* on-disk inode size of file systems made before s_inode_size existed */
+#define SFS_OLD_INODE_SIZE		64
+
+/* s_features: a kernel refuses to mount a file system with unknown bits */
+#define SFS_FEATURE_DIR_INDEX		0x0001	/* hashed directories */
+#define SFS_FEATURE_EXTENTS		0x0002	/* extent mapped files */
+#define SFS_FEATURE_INLINE_DATA		0x0004	/* small files in the inode */
+#define SFS_FEATURE_FILETYPE		0x0008	/* de_type is filled in */
+#define SFS_FEATURE_VAR_DIRENT		0x0010	/* struct sfs_dir_rec entries */
+#define SFS_FEATURE_JOURNAL		0x0020	/* metadata journal, journal.c */
+#define SFS_FEATURE_FAST_SYMLINK	0x0040	/* SFS_FAST_SYMLINK_FL inodes */
+#define SFS_FEATURE_BLOCK_COUNT		0x0080	/* i_blocks is kept */
+#define SFS_FEATURE_SUPP		(SFS_FEATURE_DIR_INDEX | \
+					 SFS_FEATURE_EXTENTS | \
+					 SFS_FEATURE_INLINE_DATA | \
+					 SFS_FEATURE_FILETYPE | \
+					 SFS_FEATURE_VAR_DIRENT | \
+					 SFS_FEATURE_JOURNAL | \
+					 SFS_FEATURE_FAST_SYMLINK | \
+					 SFS_FEATURE_BLOCK_COUNT)
+
 struct sfs_super_block {
 	__le32	s_magic;
 	__le32	s_blocksize;
@@ -30,8 +56,24 @@ struct sfs_super_block {
 	__le32	s_inode_blocks;
 	__le32	s_nblocks;
 	__le32	s_ninodes;
+	__le32	s_inode_size;		/* 0 means SFS_OLD_INODE_SIZE */
+	__le32	s_features;
+	__le32	s_free_blocks;		/* valid if SFS_STATE_VALID */
+	__le32	s_free_inodes;
+	__le32	s_state;
+	__le32	s_journal_start;	/* SFS_FEATURE_JOURNAL: jbd2 log */
+	__le32	s_journal_blocks;
 };
 
+/* s_state */
+#define SFS_STATE_VALID			0x0001	/* cleanly unmounted */
+
+/* i_flags */
+#define SFS_INDEX_FL			0x0001	/* directory has a hash index */
+#define SFS_EXTENTS_FL			0x0002	/* i_blkaddr is an extent tree */
+#define SFS_INLINE_DATA_FL		0x0004	/* data follows the inode */
+#define SFS_FAST_SYMLINK_FL		0x0008	/* target is in i_blkaddr */
+
 struct sfs_inode {
 	__le16 i_mode;
 	__le16 i_nlink;
@@ -42,14 +84,133 @@ struct sfs_inode {
 	__le32 i_mtime;
 	__le32 i_ctime;
 	__le32 i_blkaddr[9];	//	6+1+1+1
+	/* the fields below exist only if s_inode_size > SFS_OLD_INODE_SIZE */
+	__le32 i_flags;
+	__le32 i_blocks;	/* SFS_FEATURE_BLOCK_COUNT: blocks owned */
+	__le32 i_reserved[14];
+	/*
+	 * With SFS_FEATURE_INLINE_DATA, the rest of an s_inode_size inode
+	 * holds the first bytes of a SFS_INLINE_DATA_FL file or directory.
+	 */
 };
 
+/*
+ * A name of SFS_MAX_NAME_LEN - 1 bytes is terminated by de_type, which
+ * is 0 unless SFS_FEATURE_FILETYPE is set.  With it, de_type holds the
+ * DT_* value of the inode, (i_mode & S_IFMT) >> 12, and names are one
+ * byte shorter.
+ */
 struct sfs_dir_entry {
-	char de_name[SFS_MAX_NAME_LEN];
+	char de_name[SFS_MAX_NAME_LEN - 1];
+	__u8 de_type;
 	__le32 de_inode;
 };
 
+/*
+ * Variable length directory entries (SFS_FEATURE_VAR_DIRENT), used
+ * instead of struct sfs_dir_entry.  dr_rec_len is a multiple of 4 and
+ * the name is not NUL terminated.  dr_type is always filled in.
+ */
+#define SFS_DIR_REC_MAX_NAME		255
+#define SFS_DIR_REC_LEN(name_len)	((8 + (name_len) + 3) & ~3)
+
+struct sfs_dir_rec {
+	__le32 dr_inode;
+	__le16 dr_rec_len;
+	__u8   dr_name_len;
+	__u8   dr_type;
+	char   dr_name[];
+};
+
+/*
+ * Extent tree (SFS_EXTENTS_FL).
+ *
+ * The root lives in i_blkaddr: a header followed by either extents
+ * (eh_depth == 0) or index entries pointing to tree blocks one level
+ * down.  Every tree block starts with the same header.
+ */
+#define SFS_EXT_MAGIC			0xe5e5
+#define SFS_EXT_MAX_LEN			0xffff
+#define SFS_EXT_MAX_DEPTH		4
+
+/* ee_flags */
+#define SFS_EXT_UNWRITTEN		0x0001	/* allocated, reads as zeroes */
+
+struct sfs_extent_header {
+	__le16 eh_magic;
+	__le16 eh_entries;
+	__le16 eh_max;
+	__le16 eh_depth;	/* 0: entries are extents */
+};
+
+struct sfs_extent {
+	__le32 ee_block;	/* first logical block */
+	__le32 ee_start;	/* first physical block */
+	__le16 ee_len;
+	__le16 ee_flags;
+};
+
+struct sfs_extent_idx {
+	__le32 ei_block;	/* first logical block below, 0 for entry 0 */
+	__le32 ei_leaf;		/* tree block one level down */
+};
+
+/*
+ * Hashed directory index (SFS_INDEX_FL).
+ *
+ * Block 0 of an indexed directory keeps "." and ".." in its first two
+ * entries, followed by a header and the root of the index.  The root
+ * points either to leaf blocks, which hold ordinary directory entries,
+ * or to one level of index nodes that point to leaf blocks.  Index
+ * blocks are cut into slots of sizeof(struct sfs_dir_entry) bytes whose
+ * last word, where de_inode lives, is always zero: anything walking the
+ * directory linearly (readdir, rmdir) sees them as unused entries.
+ */
+#define SFS_DX_MAGIC			0xd1d1
+#define SFS_DX_PER_SLOT			7
+#define SFS_DX_MAX_LEVELS		1	/* index nodes below the root */
+
+struct sfs_dx_entry {
+	__le32 de_hash;		/* lowest hash in the block, 0 for entry 0 */
+	__le32 de_block;	/* logical block in the directory */
+};
+
+struct sfs_dx_slot {
+	struct sfs_dx_entry ds_entry[SFS_DX_PER_SLOT];
+	__le32 ds_pad;
+	__le32 ds_zero;
+};
+
+struct sfs_dx_head {
+	__le32 dh_reserved[2];
+	__le16 dh_magic;
+	__le16 dh_count;
+	__le16 dh_limit;
+	__u8   dh_levels;	/* root only: index levels below the root */
+	__u8   dh_unused;
+	__le32 dh_pad[11];
+	__le32 dh_zero;
+};
+
 #ifdef __KERNEL__
+struct sfs_group_info {
+	struct rb_root	g_free;		/* free extents, see freetree.c */
+	int		g_loaded;
+	unsigned int	g_busy;		/* reserved: not in g_free, clear on disk */
+};
+
+/*
+ * Which allocation groups may still have free bits: one bit per group and
+ * one per word of those, so a free group (or none) is found in a few
+ * cache lines.  A clear bit means the group is known to be full.
+ */
+struct sfs_summary {
+	unsigned long	*sm_groups;
+	unsigned long	*sm_words;
+	unsigned int	sm_count;
+	spinlock_t	sm_lock;	/* keeps sm_words in step with sm_groups */
+};
+
 struct sfs_sb_info {
 	__u32	s_magic;
 	__u32	s_blocksize;
@@ -58,6 +219,8 @@ struct sfs_sb_info {
 	__u32	s_inode_blocks;
 	__u32	s_nblocks;
 	__u32	s_ninodes;
+	__u32	s_inode_size;
+	__u32	s_features;
 
 	/* some additional info	*/
 	__u32	s_inodes_per_block;
@@ -65,19 +228,87 @@ struct sfs_sb_info {
 	__u32	s_dir_entries_per_block;
 	struct buffer_head **s_bam_bh;
 	struct buffer_head **s_iam_bh;
-	__u32	s_bam_last;
-	__u32	s_iam_last;
+	spinlock_t *s_bam_lock;		/* one per bitmap block */
+	spinlock_t *s_iam_lock;
+	struct sfs_group_info *s_groups;	/* one per bitmap block */
+	struct mutex s_group_mutex;		/* loads s_groups[] trees */
+	struct sfs_summary s_bam_sum;
+	struct sfs_summary s_iam_sum;
 	__u32	s_inode_list_start;
 	__u32	s_data_block_start;
+	__u32	s_free_blocks;		/* as found on disk */
+	__u32	s_free_inodes;
+	__u32	s_state;
+	__u32	s_journal_start;
+	__u32	s_journal_blocks;
+	journal_t *s_journal;		/* NULL without SFS_FEATURE_JOURNAL */
+	struct percpu_counter s_freeblocks_counter;
+	struct percpu_counter s_freeinodes_counter;
+	struct percpu_counter s_dirtyblocks_counter;	/* delalloc reserved */
+	struct super_block *s_sb;
+	unsigned long s_mount_opt;
+	spinlock_t s_freed_lock;	/* t_private_list of the transactions */
+	atomic_t s_freed_runs;		/* runs waiting for their commit */
+	spinlock_t s_discard_lock;
+	struct list_head s_discard_list;	/* freed runs to discard */
+	struct delayed_work s_discard_work;
 };
 
+/* s_mount_opt */
+#define SFS_MOUNT_DISCARD	0x0001
+
+#define clear_opt(o, opt)	(o &= ~SFS_MOUNT_##opt)
+#define set_opt(o, opt)		(o |= SFS_MOUNT_##opt)
+#define test_opt(sb, opt)	(SFS_SB(sb)->s_mount_opt & SFS_MOUNT_##opt)
+
 static inline struct sfs_sb_info *SFS_SB(struct super_block *sb)
 {
 	return (struct sfs_sb_info *)sb->s_fs_info;
 }
 
+static inline int sfs_has_feature(struct super_block *sb, __u32 feature)
+{
+	return (SFS_SB(sb)->s_features & feature) != 0;
+}
+
+/* Longest name a directory entry can take */
+static inline unsigned sfs_max_name_len(struct super_block *sb)
+{
+	if (sfs_has_feature(sb, SFS_FEATURE_VAR_DIRENT))
+		return SFS_DIR_REC_MAX_NAME;
+	if (sfs_has_feature(sb, SFS_FEATURE_FILETYPE))
+		return SFS_MAX_NAME_LEN - 2;
+	return SFS_MAX_NAME_LEN - 1;
+}
+
+static inline void sfs_set_de_type(struct super_block *sb,
+			struct sfs_dir_entry *de, umode_t mode)
+{
+	de->de_type = 0;
+	if (sfs_has_feature(sb, SFS_FEATURE_FILETYPE))
+		de->de_type = (mode & S_IFMT) >> 12;
+}
+
+struct sfs_dir_hint;
+
 struct sfs_inode_info {
 	__le32			blkaddr[9];	
+	__u32			i_flags;
+	struct sfs_dir_hint	*i_dir_hint;
+	seqlock_t		i_pointers_lock; /* indirect pointer updates */
+	struct rw_semaphore	i_ext_sem;	/* protects the extent tree */
+	rwlock_t		i_map_lock;	/* protects i_map_tree */
+	struct rb_root		i_map_tree;	/* cached block runs */
+	unsigned int		i_map_count;
+	atomic_t		i_reserved;	/* delalloc blocks reserved */
+	__u32			i_next_block;	/* logical block after last alloc */
+	__u32			i_next_goal;	/* physical block to try for it */
+	__u32			i_dir_goal;	/* near the parent's data */
+	spinlock_t		i_pa_lock;	/* protects the i_pa_* window */
+	__u32			i_pa_lblk;	/* logical block it starts at */
+	__u32			i_pa_start;	/* blocks taken ahead of writes */
+	__u32			i_pa_len;
+	tid_t			i_sync_tid;	/* last transaction to log it */
 	struct inode	vfs_inode;
 };
 
@@ -90,15 +321,35 @@ extern const struct address_space_operations sfs_aops;
 extern const struct inode_operations sfs_file_inode_ops;
 extern const struct inode_operations sfs_dir_inode_ops;
 extern const struct inode_operations sfs_symlink_inode_ops;
+extern const struct inode_operations sfs_fast_symlink_inode_ops;
 extern const struct file_operations sfs_file_ops;
 extern const struct file_operations sfs_dir_ops;
 int sfs_get_block(struct inode *inode, sector_t block,
             struct buffer_head *bh, int create);
 
+static inline size_t sfs_dir_pages(struct inode *inode)
+{
+	return (inode->i_size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+}
+
+struct page *sfs_dir_get_page(struct inode *inode, size_t n);
+struct page *sfs_dir_get_page_ra(struct inode *inode, size_t n,
+	struct file_ra_state *ra, size_t npages);
+unsigned sfs_last_byte(struct inode *inode, unsigned long page_nr);
+void sfs_dir_put_page(struct page *page);
+int sfs_dir_emit(struct inode *dir, struct dir_context *ctx,
+	struct sfs_dir_entry *de);
+int sfs_dir_prepare_chunk(struct page *page, loff_t pos, unsigned len);
+int sfs_dir_commit_chunk(struct page *page, loff_t pos, unsigned len);
+int sfs_fill_entry(struct page *page, struct sfs_dir_entry *de,
+	const char *name, struct inode *inode);
 int sfs_add_link(struct dentry *dentry, struct inode *inode);
+void sfs_dir_drop_hint(struct inode *dir);
 ino_t sfs_inode_by_name(struct inode *dir, struct qstr *child);
 int sfs_make_empty(struct inode *inode, struct inode *dir);
 struct sfs_dir_entry *sfs_dotdot (struct inode *dir, struct page **p);
+struct sfs_dir_entry *sfs_find_in_page(struct page *page,
+	const struct qstr *child, unsigned last_byte);
 struct sfs_dir_entry *
 sfs_find_entry(struct dentry *dentry, struct page **res_page);
 int sfs_empty_dir(struct inode * inode);
@@ -106,22 +357,214 @@ void sfs_set_link(struct sfs_dir_entry *de, struct page *page,
 	struct inode *inode);
 int sfs_delete_entry(struct sfs_dir_entry *de, struct page *page);
 
+/*
+ * With SFS_FEATURE_VAR_DIRENT, the struct sfs_dir_entry pointers handed
+ * out by the functions above point to a struct sfs_dir_rec.
+ */
+static inline int sfs_dir_var(struct inode *dir)
+{
+	return sfs_has_feature(dir->i_sb, SFS_FEATURE_VAR_DIRENT);
+}
+
+int sfs_dv_iterate(struct inode *dir, struct dir_context *ctx,
+	struct file_ra_state *ra);
+struct sfs_dir_entry *sfs_dv_find_entry(struct inode *dir,
+	const struct qstr *child, struct page **res_page);
+ino_t sfs_dv_inode_by_name(struct inode *dir, const struct qstr *child);
+int sfs_dv_add_link(struct inode *dir, const struct qstr *child,
+	struct inode *inode);
+int sfs_dv_delete_entry(struct sfs_dir_entry *de, struct page *page);
+void sfs_dv_set_link(struct sfs_dir_entry *de, struct page *page,
+	struct inode *inode);
+struct sfs_dir_entry *sfs_dv_dotdot(struct inode *dir, struct page **p);
+int sfs_dv_empty_dir(struct inode *dir);
+int sfs_dv_make_empty(struct page *page, struct inode *inode,
+	struct inode *dir);
+
+static inline int sfs_dx_indexed(struct inode *dir)
+{
+	return (SFS_INODE(dir)->i_flags & SFS_INDEX_FL) != 0;
+}
+
+/* Bytes of data an inode can hold, 0 without SFS_FEATURE_INLINE_DATA */
+static inline unsigned sfs_inline_size(struct super_block *sb)
+{
+	if (!sfs_has_feature(sb, SFS_FEATURE_INLINE_DATA))
+		return 0;
+	return SFS_SB(sb)->s_inode_size - sizeof(struct sfs_inode);
+}
+
+static inline int sfs_fast_symlink(struct inode *inode)
+{
+	return (SFS_INODE(inode)->i_flags & SFS_FAST_SYMLINK_FL) != 0;
+}
+
+static inline int sfs_has_inline_data(struct inode *inode)
+{
+	return (SFS_INODE(inode)->i_flags & SFS_INLINE_DATA_FL) != 0;
+}
+
+int sfs_inline_read_page(struct inode *inode, struct page *page);
+int sfs_inline_readpage(struct page *page);
+int sfs_inline_writepage(struct page *page, struct writeback_control *wbc);
+int sfs_inline_write_begin(struct address_space *mapping, loff_t pos,
+	unsigned flags, struct page **pagep);
+int sfs_inline_convert(struct inode *inode, struct page *page,
+	get_block_t *get_block);
+int sfs_inline_convert_file(struct inode *inode);
+
+struct sfs_dir_entry *sfs_dx_find_entry(struct inode *dir,
+	const struct qstr *child, struct page **res_page);
+int sfs_dx_add_link(struct inode *dir, const struct qstr *child,
+	struct inode *inode);
+int sfs_dx_make_indexed(struct inode *dir);
+int sfs_dx_iterate(struct inode *dir, struct dir_context *ctx);
+
+void sfs_ext_init(struct inode *inode);
+int sfs_ext_get_block(struct inode *inode, sector_t block,
+	struct buffer_head *bh, int create);
+void sfs_ext_truncate(struct inode *inode);
+int sfs_ext_punch(struct inode *inode, u32 start, u32 end);
+int sfs_ext_fallocate(struct inode *inode, u32 start, u32 end);
+unsigned long sfs_ext_first_block(struct inode *inode);
+unsigned long sfs_first_block(struct inode *inode);
+int sfs_punch_blocks(struct inode *inode, u32 start, u32 end);
+int sfs_fallocate_blocks(struct inode *inode, u32 start, u32 end, int zero);
+
+u32 sfs_map_lookup(struct inode *inode, u32 lblk, u32 *pblk);
+void sfs_map_insert(struct inode *inode, u32 lblk, u32 pblk, u32 len);
+void sfs_map_remove(struct inode *inode, u32 from);
+void sfs_map_drop(struct inode *inode);
+int sfs_map_cache_create(void);
+void sfs_map_cache_destroy(void);
+
+#define SFS_INVALID_BLOCK	((sector_t)~0ULL)
+
+void sfs_da_release(struct inode *inode, int nblocks);
+int sfs_da_get_block_prep(struct inode *inode, sector_t iblock,
+	struct buffer_head *bh, int create);
+int sfs_da_get_block_write(struct inode *inode, sector_t iblock,
+	struct buffer_head *bh, int create);
+int sfs_da_writepages(struct address_space *mapping,
+	struct writeback_control *wbc);
+void sfs_da_invalidatepage(struct page *page, unsigned int offset,
+	unsigned int length);
+
 unsigned sfs_blocks(loff_t size, struct super_block *sb);
 
-unsigned long sfs_new_block(struct inode *inode, int *err);
+struct sfs_free_extent;
+struct sfs_free_extent *sfs_fe_alloc(void);
+void sfs_fe_free(struct sfs_free_extent *fe);
+u32 sfs_fe_take(struct rb_root *root, u32 goal, u32 need, u32 want, u32 *got,
+	struct sfs_free_extent **spare);
+u32 sfs_fe_find(struct rb_root *root, u32 from, u32 len, u32 *got);
+int sfs_fe_put(struct rb_root *root, u32 start, u32 len,
+	struct sfs_free_extent **spare);
+void sfs_fe_drop(struct rb_root *root);
+int sfs_load_group(struct super_block *sb, unsigned int g);
+int sfs_fe_cache_create(void);
+void sfs_fe_cache_destroy(void);
+
+unsigned long sfs_new_block(struct inode *inode, unsigned long goal,
+	int *err);
+unsigned long sfs_new_blocks(struct inode *inode, unsigned long goal,
+	unsigned long *count, int *err);
 struct inode *sfs_new_inode(struct inode *dir, umode_t mode, int *err);
 void sfs_free_block(struct inode *inode, unsigned long block);
+void sfs_free_blocks(struct inode *inode, unsigned long block,
+	unsigned long count);
+void sfs_release_blocks(struct super_block *sb, unsigned long block,
+			unsigned long count);
+int sfs_reclaim_blocks(struct super_block *sb);
+void sfs_unreserve_blocks(struct super_block *sb, unsigned long block,
+	unsigned long count);
+int sfs_trim_group(struct super_block *sb, unsigned int g,
+	unsigned long first, unsigned long last, unsigned long minlen,
+	unsigned long *trimmed);
+
+int sfs_discard_queue(struct super_block *sb, unsigned long start,
+	unsigned long len);
+void sfs_discard_worker(struct work_struct *work);
+int sfs_discard_flush(struct super_block *sb);
+int sfs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+
+long sfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 
 struct sfs_inode *sfs_get_inode(struct super_block *sb, ino_t ino,
 	struct buffer_head **p);
 
 void sfs_set_inode(struct inode *inode, dev_t rdev);
 struct inode *sfs_iget(struct super_block *sb, unsigned long no);
+sector_t sfs_inode_readahead(struct super_block *sb, ino_t ino, sector_t last);
 int sfs_write_inode(struct inode *inode, struct writeback_control *wbc);
+void sfs_dirty_inode(struct inode *inode, int flags);
+void sfs_truncate(struct inode *inode);
 void sfs_truncate_inode(struct inode *inode);
 void sfs_evict_inode(struct inode *inode);
 void sfs_free_inode(struct inode *inode);
 
+/*
+ * Journal credits: how many metadata buffers a handle may dirty.  A
+ * block map change covers a split of every level of the deepest extent
+ * tree, the bitmaps of its blocks and of a data run (up to nine with 1k
+ * blocks), and the inode.  A directory change covers a dx split with 1k
+ * blocks, up to eight pages of four buffers, and the blocks mapped for
+ * it; an inode takes its table block and its bitmap block.  A truncate
+ * moves on to a new transaction whenever fewer than SFS_FREE_CREDITS are
+ * left: one more run and tree block, and the two buffers logged before
+ * the restart.
+ */
+#define SFS_MAP_CREDITS		32
+#define SFS_DIR_CREDITS		(32 + SFS_MAP_CREDITS)
+#define SFS_INODE_CREDITS	2
+#define SFS_ALLOC_CREDITS	2
+#define SFS_TRUNCATE_CREDITS	64
+#define SFS_FREE_CREDITS	16
+#define SFS_NAMEI_CREDITS	(SFS_DIR_CREDITS + 2 * SFS_INODE_CREDITS + \
+				 2 * SFS_ALLOC_CREDITS)
+#define SFS_RENAME_CREDITS	(3 * SFS_DIR_CREDITS + 4 * SFS_INODE_CREDITS + \
+				 2 * SFS_ALLOC_CREDITS)
+
+/* Directory blocks go through the journal rather than the page cache */
+static inline int sfs_journal_dir(struct inode *inode)
+{
+	return SFS_SB(inode->i_sb)->s_journal && S_ISDIR(inode->i_mode);
+}
+
+int sfs_journal_load(struct super_block *sb);
+int sfs_journal_destroy(struct super_block *sb);
+handle_t *sfs_journal_start(struct super_block *sb, int nblocks);
+int sfs_journal_stop(handle_t *handle);
+int sfs_journal_get_write_access(handle_t *handle, struct buffer_head *bh);
+int sfs_journal_get_create_access(handle_t *handle, struct buffer_head *bh);
+int sfs_journal_dirty(handle_t *handle, struct buffer_head *bh);
+int sfs_journal_dirty_map(handle_t *handle, struct inode *inode,
+	struct buffer_head *bh);
+void sfs_journal_forget(handle_t *handle, struct buffer_head *bh);
+int sfs_journal_room(handle_t *handle, int nblocks);
+int sfs_journal_extend(handle_t *handle, struct inode *inode,
+	struct buffer_head *bh, int nblocks);
+void sfs_journal_revoke(struct inode *inode, unsigned long block,
+	unsigned long count);
+int sfs_journal_dir_begin(struct page *page, loff_t pos, unsigned len);
+int sfs_journal_dir_dirty(struct page *page, loff_t pos, unsigned len);
+int sfs_journal_dir_end(struct inode *dir);
+void sfs_journal_wait_tail_page(struct inode *inode, loff_t size);
+void sfs_journal_invalidatepage(struct page *page, unsigned int offset,
+	unsigned int length);
+int sfs_journal_releasepage(struct page *page, gfp_t wait);
+int sfs_journal_commit_inode(struct inode *inode);
+void sfs_journal_release_on_commit(handle_t *handle, unsigned long block,
+				   unsigned long count);
+int sfs_journal_commit_freed(struct super_block *sb);
+int sfs_sync_fs(struct super_block *sb, int wait);
+int sfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+
+int sfs_summary_init(struct sfs_summary *sm, unsigned int groups);
+void sfs_summary_free(struct sfs_summary *sm);
+unsigned long sfs_new_data_blocks(struct inode *inode, u32 lblk,
+	unsigned long goal, unsigned long *count, int *err);
+void sfs_discard_prealloc(struct inode *inode);
 unsigned long sfs_count_free_blocks(struct super_block *sb);
 unsigned long sfs_count_free_inodes(struct super_block *sb);
 #endif	/* __KERNEL__ */
@@ -1,23 +1,73 @@
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/parser.h>
+#include <linux/percpu_counter.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/vfs.h>
 
 #include "sfs.h"
 
+/*
+ * Record the free counts and whether the fs is clean.  A clean fs lets
+ * the next mount take the counts as they are instead of scanning the
+ * bitmaps.
+ */
+static void sfs_commit_super(struct super_block *sb, int clean)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_super_block *dsb;
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, SUPER_BLOCK_NO);
+	if (!bh) {
+		pr_err("cannot read super block\n");
+		return;
+	}
+	dsb = (struct sfs_super_block *)bh->b_data;
+	lock_buffer(bh);
+	dsb->s_free_blocks = cpu_to_le32(
+		percpu_counter_sum_positive(&sbi->s_freeblocks_counter));
+	dsb->s_free_inodes = cpu_to_le32(
+		percpu_counter_sum_positive(&sbi->s_freeinodes_counter));
+	sbi->s_state = clean ? sbi->s_state | SFS_STATE_VALID
+			     : sbi->s_state & ~SFS_STATE_VALID;
+	dsb->s_state = cpu_to_le32(sbi->s_state);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+	brelse(bh);
+}
+
 static void sfs_put_super(struct super_block *sb)
 {
 	struct sfs_sb_info *sbi = SFS_SB(sb);
 
 	if (sbi) {
 		int i;
-		for (i = 0; i < sbi->s_bam_blocks; i++)
+		/* the last commit may queue runs, the worker uses the bitmaps */
+		sfs_journal_destroy(sb);
+		sfs_discard_flush(sb);
+		cancel_delayed_work_sync(&sbi->s_discard_work);
+		if (!(sb->s_flags & MS_RDONLY))
+			sfs_commit_super(sb, 1);
+		percpu_counter_destroy(&sbi->s_freeblocks_counter);
+		percpu_counter_destroy(&sbi->s_freeinodes_counter);
+		percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
+		for (i = 0; i < sbi->s_bam_blocks; i++) {
+			sfs_fe_drop(&sbi->s_groups[i].g_free);
 			brelse(sbi->s_bam_bh[i]);
+		}
 		for (i = 0; i < sbi->s_iam_blocks; i++)
 			brelse(sbi->s_iam_bh[i]);
 		kfree(sbi->s_bam_bh);
+		kfree(sbi->s_bam_lock);
+		kfree(sbi->s_groups);
+		sfs_summary_free(&sbi->s_bam_sum);
+		sfs_summary_free(&sbi->s_iam_sum);
 		kfree(sbi);
 	}
 	sb->s_fs_info = NULL;
@@ -34,7 +84,18 @@ static inline void sfs_super_block_fill(struct sfs_sb_info *sbi,
 	sbi->s_inode_blocks = le32_to_cpu(dsb->s_inode_blocks);
 	sbi->s_nblocks = le32_to_cpu(dsb->s_nblocks);
 	sbi->s_ninodes = le32_to_cpu(dsb->s_ninodes);
-	sbi->s_inodes_per_block = sbi->s_blocksize / sizeof(struct sfs_inode); 
+	sbi->s_inode_size = le32_to_cpu(dsb->s_inode_size);
+	if (!sbi->s_inode_size)
+		sbi->s_inode_size = SFS_OLD_INODE_SIZE;
+	sbi->s_features = le32_to_cpu(dsb->s_features);
+	sbi->s_free_blocks = le32_to_cpu(dsb->s_free_blocks);
+	sbi->s_free_inodes = le32_to_cpu(dsb->s_free_inodes);
+	sbi->s_state = le32_to_cpu(dsb->s_state);
+	if (sbi->s_features & SFS_FEATURE_JOURNAL) {
+		sbi->s_journal_start = le32_to_cpu(dsb->s_journal_start);
+		sbi->s_journal_blocks = le32_to_cpu(dsb->s_journal_blocks);
+	}
+	sbi->s_inodes_per_block = sbi->s_blocksize / sbi->s_inode_size; 
 	sbi->s_bits_per_block = 8*sbi->s_blocksize;
 	sbi->s_dir_entries_per_block =
 			sbi->s_blocksize / sizeof(struct sfs_dir_entry);
@@ -70,6 +131,43 @@ static struct sfs_sb_info *sfs_super_block_read(struct super_block *sb)
 		goto free_memory;
 	}
 
+	if (sbi->s_inode_size < SFS_OLD_INODE_SIZE ||
+	    sbi->s_inode_size > sbi->s_blocksize ||
+	    (sbi->s_inode_size & (sbi->s_inode_size - 1))) {
+		pr_err("unsupported inode size %lu\n",
+			(unsigned long)sbi->s_inode_size);
+		goto free_memory;
+	}
+
+	if ((sbi->s_features & SFS_FEATURE_INLINE_DATA) &&
+	    sbi->s_inode_size <= sizeof(struct sfs_inode)) {
+		pr_err("inline data needs inodes larger than %d bytes\n",
+			(int)sizeof(struct sfs_inode));
+		goto free_memory;
+	}
+
+	/* inline data is written back into the inode table, past jbd2 */
+	if ((sbi->s_features & SFS_FEATURE_INLINE_DATA) &&
+	    (sbi->s_features & SFS_FEATURE_JOURNAL)) {
+		pr_err("inline data cannot be used with a journal\n");
+		goto free_memory;
+	}
+
+	if (sbi->s_features & ~SFS_FEATURE_SUPP) {
+		pr_err("unsupported features 0x%lx\n",
+			(unsigned long)(sbi->s_features & ~SFS_FEATURE_SUPP));
+		goto free_memory;
+	}
+
+	if ((sbi->s_features & (SFS_FEATURE_DIR_INDEX | SFS_FEATURE_EXTENTS |
+				SFS_FEATURE_FAST_SYMLINK |
+				SFS_FEATURE_BLOCK_COUNT)) &&
+	    sbi->s_inode_size == SFS_OLD_INODE_SIZE) {
+		pr_err("features 0x%lx need inodes larger than %d bytes\n",
+			(unsigned long)sbi->s_features, SFS_OLD_INODE_SIZE);
+		goto free_memory;
+	}
+
 	return sbi;
 
 free_memory:
@@ -85,11 +183,14 @@ static int sfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	buf->f_type = sb->s_magic;
 	buf->f_bsize = sb->s_blocksize;
 	buf->f_blocks = sbi->s_nblocks - sbi->s_data_block_start;
-	buf->f_bfree = sfs_count_free_blocks(sb);
+	buf->f_bfree = percpu_counter_read_positive(&sbi->s_freeblocks_counter) -
+		percpu_counter_read_positive(&sbi->s_dirtyblocks_counter);
+	if ((s64)buf->f_bfree < 0)
+		buf->f_bfree = 0;
 	buf->f_bavail = buf->f_bfree;
 	buf->f_files = sbi->s_ninodes;
-	buf->f_ffree = sfs_count_free_inodes(sb);
-	buf->f_namelen = SFS_MAX_NAME_LEN;
+	buf->f_ffree = percpu_counter_read_positive(&sbi->s_freeinodes_counter);
+	buf->f_namelen = sfs_max_name_len(sb);
 	buf->f_fsid.val[0] = (u32)id;
 	buf->f_fsid.val[1] = (u32)(id >> 32);
 
@@ -106,6 +207,14 @@ static struct inode *sfs_alloc_inode(struct super_block *sb)
 	if (!si)
 		return NULL;
 
+	si->i_dir_hint = NULL;
+	si->i_next_block = 0;
+	si->i_next_goal = 0;
+	si->i_dir_goal = 0;
+	si->i_pa_len = 0;
+	si->i_sync_tid = 0;
+	if (SFS_SB(sb)->s_journal)
+		si->i_sync_tid = SFS_SB(sb)->s_journal->j_commit_sequence;
 	return &si->vfs_inode;
 }
 
@@ -126,6 +235,13 @@ static void sfs_inode_init_once(void *p)
 {
 	struct sfs_inode_info *si = (struct sfs_inode_info *)p;
 
+	seqlock_init(&si->i_pointers_lock);
+	init_rwsem(&si->i_ext_sem);
+	rwlock_init(&si->i_map_lock);
+	si->i_map_tree = RB_ROOT;
+	si->i_map_count = 0;
+	atomic_set(&si->i_reserved, 0);
+	spin_lock_init(&si->i_pa_lock);
 	inode_init_once(&si->vfs_inode);
 }
 
@@ -147,12 +263,96 @@ static void sfs_inode_cache_destroy(void)
 	sfs_inode_cache = NULL;
 }
 
+enum { Opt_discard, Opt_nodiscard, Opt_err };
+
+static const match_table_t tokens = {
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_err, NULL}
+};
+
+static int sfs_parse_options(char *options, struct sfs_sb_info *sbi)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	if (!options)
+		return 1;
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, tokens, args)) {
+		case Opt_discard:
+			set_opt(sbi->s_mount_opt, DISCARD);
+			break;
+		case Opt_nodiscard:
+			clear_opt(sbi->s_mount_opt, DISCARD);
+			break;
+		default:
+			pr_err("sfs: unrecognized mount option \"%s\"\n", p);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void sfs_check_discard(struct super_block *sb)
+{
+	if (test_opt(sb, DISCARD) &&
+	    !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+		pr_warn("sfs: %s does not support discard, option ignored\n",
+			sb->s_id);
+		clear_opt(SFS_SB(sb)->s_mount_opt, DISCARD);
+	}
+}
+
+static int sfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	if (test_opt(root->d_sb, DISCARD))
+		seq_puts(seq, ",discard");
+	return 0;
+}
+
+/*
+ * The counts on disk go stale once the fs is writable, so the state
+ * follows the mount: not valid while read-write, valid again when it
+ * goes read-only.
+ */
+static int sfs_remount(struct super_block *sb, int *flags, char *data)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	unsigned long old_opt = sbi->s_mount_opt;
+
+	sync_filesystem(sb);
+	if (!sfs_parse_options(data, sbi)) {
+		sbi->s_mount_opt = old_opt;
+		return -EINVAL;
+	}
+	sfs_check_discard(sb);
+
+	if ((*flags & MS_RDONLY) == (sb->s_flags & MS_RDONLY))
+		return 0;
+	if (*flags & MS_RDONLY) {
+		/* the commit releases freed runs, maybe to the discard queue */
+		sfs_sync_fs(sb, 1);
+		sfs_discard_flush(sb);
+		sfs_commit_super(sb, 1);
+	} else {
+		sfs_commit_super(sb, 0);
+	}
+	return 0;
+}
+
 static struct super_operations const sfs_super_ops = {
 	.alloc_inode		= sfs_alloc_inode,
 	.destroy_inode		= sfs_destroy_inode,
+	.dirty_inode		= sfs_dirty_inode,
 	.write_inode		= sfs_write_inode,
 	.evict_inode		= sfs_evict_inode,
 	.put_super		= sfs_put_super,
+	.sync_fs		= sfs_sync_fs,
+	.remount_fs		= sfs_remount,
+	.show_options		= sfs_show_options,
 	.statfs			= sfs_statfs,
 };
 
@@ -160,6 +360,8 @@ static int sfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct sfs_sb_info *sbi = sfs_super_block_read(sb);
 	struct buffer_head **map;
+	spinlock_t *locks;
+	struct sfs_group_info *groups;
 	struct inode *root;
 	unsigned long i, block;
 
@@ -168,6 +370,15 @@ static int sfs_fill_super(struct super_block *sb, void *data, int silent)
 
 	sb->s_magic = sbi->s_magic;
 	sb->s_fs_info = sbi;
+	sbi->s_sb = sb;
+	spin_lock_init(&sbi->s_freed_lock);
+	atomic_set(&sbi->s_freed_runs, 0);
+	spin_lock_init(&sbi->s_discard_lock);
+	INIT_LIST_HEAD(&sbi->s_discard_list);
+	INIT_DELAYED_WORK(&sbi->s_discard_work, sfs_discard_worker);
+	if (!sfs_parse_options(data, sbi))
+		return -EINVAL;
+	sfs_check_discard(sb);
 	sb->s_op = &sfs_super_ops;
 	sb->s_max_links = SFS_LINK_MAX;
 
@@ -185,11 +396,46 @@ static int sfs_fill_super(struct super_block *sb, void *data, int silent)
 		return -EINVAL;
 	}	 
 
+	/* Before anything is read: a replay may change it */
+	if (sfs_has_feature(sb, SFS_FEATURE_JOURNAL)) {
+		int err = sfs_journal_load(sb);
+		if (err)
+			return err;
+	}
+
 	map = kzalloc(sizeof(struct buffer_head *) * 
 			(sbi->s_bam_blocks + sbi->s_iam_blocks), GFP_KERNEL);
 	sbi->s_bam_bh = &map[0]; 
 	sbi->s_iam_bh = &map[sbi->s_bam_blocks];
 
+	locks = kmalloc(sizeof(spinlock_t) *
+			(sbi->s_bam_blocks + sbi->s_iam_blocks), GFP_KERNEL);
+	/* all zero: empty trees, loaded on first use */
+	groups = kzalloc(sizeof(struct sfs_group_info) * sbi->s_bam_blocks,
+			GFP_KERNEL);
+	if (!map || !locks || !groups) {
+		kfree(map);
+		kfree(locks);
+		kfree(groups);
+		sfs_journal_destroy(sb);
+		return -ENOMEM;
+	}
+	for (i = 0; i < sbi->s_bam_blocks + sbi->s_iam_blocks; i++)
+		spin_lock_init(&locks[i]);
+	sbi->s_bam_lock = &locks[0];
+	sbi->s_iam_lock = &locks[sbi->s_bam_blocks];
+	sbi->s_groups = groups;
+	mutex_init(&sbi->s_group_mutex);
+	if (sfs_summary_init(&sbi->s_bam_sum, sbi->s_bam_blocks) ||
+	    sfs_summary_init(&sbi->s_iam_sum, sbi->s_iam_blocks)) {
+		sfs_summary_free(&sbi->s_bam_sum);
+		kfree(map);
+		kfree(locks);
+		kfree(groups);
+		sfs_journal_destroy(sb);
+		return -ENOMEM;
+	}
+
 	block = 1;
 	for (i = 0; i < sbi->s_bam_blocks; i++) {
 		sbi->s_bam_bh[i] = sb_bread(sb, block);
@@ -203,26 +449,55 @@ static int sfs_fill_super(struct super_block *sb, void *data, int silent)
 			goto error;
 		block++;
 	}  
-	sbi->s_bam_last = 0;
-	sbi->s_iam_last = 0;
+
+	/* Only an unclean fs needs its bitmaps counted */
+	if (!(sbi->s_state & SFS_STATE_VALID)) {
+		pr_debug("sfs was not cleanly unmounted, counting free space\n");
+		sbi->s_free_blocks = sfs_count_free_blocks(sb);
+		sbi->s_free_inodes = sfs_count_free_inodes(sb);
+	}
+	if (percpu_counter_init(&sbi->s_freeblocks_counter, sbi->s_free_blocks))
+		goto error;
+	if (percpu_counter_init(&sbi->s_freeinodes_counter, sbi->s_free_inodes))
+		goto error_blocks;
+	if (percpu_counter_init(&sbi->s_dirtyblocks_counter, 0))
+		goto error_inodes;
 
 	root = sfs_iget(sb, SFS_ROOT_INO);
-	if (IS_ERR(root))
+	if (IS_ERR(root)) {
+		percpu_counter_destroy(&sbi->s_freeblocks_counter);
+		percpu_counter_destroy(&sbi->s_freeinodes_counter);
+		percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
+		sfs_journal_destroy(sb);
 		return PTR_ERR(root);
+	}
 
 	sb->s_root = d_make_root(root);
 	if (!sb->s_root) {
 		pr_err("sfs cannot create root\n");
+		sfs_journal_destroy(sb);
 		return -ENOMEM;
 	}
+	/* The counts on disk are stale from now until a clean unmount */
+	if (!(sb->s_flags & MS_RDONLY))
+		sfs_commit_super(sb, 0);
 	return 0;
 
+error_inodes:
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+error_blocks:
+	percpu_counter_destroy(&sbi->s_freeblocks_counter);
 error:
 	for (i = 0; i < sbi->s_bam_blocks; i++)
 		brelse(sbi->s_bam_bh[i]);
 	for (i = 0; i < sbi->s_iam_blocks; i++)
 		brelse(sbi->s_iam_bh[i]);
 	kfree(map);
+	kfree(locks);
+	kfree(groups);
+	sfs_summary_free(&sbi->s_bam_sum);
+	sfs_summary_free(&sbi->s_iam_sum);
+	sfs_journal_destroy(sb);
 	return -EIO;	
 }
 
@@ -256,8 +531,25 @@ static int __init init_sfs_fs(void)
 		return ret;
 	}
 
+	ret = sfs_map_cache_create();
+	if (ret != 0) {
+		sfs_inode_cache_destroy();
+		pr_err("cannot create mapping cache\n");
+		return ret;
+	}
+
+	ret = sfs_fe_cache_create();
+	if (ret != 0) {
+		sfs_map_cache_destroy();
+		sfs_inode_cache_destroy();
+		pr_err("cannot create free extent cache\n");
+		return ret;
+	}
+
 	ret = register_filesystem(&sfs_type);
 	if (ret != 0) {
+		sfs_fe_cache_destroy();
+		sfs_map_cache_destroy();
 		sfs_inode_cache_destroy();
 		pr_err("cannot register filesystem\n");
 		return ret;
@@ -275,6 +567,8 @@ static void __exit exit_sfs_fs(void)
 	if (ret != 0)
 		pr_err("cannot unregister filesystem\n");
 
+	sfs_fe_cache_destroy();
+	sfs_map_cache_destroy();
 	sfs_inode_cache_destroy();
 
 	pr_debug("sfs module unloaded\n");
@@ -0,0 +1,66 @@
+#!/bin/sh
+
+# Directory lookup rate on a mounted sfs.
+# usage: ./lookup_bench.sh [mountpoint] [entries...]
+# Fills a directory with each number of entries (default 10000 and
+# 100000), then times a stat of every name with cold and warm caches.
+#
+# For an A/B run set OLD_KO to a module built from before the series
+# (and OLD_MKFS to its mkfs if the format differs). Each module is then
+# loaded in turn on a fresh loop image IMG (default lookup.img, 512 MB)
+# mounted at [mountpoint], the old one first.
+
+MNT=${1:-/mnt}
+[ $# -gt 0 ] && shift
+SIZES=${@:-10000 100000}
+IMG=${IMG:-lookup.img}
+NEW_KO=${NEW_KO:-../kernel/sfs.ko}
+NEW_MKFS=${NEW_MKFS:-../tools/mkfs.sfs}
+OLD_MKFS=${OLD_MKFS:-$NEW_MKFS}
+
+lookup() {
+	cd $MNT/lookup
+	start=`date +%s.%N`
+	seq -f "entry%.0f" 0 $(($1 - 1)) | xargs stat -c %i > /dev/null
+	end=`date +%s.%N`
+	cd - > /dev/null
+	echo "$end - $start" | bc
+}
+
+run() {
+	echo "entries cache seconds lookups_per_sec"
+	for n in $SIZES; do
+		rm -rf $MNT/lookup
+		mkdir -p $MNT/lookup
+		(cd $MNT/lookup && seq -f "entry%.0f" 0 $((n - 1)) | xargs touch)
+		sync
+
+		echo 3 > /proc/sys/vm/drop_caches
+		t=`lookup $n`
+		echo "$n cold $t `echo "$n / $t" | bc`"
+
+		t=`lookup $n`
+		echo "$n warm $t `echo "$n / $t" | bc`"
+	done
+	rm -rf $MNT/lookup
+}
+
+# module mkfs label
+run_module() {
+	dd if=/dev/zero of=$IMG bs=1M count=512 2>/dev/null
+	$2 $IMG > /dev/null || exit 1
+	insmod $1 || exit 1
+	mount -o loop -t sfs $IMG $MNT || { rmmod sfs; exit 1; }
+	echo "# $3: $1"
+	run
+	umount $MNT
+	rmmod sfs
+}
+
+if [ -z "$OLD_KO" ]; then
+	run
+	exit 0
+fi
+run_module $OLD_KO $OLD_MKFS old
+run_module $NEW_KO $NEW_MKFS new
+rm -f $IMG
@@ -0,0 +1,71 @@
+#!/bin/sh
+
+# Parallel create/write scaling on a mounted sfs.
+# usage: ./scale_bench.sh [max_threads] [files_per_thread] [mountpoint] [blocks]
+# Prints the elapsed time for 1, 2, 4, ... max_threads writers, each
+# writing files of [blocks] 4k blocks (default 4).
+#
+# For an A/B run set OLD_KO to a module built from before the series
+# (and OLD_MKFS to its mkfs if the format differs). Each module is then
+# loaded in turn on a fresh loop image IMG (default scale.img, 1024 MB)
+# mounted at [mountpoint], the old one first.
+
+MAX=${1:-`nproc`}
+FILES=${2:-1000}
+MNT=${3:-/mnt}
+BLOCKS=${4:-4}
+IMG=${IMG:-scale.img}
+NEW_KO=${NEW_KO:-../kernel/sfs.ko}
+NEW_MKFS=${NEW_MKFS:-../tools/mkfs.sfs}
+OLD_MKFS=${OLD_MKFS:-$NEW_MKFS}
+
+worker() {
+	mkdir -p $MNT/bench/$1
+	i=0
+	while [ $i -lt $FILES ]; do
+		dd if=/dev/zero of=$MNT/bench/$1/f$i bs=4k count=$BLOCKS \
+			conv=fsync 2>/dev/null
+		i=$((i + 1))
+	done
+}
+
+run() {
+	echo "threads files seconds"
+	n=1
+	while [ $n -le $MAX ]; do
+		rm -rf $MNT/bench
+		sync
+		start=`date +%s.%N`
+		t=0
+		while [ $t -lt $n ]; do
+			worker $t &
+			t=$((t + 1))
+		done
+		wait
+		sync
+		end=`date +%s.%N`
+		echo "$n $((n * FILES)) `echo "$end - $start" | bc`"
+		n=$((n * 2))
+	done
+	rm -rf $MNT/bench
+}
+
+# module mkfs label
+run_module() {
+	dd if=/dev/zero of=$IMG bs=1M count=1024 2>/dev/null
+	$2 $IMG > /dev/null || exit 1
+	insmod $1 || exit 1
+	mount -o loop -t sfs $IMG $MNT || { rmmod sfs; exit 1; }
+	echo "# $3: $1"
+	run
+	umount $MNT
+	rmmod sfs
+}
+
+if [ -z "$OLD_KO" ]; then
+	run
+	exit 0
+fi
+run_module $OLD_KO $OLD_MKFS old
+run_module $NEW_KO $NEW_MKFS new
+rm -f $IMG
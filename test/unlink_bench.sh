@@ -0,0 +1,56 @@
+#!/bin/sh
+
+# Time to unlink large files on a mounted sfs.
+# usage: ./unlink_bench.sh [size_mb] [files] [mountpoint]
+# Writes the files, syncs, then times rm + sync.
+#
+# For an A/B run set OLD_KO to a module built from before the series
+# (and OLD_MKFS to its mkfs if the format differs). Each module is then
+# loaded in turn on a fresh loop image IMG (default unlink.img, sized
+# [size_mb] * [files] + 256 MB) mounted at [mountpoint], the old one first.
+
+SIZE=${1:-1024}
+FILES=${2:-4}
+MNT=${3:-/mnt}
+IMG=${IMG:-unlink.img}
+NEW_KO=${NEW_KO:-../kernel/sfs.ko}
+NEW_MKFS=${NEW_MKFS:-../tools/mkfs.sfs}
+OLD_MKFS=${OLD_MKFS:-$NEW_MKFS}
+
+run() {
+	mkdir -p $MNT/unlink
+	i=0
+	while [ $i -lt $FILES ]; do
+		dd if=/dev/zero of=$MNT/unlink/f$i bs=1M count=$SIZE 2>/dev/null
+		i=$((i + 1))
+	done
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+
+	start=`date +%s.%N`
+	rm -rf $MNT/unlink
+	sync
+	end=`date +%s.%N`
+	echo "files size_mb seconds"
+	echo "$FILES $SIZE `echo "$end - $start" | bc`"
+}
+
+# module mkfs label
+run_module() {
+	dd if=/dev/zero of=$IMG bs=1M count=$((SIZE * FILES + 256)) 2>/dev/null
+	$2 $IMG > /dev/null || exit 1
+	insmod $1 || exit 1
+	mount -o loop -t sfs $IMG $MNT || { rmmod sfs; exit 1; }
+	echo "# $3: $1"
+	run
+	umount $MNT
+	rmmod sfs
+}
+
+if [ -z "$OLD_KO" ]; then
+	run
+	exit 0
+fi
+run_module $OLD_KO $OLD_MKFS old
+run_module $NEW_KO $NEW_MKFS new
+rm -f $IMG
@@ -6,6 +6,7 @@
 #include <time.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <arpa/inet.h>
 
 #include "sfs.h"
 #include "bitmap.h"
@@ -19,6 +20,10 @@ struct fs_config {
 	uint64_t	fs_nblocks;
 	uint64_t	fs_ninodes;
 	uint64_t	fs_data_start;
+	uint32_t	fs_features;
+	uint32_t	fs_inode_size;
+	uint32_t	fs_journal_start;
+	uint32_t	fs_journal_blocks;
 };
 
 struct fs_config cfg;
@@ -32,7 +37,7 @@ void bc_write(int blk_no, int sync);
 #define IAM_BLOCK_START		(BAM_BLOCK_START+cfg.fs_bam_blocks)
 #define INODE_LIST_START	(IAM_BLOCK_START+cfg.fs_iam_blocks)
 #define DATA_BLOCK_START	(INODE_LIST_START+cfg.fs_inode_blocks)
-#define INODES_PER_BLOCK	(SFS_BLOCK_SIZE/sizeof(struct sfs_inode))
+#define INODES_PER_BLOCK	(SFS_BLOCK_SIZE/cfg.fs_inode_size)
 
 int init_super_block()
 {
@@ -48,6 +53,8 @@ int init_super_block()
 	sb->s_inode_blocks = cfg.fs_inode_blocks;
 	sb->s_nblocks = cfg.fs_nblocks;
 	sb->s_ninodes = cfg.fs_ninodes;
+	sb->s_inode_size = cfg.fs_inode_size;
+	sb->s_features = cfg.fs_features;
 	
 	write_block(SUPER_BLOCK_NO, buffer);
 
@@ -281,16 +288,17 @@ void free_inode(uint32_t ino)
 
 struct sfs_inode *get_inode(uint32_t ino)
 {
-	struct sfs_inode *ino_list = (struct sfs_inode *) bc_read(INODE_LIST_START);
+	char *ino_list = (char *) bc_read(INODE_LIST_START);
 	if (ino >= INODES_PER_BLOCK) 
 		return NULL;
-	return &ino_list[ino];
+	return (struct sfs_inode *)(ino_list + ino * cfg.fs_inode_size);
 }		
 
 uint32_t new_inode(mode_t mode, int byte_size)
 {
 	uint32_t ino;
 	struct sfs_inode *ip;
+	uint32_t blk;
 	int nblocks;
 
 	nblocks = (byte_size + SFS_BLOCK_SIZE -1) / SFS_BLOCK_SIZE;  
@@ -305,11 +313,28 @@ uint32_t new_inode(mode_t mode, int byte_size)
 		exit(1);
 	}
 	
-	ip->i_blkaddr[0] = allocate_blk(nblocks);
-	if (ip->i_blkaddr[0] == INVALID_NO) {
+	blk = allocate_blk(nblocks);
+	if (blk == INVALID_NO) {
 		free_inode(ino);
 		return INVALID_NO;
 	}
+	if (cfg.fs_features & SFS_FEATURE_EXTENTS) {
+		struct sfs_extent_header *eh = (void *)ip->i_blkaddr;
+		struct sfs_extent *ex = (void *)(eh + 1);
+
+		memset(ip->i_blkaddr, 0, sizeof(ip->i_blkaddr));
+		eh->eh_magic = SFS_EXT_MAGIC;
+		eh->eh_entries = 1;
+		eh->eh_max = (sizeof(ip->i_blkaddr) - sizeof(*eh)) / sizeof(*ex);
+		eh->eh_depth = 0;
+		ex->ee_block = 0;
+		ex->ee_start = blk;
+		ex->ee_len = nblocks;
+		ip->i_flags |= SFS_EXTENTS_FL;
+	} else
+		ip->i_blkaddr[0] = blk;
+	if (cfg.fs_features & SFS_FEATURE_BLOCK_COUNT)
+		ip->i_blocks = nblocks;
 
 	ip->i_size = 0;
 	if (S_ISDIR(mode))
@@ -338,6 +363,17 @@ int ll_read(uint32_t ino, char *data, int size);
 
 void dump_inode(struct sfs_inode *ip);
 
+/* First data block; mkfs always allocates contiguously */
+uint32_t first_block(struct sfs_inode *ip)
+{
+	if (ip->i_flags & SFS_EXTENTS_FL) {
+		struct sfs_extent_header *eh = (void *)ip->i_blkaddr;
+
+		return ((struct sfs_extent *)(eh + 1))->ee_start;
+	}
+	return ip->i_blkaddr[0];
+}
+
 void sfs_add_dir_entry(struct sfs_inode *ip, char *name, uint32_t new_ino)
 {
 	uint32_t left = SFS_BLOCK_SIZE - ip->i_size;	
@@ -353,12 +389,27 @@ void sfs_add_dir_entry(struct sfs_inode *ip, char *name, uint32_t new_ino)
 		exit(1);
 	}
 
-	blk_no = ip->i_blkaddr[0] + (ip->i_size / SFS_BLOCK_SIZE); 
+	blk_no = first_block(ip) + (ip->i_size / SFS_BLOCK_SIZE); 
 	offset = ip->i_size % SFS_BLOCK_SIZE; 
 		
+	if (cfg.fs_features & SFS_FEATURE_VAR_DIRENT) {
+		struct sfs_dir_rec *dr = (struct sfs_dir_rec *)
+				((char *)bc_read(blk_no) + offset);
+
+		dr->dr_inode = new_ino;
+		dr->dr_rec_len = SFS_DIR_REC_LEN(strlen(name));
+		dr->dr_name_len = strlen(name);
+		dr->dr_type = (get_inode(new_ino)->i_mode & S_IFMT) >> 12;
+		memcpy(dr->dr_name, name, dr->dr_name_len);
+		ip->i_size += dr->dr_rec_len;
+		bc_write(blk_no, 0);
+		return;
+	}
 	dp = (struct sfs_dir_entry *) ((char *)bc_read(blk_no) + offset);	
-	strncpy(dp->de_name, name, SFS_MAX_NAME_LEN - 1);
-	dp->de_name[SFS_MAX_NAME_LEN - 1] = '\0';
+	strncpy(dp->de_name, name, sizeof(dp->de_name));
+	dp->de_type = 0;
+	if (cfg.fs_features & SFS_FEATURE_FILETYPE)
+		dp->de_type = (get_inode(new_ino)->i_mode & S_IFMT) >> 12;
 	dp->de_inode = new_ino;	
 
 	ip->i_size += sizeof(struct sfs_dir_entry);	
@@ -367,7 +418,7 @@ void sfs_add_dir_entry(struct sfs_inode *ip, char *name, uint32_t new_ino)
 
 void dump_inode(struct sfs_inode *ip)
 {
-	printf("ip->i_blkaddr[0] = %d\n", ip->i_blkaddr[0]);
+	printf("first block = %d\n", first_block(ip));
 	printf("ip->i_size = %d\n", ip->i_size);
 	printf("ip->i_mode = 0x%x\n", ip->i_mode);
 }
@@ -389,17 +440,189 @@ void make_rootdir()
 	//sfs_add_dir_entry(ip, ".trash", ll_mkdir(0));
 }
 
+static uint32_t count_zero_bits(uint32_t start, uint32_t blocks)
+{
+	uint32_t i, j, sum = 0;
+	unsigned char *p;
+
+	for (i = 0; i < blocks; i++) {
+		p = bc_read(start + i);
+		for (j = 0; j < SFS_BLOCK_SIZE; j++)
+			sum += 8 - __builtin_popcount(p[j]);
+	}
+	return sum;
+}
+
+/* Record the free counts so the first mount need not scan the bitmaps */
+void finish_super_block()
+{
+	struct sfs_super_block *sb = bc_read(SUPER_BLOCK_NO);
+
+	sb->s_free_blocks = count_zero_bits(BAM_BLOCK_START, cfg.fs_bam_blocks);
+	sb->s_free_inodes = count_zero_bits(IAM_BLOCK_START, cfg.fs_iam_blocks);
+	sb->s_state = SFS_STATE_VALID;
+	sb->s_journal_start = cfg.fs_journal_start;
+	sb->s_journal_blocks = cfg.fs_journal_blocks;
+	bc_write(SUPER_BLOCK_NO, 0);
+}
+
+/* The part of the jbd2 superblock mkfs fills in; all big endian */
+#define JBD2_MAGIC_NUMBER		0xc03b3998
+#define JBD2_SUPERBLOCK_V2		4
+#define JBD2_FEATURE_INCOMPAT_REVOKE	0x1
+#define JBD2_MIN_JOURNAL_BLOCKS		1024
+#define JBD2_MAX_JOURNAL_BLOCKS		16384	/* fits in one bitmap block */
+
+struct jbd2_super {
+	uint32_t	h_magic;
+	uint32_t	h_blocktype;
+	uint32_t	h_sequence;
+	uint32_t	s_blocksize;
+	uint32_t	s_maxlen;
+	uint32_t	s_first;
+	uint32_t	s_sequence;
+	uint32_t	s_start;	/* 0: nothing to replay */
+	uint32_t	s_errno;
+	uint32_t	s_feature_compat;
+	uint32_t	s_feature_incompat;
+	uint32_t	s_feature_ro_compat;
+	uint8_t		s_uuid[16];
+	uint32_t	s_nr_users;
+};
+
+/* Sets aside a zeroed, empty jbd2 log in the data zone */
+int make_journal()
+{
+	char buffer[SFS_BLOCK_SIZE];
+	struct jbd2_super *jsb = (struct jbd2_super *)buffer;
+	uint32_t blocks = cfg.fs_nblocks / 32, start, i;
+
+	if (blocks < JBD2_MIN_JOURNAL_BLOCKS)
+		blocks = JBD2_MIN_JOURNAL_BLOCKS;
+	if (blocks > JBD2_MAX_JOURNAL_BLOCKS)
+		blocks = JBD2_MAX_JOURNAL_BLOCKS;
+	start = allocate_blk(blocks);
+	if (start == INVALID_NO) {
+		printf("no room for a journal of %u blocks\n", blocks);
+		return -1;
+	}
+
+	memset(buffer, 0, SFS_BLOCK_SIZE);
+	for (i = 1; i < blocks; i++)
+		write_block(start + i, buffer);
+	jsb->h_magic = htonl(JBD2_MAGIC_NUMBER);
+	jsb->h_blocktype = htonl(JBD2_SUPERBLOCK_V2);
+	jsb->s_blocksize = htonl(SFS_BLOCK_SIZE);
+	jsb->s_maxlen = htonl(blocks);
+	jsb->s_first = htonl(1);
+	jsb->s_sequence = htonl(1);
+	jsb->s_feature_incompat = htonl(JBD2_FEATURE_INCOMPAT_REVOKE);
+	jsb->s_nr_users = htonl(1);
+	write_block(start, buffer);
+
+	cfg.fs_journal_start = start;
+	cfg.fs_journal_blocks = blocks;
+	printf("Journal = %u blocks at %u\n", blocks, start);
+	return 0;
+}
+
+struct feature {
+	const char	*name;
+	uint32_t	mask;
+};
+
+struct feature features[] = {
+	{ "dir_index",	SFS_FEATURE_DIR_INDEX },
+	{ "extents",	SFS_FEATURE_EXTENTS },
+	{ "inline_data",	SFS_FEATURE_INLINE_DATA },
+	{ "filetype",	SFS_FEATURE_FILETYPE },
+	{ "var_dirent",	SFS_FEATURE_VAR_DIRENT },
+	{ "journal",	SFS_FEATURE_JOURNAL },
+	{ "fast_symlink",	SFS_FEATURE_FAST_SYMLINK },
+	{ "block_count",	SFS_FEATURE_BLOCK_COUNT },
+	{ NULL,		0 }
+};
+
+int parse_features(char *list)
+{
+	char *name;
+	struct feature *f;
+
+	for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		for (f = features; f->name; f++)
+			if (!strcmp(f->name, name))
+				break;
+		if (!f->name) {
+			printf("unknown feature %s\n", name);
+			return -1;
+		}
+		cfg.fs_features |= f->mask;
+	}
+	return 0;
+}
+
+void usage(char *prog)
+{
+	struct feature *f;
+
+	printf("usage: %s [-O feature[,feature...]] [-I inode-size] device\n",
+		prog);
+	printf("features:");
+	for (f = features; f->name; f++)
+		printf(" %s", f->name);
+	printf("\n");
+}
+
 int main(int ac, char *av[])
 {
 	struct stat st;
 	char *block;
 	off_t size;
-
-	if (ac < 2) {
-		printf("error\n");
+	int opt;
+
+	while ((opt = getopt(ac, av, "O:I:")) != -1) {
+		switch (opt) {
+		case 'O':
+			if (parse_features(optarg) < 0) {
+				usage(av[0]);
+				exit(1);
+			}
+			break;
+		case 'I':
+			cfg.fs_inode_size = atoi(optarg);
+			break;
+		default:
+			usage(av[0]);
+			exit(1);
+		}
+	}
+	if (optind >= ac) {
+		usage(av[0]);
 		exit(1);
 	}
-	cfg.fs_fd = open(av[1], O_RDWR);
+	if ((cfg.fs_features & SFS_FEATURE_DIR_INDEX) &&
+	    (cfg.fs_features & SFS_FEATURE_VAR_DIRENT)) {
+		printf("dir_index cannot be used with var_dirent\n");
+		exit(1);
+	}
+	if ((cfg.fs_features & SFS_FEATURE_INLINE_DATA) &&
+	    (cfg.fs_features & SFS_FEATURE_JOURNAL)) {
+		printf("inline_data cannot be used with journal\n");
+		exit(1);
+	}
+	/* inline data lives after struct sfs_inode, so it needs room there */
+	if (!cfg.fs_inode_size)
+		cfg.fs_inode_size = (cfg.fs_features & SFS_FEATURE_INLINE_DATA) ?
+			2 * sizeof(struct sfs_inode) : sizeof(struct sfs_inode);
+	if (cfg.fs_inode_size < sizeof(struct sfs_inode) ||
+	    cfg.fs_inode_size > SFS_BLOCK_SIZE ||
+	    (cfg.fs_inode_size & (cfg.fs_inode_size - 1)) ||
+	    ((cfg.fs_features & SFS_FEATURE_INLINE_DATA) &&
+	     cfg.fs_inode_size == sizeof(struct sfs_inode))) {
+		printf("invalid inode size %u\n", cfg.fs_inode_size);
+		exit(1);
+	}
+	cfg.fs_fd = open(av[optind], O_RDWR);
 	if (cfg.fs_fd < 0) {
 		printf("file open error\n");
 		exit(2);
@@ -424,12 +647,19 @@ int main(int ac, char *av[])
 	printf("inode blocks = %Ld\n", (long long) cfg.fs_inode_blocks);
 	printf("Number of inodes = %Ld\n", (long long) cfg.fs_ninodes);
 	printf("Data block starts at %Ld block\n", (long long) cfg.fs_data_start); 
+	printf("Inode size = %u\n", cfg.fs_inode_size);
+	printf("Features = 0x%x\n", cfg.fs_features);
 
 	init_super_block(); 
 	init_block_alloc_map();
 	init_inode_alloc_map();
 	init_inode_list();
 	make_rootdir();
+	if ((cfg.fs_features & SFS_FEATURE_JOURNAL) && make_journal() < 0) {
+		bc_sync();
+		exit(1);
+	}
+	finish_super_block();
 	
 	bc_sync();
 	printf("Device write complete\n");